@@ -17,6 +17,7 @@
 #ifndef _LIBLMKD_UTILS_H_
 #define _LIBLMKD_UTILS_H_
 
+#include <stdbool.h>
 #include <sys/cdefs.h>
 #include <sys/types.h>
 
@@ -106,6 +107,57 @@ enum get_kill_count_err_result {
  */
 int lmkd_get_kill_count(int sock, struct lmk_getkillcnt* params);
 
+/*
+ * Subscribes for the memory pressure snapshot published by lmkd and maps it read-only. Should be
+ * called before subscribing the same socket for other asynchronous events.
+ * On success returns the mapped snapshot, to be read with lmkd_read_pressure_snapshot.
+ * On error, NULL is returned and errno is set appropriately.
+ */
+const struct lmk_pressure_snapshot* lmkd_map_pressure_snapshot(int sock);
+
+/*
+ * Unmaps the memory pressure snapshot mapped by lmkd_map_pressure_snapshot.
+ */
+void lmkd_unmap_pressure_snapshot(const struct lmk_pressure_snapshot* shared);
+
+/*
+ * Copies a consistent memory pressure snapshot without blocking lmkd.
+ * Returns false if lmkd did not evaluate memory pressure yet.
+ */
+bool lmkd_read_pressure_snapshot(const struct lmk_pressure_snapshot* shared,
+                                 struct lmk_pressure_snapshot* snapshot);
+
+/*
+ * Sends LMK_BATCH packet of batch_size bytes prepared with lmkd_pack_set_batch_header and
+ * lmkd_pack_add_batch. Commands are executed in order and their replies, if any, are sent back
+ * in one LMK_BATCH packet to be received with lmkd_recv_batch_replies.
+ * On success returns 0.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int lmkd_send_batch(int sock, LMKD_BATCH_PACKET batch, size_t batch_size);
+
+/*
+ * Receives replies of the commands sent with lmkd_send_batch. Replies are iterated over with
+ * lmkd_pack_get_batch_next.
+ * On success returns size of the received packet in bytes.
+ * On error, -1 is returned and errno is set appropriately.
+ */
+int lmkd_recv_batch_replies(int sock, LMKD_BATCH_PACKET replies);
+
+enum get_latency_hist_result {
+    GET_LATENCY_HIST_SUCCESS,
+    GET_LATENCY_HIST_SEND_ERR,
+    GET_LATENCY_HIST_RECV_ERR,
+    GET_LATENCY_HIST_FORMAT_ERR,
+};
+
+/*
+ * Get the latency histogram of a memory pressure handling stage.
+ * In the case of SEND_ERR or RECV_ERR errno is set appropriately.
+ */
+enum get_latency_hist_result lmkd_get_latency_hist(int sock, enum lmk_latency_stage stage,
+                                                   struct lmk_getlatencyhist_reply* reply);
+
 __END_DECLS
 
 #endif /* _LIBLMKD_UTILS_H_ */
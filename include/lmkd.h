@@ -18,6 +18,8 @@
 #define _LMKD_H_
 
 #include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/cdefs.h>
 #include <sys/types.h>
 
@@ -39,6 +41,11 @@ enum lmk_cmd {
     LMK_START_MONITORING,   /* Start psi monitoring if it was skipped earlier */
     LMK_BOOT_COMPLETED,     /* Notify LMKD boot is completed */
     LMK_PROCS_PRIO,         /* Register processes and set the same oom_adj_score */
+    LMK_GETLATENCYHIST,     /* Get latency histogram of a memory pressure handling stage */
+    LMK_STAT_KILL_LATENCY,  /* Unsolicited msg to subscribed clients on kill latencies */
+    LMK_PRESSURE_SNAPSHOT,  /* Msg carrying the pressure snapshot memfd to a subscribed client */
+    LMK_BATCH,              /* Several commands in one packet */
+    LMK_STAT_KILL_EFFICACY, /* Unsolicited msg to subscribed clients on memory freed by kills */
 };
 
 /*
@@ -66,6 +73,69 @@ static inline enum lmk_cmd lmkd_pack_get_cmd(LMKD_CTRL_PACKET pack) {
     return (enum lmk_cmd)ntohl(pack[0]);
 }
 
+/*
+ * LMK_BATCH packet carries several commands in one message: LMK_BATCH, number of commands and
+ * then each command packet preceded by its size in bytes. Replies of the commands that have them
+ * are sent back in one LMK_BATCH packet of the same format, in the order of the commands.
+ */
+#define LMK_BATCH_MAX_CMDS 16
+#define LMK_BATCH_HEADER_SIZE (sizeof(int) * 2)
+#define LMK_BATCH_MAX_SIZE \
+    (LMK_BATCH_HEADER_SIZE + LMK_BATCH_MAX_CMDS * (sizeof(int) + CTRL_PACKET_MAX_SIZE))
+
+typedef int LMKD_BATCH_PACKET[LMK_BATCH_MAX_SIZE / sizeof(int)];
+
+/*
+ * Prepare LMK_BATCH packet header for cmd_count commands and return its size in bytes.
+ * Warning: no checks performed, caller should ensure valid parameters.
+ */
+static inline size_t lmkd_pack_set_batch_header(int* batch, int cmd_count) {
+    batch[0] = htonl(LMK_BATCH);
+    batch[1] = htonl(cmd_count);
+    return LMK_BATCH_HEADER_SIZE;
+}
+
+/*
+ * Append a command packet of size bytes to LMK_BATCH packet of batch_size bytes.
+ * Returns the new batch size in bytes or 0 if the command does not fit.
+ */
+static inline size_t lmkd_pack_add_batch(LMKD_BATCH_PACKET batch, size_t batch_size,
+                                         LMKD_CTRL_PACKET packet, size_t size) {
+    int cmd_count = ntohl(batch[1]);
+
+    if (size < sizeof(int) || size > CTRL_PACKET_MAX_SIZE || size % sizeof(int) ||
+        cmd_count >= LMK_BATCH_MAX_CMDS || batch_size + sizeof(int) + size > LMK_BATCH_MAX_SIZE) {
+        return 0;
+    }
+    batch[batch_size / sizeof(int)] = htonl(size);
+    memcpy(&batch[batch_size / sizeof(int) + 1], packet, size);
+    batch[1] = htonl(cmd_count + 1);
+    return batch_size + sizeof(int) + size;
+}
+
+/*
+ * Copy the command packet at *offset of LMK_BATCH packet of batch_size bytes and advance *offset
+ * to the next one. *offset should be LMK_BATCH_HEADER_SIZE for the first command.
+ * Returns the command size in bytes, 0 if there are no more commands or -1 if the packet is
+ * malformed.
+ */
+static inline int lmkd_pack_get_batch_next(LMKD_BATCH_PACKET batch, size_t batch_size,
+                                           size_t* offset, LMKD_CTRL_PACKET packet) {
+    size_t size;
+
+    if (*offset + sizeof(int) > batch_size) {
+        return *offset == batch_size ? 0 : -1;
+    }
+    size = ntohl(batch[*offset / sizeof(int)]);
+    if (size < sizeof(int) || size > CTRL_PACKET_MAX_SIZE || size % sizeof(int) ||
+        *offset + sizeof(int) + size > batch_size) {
+        return -1;
+    }
+    memcpy(packet, &batch[*offset / sizeof(int) + 1], size);
+    *offset += sizeof(int) + size;
+    return (int)size;
+}
+
 /* LMK_TARGET packet payload */
 struct lmk_target {
     int minfree;
@@ -215,11 +285,112 @@ static inline size_t lmkd_pack_set_getkillcnt_repl(LMKD_CTRL_PACKET packet, int
     return 2 * sizeof(int);
 }
 
+/* Stages of memory pressure handling tracked with latency histograms */
+enum lmk_latency_stage {
+    LMK_LATENCY_EVENT,      /* event wakeup to pressure handler entry */
+    LMK_LATENCY_PARSE,      /* reading and parsing of memory state files */
+    LMK_LATENCY_SELECT,     /* victim selection */
+    LMK_LATENCY_REAP,       /* kill request to process_mrelease completion or to the signal
+                               for processes which are not reaped */
+    LMK_LATENCY_EXIT,       /* kill request to process exit notification */
+    LMK_LATENCY_STAGE_COUNT,
+};
+
+/*
+ * Number of latency histogram buckets. LMK_GETLATENCYHIST reply carries the command, the stage
+ * and all buckets, so it should fit into CTRL_PACKET_MAX_SIZE.
+ */
+#define LMK_LATENCY_BUCKET_COUNT 11
+
+/*
+ * Returns the upper bound in microseconds of a latency histogram bucket. The last bucket has no
+ * upper bound.
+ */
+static inline unsigned int lmkd_latency_bucket_limit_us(int bucket) {
+    static const unsigned int limits_us[LMK_LATENCY_BUCKET_COUNT - 1] = {
+        100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000
+    };
+    return bucket < LMK_LATENCY_BUCKET_COUNT - 1 ? limits_us[bucket] : (unsigned int)-1;
+}
+
+/* Returns the index of the latency histogram bucket to count latency_us in. */
+static inline int lmkd_latency_bucket(unsigned long latency_us) {
+    int bucket = 0;
+
+    while (bucket < LMK_LATENCY_BUCKET_COUNT - 1 &&
+           latency_us >= lmkd_latency_bucket_limit_us(bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+/* LMK_GETLATENCYHIST packet payload */
+struct lmk_getlatencyhist {
+    enum lmk_latency_stage stage;
+};
+
+/* LMK_GETLATENCYHIST reply payload, stage is -1 if the requested stage is invalid */
+struct lmk_getlatencyhist_reply {
+    int stage;
+    unsigned int buckets[LMK_LATENCY_BUCKET_COUNT];
+};
+
+/*
+ * For LMK_GETLATENCYHIST packet get its payload.
+ * Warning: no checks performed, caller should ensure valid parameters.
+ */
+static inline void lmkd_pack_get_getlatencyhist(LMKD_CTRL_PACKET packet,
+                                                struct lmk_getlatencyhist* params) {
+    params->stage = (enum lmk_latency_stage)ntohl(packet[1]);
+}
+
+/*
+ * Prepare LMK_GETLATENCYHIST packet and return packet size in bytes.
+ * Warning: no checks performed, caller should ensure valid parameters.
+ */
+static inline size_t lmkd_pack_set_getlatencyhist(LMKD_CTRL_PACKET packet,
+                                                  struct lmk_getlatencyhist* params) {
+    packet[0] = htonl(LMK_GETLATENCYHIST);
+    packet[1] = htonl((int)params->stage);
+    return 2 * sizeof(int);
+}
+
+/*
+ * Prepare LMK_GETLATENCYHIST reply packet and return packet size in bytes.
+ * Warning: no checks performed, caller should ensure valid parameters.
+ */
+static inline size_t lmkd_pack_set_getlatencyhist_repl(LMKD_CTRL_PACKET packet,
+                                                       struct lmk_getlatencyhist_reply* params) {
+    int idx = 0;
+
+    packet[idx++] = htonl(LMK_GETLATENCYHIST);
+    packet[idx++] = htonl(params->stage);
+    for (int i = 0; i < LMK_LATENCY_BUCKET_COUNT; i++) {
+        packet[idx++] = htonl(params->buckets[i]);
+    }
+    return idx * sizeof(int);
+}
+
+/*
+ * For LMK_GETLATENCYHIST reply payload.
+ * Warning: no checks performed, caller should ensure valid parameters.
+ */
+static inline void lmkd_pack_get_getlatencyhist_repl(LMKD_CTRL_PACKET packet,
+                                                     struct lmk_getlatencyhist_reply* params) {
+    params->stage = ntohl(packet[1]);
+    for (int i = 0; i < LMK_LATENCY_BUCKET_COUNT; i++) {
+        params->buckets[i] = ntohl(packet[i + 2]);
+    }
+}
+
 /* Types of asynchronous events sent from lmkd to its clients */
 enum async_event_type {
     LMK_ASYNC_EVENT_FIRST,
     LMK_ASYNC_EVENT_KILL = LMK_ASYNC_EVENT_FIRST,
     LMK_ASYNC_EVENT_STAT,
+    LMK_ASYNC_EVENT_LATENCY,
+    LMK_ASYNC_EVENT_PRESSURE_SNAPSHOT,
+    LMK_ASYNC_EVENT_EFFICACY,
     LMK_ASYNC_EVENT_COUNT,
 };
 
@@ -246,6 +417,76 @@ static inline size_t lmkd_pack_set_subscribe(LMKD_CTRL_PACKET packet, enum async
     return 2 * sizeof(int);
 }
 
+/*
+ * Memory pressure state computed by lmkd on each evaluation, published into a memfd that clients
+ * subscribed to LMK_ASYNC_EVENT_PRESSURE_SNAPSHOT map read-only. The fd is sent with
+ * LMK_PRESSURE_SNAPSHOT message as SCM_RIGHTS ancillary data.
+ * seq is odd while lmkd updates the snapshot, readers should retry until they copy the snapshot
+ * with the same even seq before and after the copy. seq is 0 until the first evaluation. New
+ * fields are only appended and size is increased, version changes only if existing fields change
+ * their meaning.
+ * An evaluation skipped because a kill is in progress or the system is not reclaiming reports no
+ * breached watermark and no kill_reason, the fields it did not read are zero.
+ * Memory sizes are in kB.
+ */
+#define LMK_PRESSURE_SNAPSHOT_VERSION 1
+
+struct lmk_pressure_snapshot {
+    uint32_t seq;
+    uint32_t version;
+    uint32_t size;
+    int32_t level;            /* enum vmpressure_level of the evaluated event */
+    int64_t timestamp_ms;     /* CLOCK_MONOTONIC time of the evaluation */
+    int32_t wmark;            /* lowest breached watermark: 0 - min, 1 - low, 2 - high, 3 - none */
+    int32_t reclaim;          /* 0 - none, 1 - kswapd, 2 - direct, 3 - direct and throttled */
+    int32_t in_compaction;
+    int32_t critical_stall;
+    int32_t thrashing;        /* % of file-backed pagecache refaulted */
+    int32_t max_thrashing;
+    int32_t thrashing_limit;
+    int32_t swap_util;        /* % of swappable memory that is swapped out */
+    int32_t kill_reason;      /* enum kill_reasons decided by this evaluation, -1 if none */
+    int32_t min_score_adj;    /* lowest oom_score_adj allowed to be killed */
+    int64_t free_kb;
+    int64_t cma_free_kb;
+    int64_t file_lru_kb;
+    int64_t free_swap_kb;
+    int64_t total_swap_kb;
+    int64_t min_wmark_kb;
+    int64_t low_wmark_kb;
+    int64_t high_wmark_kb;
+    float psi_some_avg10;
+    float psi_full_avg10;
+};
+
+/*
+ * Prepare LMK_PRESSURE_SNAPSHOT packet and return packet size in bytes.
+ * Warning: no checks performed, caller should ensure valid parameters.
+ */
+static inline size_t lmkd_pack_set_pressure_snapshot(LMKD_CTRL_PACKET packet, uint32_t version,
+                                                     uint32_t size) {
+    packet[0] = htonl(LMK_PRESSURE_SNAPSHOT);
+    packet[1] = htonl(version);
+    packet[2] = htonl(size);
+    return 3 * sizeof(int);
+}
+
+/* LMK_PRESSURE_SNAPSHOT packet payload */
+struct lmk_pressure_snapshot_info {
+    uint32_t version;
+    uint32_t size;
+};
+
+/*
+ * For LMK_PRESSURE_SNAPSHOT packet get its payload.
+ * Warning: no checks performed, caller should ensure valid parameters.
+ */
+static inline void lmkd_pack_get_pressure_snapshot(LMKD_CTRL_PACKET packet,
+                                                   struct lmk_pressure_snapshot_info* params) {
+    params->version = ntohl(packet[1]);
+    params->size = ntohl(packet[2]);
+}
+
 /**
  * Prepare LMK_PROCKILL unsolicited packet and return packet size in bytes.
  * Warning: no checks performed, caller should ensure valid parameters.
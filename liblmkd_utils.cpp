@@ -16,7 +16,11 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <string.h>
 #include <sys/cdefs.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdio.h>
@@ -150,6 +154,122 @@ int lmkd_get_kill_count(int sock, struct lmk_getkillcnt* params) {
     return packet[1];
 }
 
+int lmkd_send_batch(int sock, LMKD_BATCH_PACKET batch, size_t batch_size) {
+    return TEMP_FAILURE_RETRY(write(sock, batch, batch_size)) < 0 ? -1 : 0;
+}
+
+int lmkd_recv_batch_replies(int sock, LMKD_BATCH_PACKET replies) {
+    int size;
+
+    size = TEMP_FAILURE_RETRY(read(sock, replies, LMK_BATCH_MAX_SIZE));
+    if (size < 0) {
+        return -1;
+    }
+
+    if (size < (int)LMK_BATCH_HEADER_SIZE || lmkd_pack_get_cmd(replies) != LMK_BATCH) {
+        errno = EPROTO;
+        return -1;
+    }
+    return size;
+}
+
+enum get_latency_hist_result lmkd_get_latency_hist(int sock, enum lmk_latency_stage stage,
+                                                   struct lmk_getlatencyhist_reply* reply) {
+    LMKD_CTRL_PACKET packet;
+    struct lmk_getlatencyhist params = { .stage = stage };
+    int size;
+
+    size = lmkd_pack_set_getlatencyhist(packet, &params);
+    if (TEMP_FAILURE_RETRY(write(sock, packet, size)) < 0) {
+        return GET_LATENCY_HIST_SEND_ERR;
+    }
+
+    size = TEMP_FAILURE_RETRY(read(sock, packet, CTRL_PACKET_MAX_SIZE));
+    if (size < 0) {
+        return GET_LATENCY_HIST_RECV_ERR;
+    }
+
+    if (size != (LMK_LATENCY_BUCKET_COUNT + 2) * sizeof(int) ||
+        lmkd_pack_get_cmd(packet) != LMK_GETLATENCYHIST) {
+        return GET_LATENCY_HIST_FORMAT_ERR;
+    }
+
+    lmkd_pack_get_getlatencyhist_repl(packet, reply);
+    return reply->stage == (int)stage ? GET_LATENCY_HIST_SUCCESS : GET_LATENCY_HIST_FORMAT_ERR;
+}
+
+const struct lmk_pressure_snapshot* lmkd_map_pressure_snapshot(int sock) {
+    LMKD_CTRL_PACKET packet;
+    struct lmk_pressure_snapshot_info info;
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {packet, CTRL_PACKET_MAX_SIZE};
+    struct msghdr hdr = {
+            NULL, 0, &iov, 1, cmsg_buf, sizeof(cmsg_buf), 0,
+    };
+    struct cmsghdr* cmsg;
+    void* snapshot;
+    int size;
+    int fd = -1;
+
+    size = lmkd_pack_set_subscribe(packet, LMK_ASYNC_EVENT_PRESSURE_SNAPSHOT);
+    if (TEMP_FAILURE_RETRY(write(sock, packet, size)) < 0) {
+        return NULL;
+    }
+
+    size = TEMP_FAILURE_RETRY(recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC));
+    if (size < 0) {
+        return NULL;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+            break;
+        }
+    }
+    if (fd < 0) {
+        errno = EPROTO;
+        return NULL;
+    }
+    if (size != 3 * sizeof(int) || lmkd_pack_get_cmd(packet) != LMK_PRESSURE_SNAPSHOT) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    lmkd_pack_get_pressure_snapshot(packet, &info);
+    if (info.version != LMK_PRESSURE_SNAPSHOT_VERSION ||
+        info.size < sizeof(struct lmk_pressure_snapshot)) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    snapshot = mmap(NULL, sizeof(struct lmk_pressure_snapshot), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return snapshot == MAP_FAILED ? NULL : static_cast<struct lmk_pressure_snapshot*>(snapshot);
+}
+
+void lmkd_unmap_pressure_snapshot(const struct lmk_pressure_snapshot* shared) {
+    munmap(const_cast<struct lmk_pressure_snapshot*>(shared), sizeof(*shared));
+}
+
+bool lmkd_read_pressure_snapshot(const struct lmk_pressure_snapshot* shared,
+                                 struct lmk_pressure_snapshot* snapshot) {
+    uint32_t seq;
+
+    do {
+        while ((seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+        memcpy(snapshot, shared, sizeof(*snapshot));
+        /* Make sure the copy is done before seq is checked again */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) != seq);
+
+    return seq != 0;
+}
+
 int create_memcg(uid_t uid, pid_t pid) {
     return createProcessGroup(uid, pid, true) == 0 ? 0 : -1;
 }
@@ -84,6 +84,57 @@ int unregister_psi_monitor(int epollfd, int fd);
  */
 void destroy_psi_monitor(int fd);
 
+#define PSI_GROUP_MAX_TRIGGERS 16
+
+struct psi_trigger {
+    enum psi_resource resource;
+    enum psi_stall_type stall_type;
+    int threshold_us;
+    int window_us;
+};
+
+/*
+ * Set of psi monitors registered on one epoll instance, possibly several per resource with
+ * different thresholds and windows. Triggers are referred to by the index returned when they
+ * are added, which stays valid until they are removed.
+ */
+struct psi_monitor_group {
+    int epollfd;
+    struct psi_trigger triggers[PSI_GROUP_MAX_TRIGGERS];
+    int fds[PSI_GROUP_MAX_TRIGGERS];
+    void* data[PSI_GROUP_MAX_TRIGGERS];
+};
+
+/*
+ * Initializes an empty monitor group whose monitors will be registered
+ * on the epoll instance referred to by epollfd.
+ */
+void psi_group_init(struct psi_monitor_group* group, int epollfd);
+
+/*
+ * Creates a monitor for the trigger and registers it with data associated
+ * with its events. Returns the trigger index or -1 with errno set.
+ */
+int psi_group_add(struct psi_monitor_group* group, const struct psi_trigger* trigger, void* data);
+
+/*
+ * Changes the threshold and window of a trigger. The new monitor is created
+ * and registered before the old one is destroyed so that stalls are monitored
+ * throughout the change; on failure the old monitor is kept. Returns 0 on
+ * success or -1 with errno set.
+ */
+int psi_group_update(struct psi_monitor_group* group, int idx, int threshold_us, int window_us);
+
+/*
+ * Unregisters and destroys the monitor of a trigger.
+ */
+void psi_group_remove(struct psi_monitor_group* group, int idx);
+
+/*
+ * Removes all triggers of the group.
+ */
+void psi_group_destroy(struct psi_monitor_group* group);
+
 /*
  * Parse psi file line content. Expected file format is:
  *    some avg10=0.00 avg60=0.00 avg300=0.00 total=0
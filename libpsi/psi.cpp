@@ -106,6 +106,99 @@ void destroy_psi_monitor(int fd) {
     }
 }
 
+void psi_group_init(struct psi_monitor_group* group, int epollfd) {
+    group->epollfd = epollfd;
+    for (int i = 0; i < PSI_GROUP_MAX_TRIGGERS; i++) {
+        group->fds[i] = -1;
+        group->data[i] = NULL;
+    }
+}
+
+static int psi_group_create(struct psi_monitor_group* group, const struct psi_trigger* trigger,
+                            void* data) {
+    int fd = init_psi_monitor(trigger->stall_type, trigger->threshold_us, trigger->window_us,
+                              trigger->resource);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (register_psi_monitor(group->epollfd, fd, data) < 0) {
+        destroy_psi_monitor(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int psi_group_add(struct psi_monitor_group* group, const struct psi_trigger* trigger, void* data) {
+    int idx;
+    int fd;
+
+    for (idx = 0; idx < PSI_GROUP_MAX_TRIGGERS && group->fds[idx] >= 0; idx++)
+        ;
+    if (idx == PSI_GROUP_MAX_TRIGGERS) {
+        ALOGE("Too many psi triggers in the group");
+        errno = ENOSPC;
+        return -1;
+    }
+
+    fd = psi_group_create(group, trigger, data);
+    if (fd < 0) {
+        return -1;
+    }
+    group->triggers[idx] = *trigger;
+    group->fds[idx] = fd;
+    group->data[idx] = data;
+    return idx;
+}
+
+int psi_group_update(struct psi_monitor_group* group, int idx, int threshold_us, int window_us) {
+    struct psi_trigger trigger;
+    int fd;
+
+    if (idx < 0 || idx >= PSI_GROUP_MAX_TRIGGERS || group->fds[idx] < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    trigger = group->triggers[idx];
+    if (trigger.threshold_us == threshold_us && trigger.window_us == window_us) {
+        return 0;
+    }
+    trigger.threshold_us = threshold_us;
+    trigger.window_us = window_us;
+    fd = psi_group_create(group, &trigger, group->data[idx]);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (unregister_psi_monitor(group->epollfd, group->fds[idx]) < 0) {
+        ALOGE("Failed to unregister psi monitor; errno=%d", errno);
+    }
+    destroy_psi_monitor(group->fds[idx]);
+    group->triggers[idx] = trigger;
+    group->fds[idx] = fd;
+    return 0;
+}
+
+void psi_group_remove(struct psi_monitor_group* group, int idx) {
+    if (idx < 0 || idx >= PSI_GROUP_MAX_TRIGGERS || group->fds[idx] < 0) {
+        return;
+    }
+
+    if (unregister_psi_monitor(group->epollfd, group->fds[idx]) < 0) {
+        ALOGE("Failed to unregister psi monitor; errno=%d", errno);
+    }
+    destroy_psi_monitor(group->fds[idx]);
+    group->fds[idx] = -1;
+    group->data[idx] = NULL;
+}
+
+void psi_group_destroy(struct psi_monitor_group* group) {
+    for (int i = 0; i < PSI_GROUP_MAX_TRIGGERS; i++) {
+        psi_group_remove(group, i);
+    }
+}
+
 int parse_psi_line(char *line, enum psi_stall_type stall_type, struct psi_stats stats[]) {
     char type_name[5];
     struct psi_stats *stat = &stats[stall_type];
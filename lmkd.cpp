@@ -21,6 +21,7 @@
 #include <dirent.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <pwd.h>
 #include <sched.h>
@@ -32,16 +33,24 @@
 #include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/pidfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/sysinfo.h>
+#include <sys/system_properties.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <bpf/KernelUtils.h>
@@ -61,6 +70,7 @@
 #include <psi/psi.h>
 #include <system/thread_defs.h>
 
+#include "lmkd_replay.h"
 #include "reaper.h"
 #include "statslog.h"
 #include "watchdog.h"
@@ -85,10 +95,15 @@ static inline void trace_kill_end() {
     ATRACE_END();
 }
 
+static inline void trace_latency(const char *name, long latency_us) {
+    ATRACE_INT(name, latency_us);
+}
+
 #else /* LMKD_TRACE_KILLS */
 
 static inline void trace_kill_start(const char *) {}
 static inline void trace_kill_end() {}
+static inline void trace_latency(const char *, long) {}
 
 #endif /* LMKD_TRACE_KILLS */
 
@@ -104,6 +119,12 @@ static inline void trace_kill_end() {}
 #define TRACE_MARKER_PATH "/sys/kernel/tracing/trace_marker"
 #define PROC_STATUS_RSS_FIELD "VmRSS:"
 #define PROC_STATUS_SWAP_FIELD "VmSwap:"
+#define PROC_STATUS_RSS_FILE_FIELD "RssFile:"
+#define PROC_STATUS_RSS_ANON_FIELD "RssAnon:"
+#define PROC_STATUS_RSS_SHMEM_FIELD "RssShmem:"
+#define ZRAM_MM_STAT_PATH "/sys/block/zram0/mm_stat"
+#define COMPACT_MEMORY_PATH "/proc/sys/vm/compact_memory"
+#define NODE_COMPACT_PATH_FMT "/sys/devices/system/node/node%d/compact"
 #define MAX_NR_ZONES 6
 
 #define PERCEPTIBLE_APP_ADJ 200
@@ -125,6 +146,7 @@ static inline void trace_kill_end() {}
 
 #define NS_PER_MS (NS_PER_SEC / MS_PER_SEC)
 #define US_PER_MS (US_PER_SEC / MS_PER_SEC)
+#define NS_PER_US (NS_PER_SEC / US_PER_SEC)
 
 /* Defined as ProcessList.SYSTEM_ADJ in ProcessList.java */
 #define SYSTEM_ADJ (-900)
@@ -140,9 +162,49 @@ static inline void trace_kill_end() {}
  * can be controlled by an experiment then use GET_LMK_PROPERTY instead of property_get_xxx and
  * add "on property" triggers in lmkd.rc to react to the experiment flag changes.
  */
+#ifdef LMKD_REPLAY
+/* Overrides given on the lmkd_replay command line take precedence */
+#define GET_LMK_PROPERTY(type, name, def) \
+    lmkd_replay_property_##type(name, \
+        property_get_##type("persist.device_config.lmkd_native." name, \
+            property_get_##type("ro.lmk." name, def)))
+#else
 #define GET_LMK_PROPERTY(type, name, def) \
-    property_get_##type("persist.device_config.lmkd_native." name, \
-        property_get_##type("ro.lmk." name, def))
+    (watch_lmk_property("persist.device_config.lmkd_native." name), \
+     watch_lmk_property("ro.lmk." name), \
+     property_get_##type("persist.device_config.lmkd_native." name, \
+        property_get_##type("ro.lmk." name, def)))
+
+/*
+ * Serials of the properties read with GET_LMK_PROPERTY, recorded before their values are read so
+ * that a change made while reading them is seen next time. Other properties lmkd reads are ro.*
+ * properties which do not change once set at boot. Main thread only.
+ */
+struct watched_property {
+    const prop_info *pi; /* NULL while the property does not exist */
+    uint32_t serial;
+};
+static std::unordered_map<std::string, struct watched_property> watched_properties;
+
+static void watch_lmk_property(const char *name) {
+    const prop_info *pi = __system_property_find(name);
+
+    watched_properties[name] = { pi, pi ? __system_property_serial(pi) : 0 };
+}
+
+/* Returns true if a watched property was set or created since its value was last read */
+static bool watched_properties_changed() {
+    for (auto& [name, prop] : watched_properties) {
+        const prop_info *pi = prop.pi ? prop.pi : __system_property_find(name.c_str());
+
+        if (pi && (!prop.pi || __system_property_serial(pi) != prop.serial)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+#endif
 
 /*
  * PSI monitor tracking window size.
@@ -159,6 +221,70 @@ static inline void trace_kill_end() {}
 #define FAIL_REPORT_RLIMIT_MS 1000
 
 #define PSI_PROC_TRAVERSE_DELAY_MS 200
+
+/* Number of memory pressure checks kept to predict when free memory runs out */
+#define PRESSURE_SAMPLE_COUNT 8
+/* Min number of samples and their min time span required for a prediction */
+#define PRESSURE_SAMPLE_MIN 4
+#define PRESSURE_SAMPLE_MIN_SPAN_MS 100
+/* Samples further apart than this are not considered a trend */
+#define PRESSURE_SAMPLE_MAX_GAP_MS (PSI_POLL_PERIOD_LONG_MS * 2)
+/* Number of times adaptive polling checks memory before it can run out at the recent rate */
+#define ADAPTIVE_POLL_CHECKS 4
+
+/* ro.lmk.memcg_reclaim_* property defaults */
+#define DEF_MEMCG_RECLAIM_BUDGET_MS 20
+#define DEF_MEMCG_RECLAIM_SWAP_UTIL_MAX 50
+/* Min time before memcg reclaim is requested again from the same process */
+#define MEMCG_RECLAIM_INTERVAL_MS 10000
+/* Max memory asked for by one memory.reclaim write, the write reclaims synchronously */
+#define MEMCG_RECLAIM_CHUNK_KB 4096
+
+/* Medium and critical level psi threshold tuning by ro.lmk.psi_auto_tune */
+#define PSI_TUNE_PERIOD_MS 60000
+#define PSI_TUNE_MIN_EVENTS 10
+#define PSI_TUNE_STEP_MS 10
+#define PSI_TUNE_MAX_SAMPLES 64
+/* Window of the sustained medium pressure trigger added by ro.lmk.psi_auto_tune, psi's longest */
+#define PSI_TUNE_LONG_WINDOW_MS 10000
+
+/* ro.lmk.kill_cost_file_pct property defaults */
+#define DEF_KILL_COST_FILE_PCT 50
+/* Min time between reads of the zram compression ratio used by the kill cost model */
+#define ZRAM_STAT_INTERVAL_MS 10000
+
+/* Max number of app uids which kill efficacy is remembered for */
+#define KILL_EFFICACY_MAX_UIDS 512
+/* Moving average weight of the latest kill efficacy sample is 1/KILL_EFFICACY_EWMA_DIV */
+#define KILL_EFFICACY_EWMA_DIV 4
+/* Efficacy is not assumed below this percentage to keep ranking victims by their size */
+#define KILL_EFFICACY_MIN_PCT 10
+/* Efficacy averages are kept in thousandths of a percent so that small corrections add up */
+#define KILL_EFFICACY_SCALE 1000
+#define KILL_EFFICACY_FULL (100 * KILL_EFFICACY_SCALE)
+/* Kills taking longer to free their memory are measured with too much unrelated activity */
+#define KILL_EFFICACY_MAX_SAMPLE_MS 1000
+/* Time for the gap of a uid kill efficacy to 100% to halve when it is not sampled again */
+#define KILL_EFFICACY_HALF_LIFE_MS 600000
+
+/* ro.lmk.compaction_wait_ms property defaults */
+#define DEF_COMPACTION_WAIT_MS 1000
+/* Time kills are not held off for compaction after it failed to resolve fragmentation */
+#define COMPACTION_BACKOFF_MS 60000
+
+/* Time a worker thread sleeps after failing to wait on its eventfd */
+#define WORKER_WAIT_RETRY_MS 1000
+
+/* Max number of native processes tracked for kills on userdebug and eng builds */
+#define NATIVE_INDEX_SIZE 64
+/* Max number of /proc entries looked at per native process index scan */
+#define NATIVE_INDEX_SCAN_COUNT 32
+/* Max number of /proc entries looked at by a kill attempt which found no indexed process */
+#define NATIVE_INDEX_KILL_SCAN_COUNT 256
+
+/* Max number of stale process size cache entries refreshed per polling cycle */
+#define PROC_SIZE_CACHE_REFRESH_COUNT 8
+#define NUMA_MAPS_BUF_SIZE 4096
 /*
  * System property defaults
  */
@@ -183,6 +309,10 @@ static inline void trace_kill_end() {}
 #define DEF_SWAP_COMP_RATIO 1
 /* ro.lmk.lowmem_min_oom_score defaults */
 #define DEF_LOWMEM_MIN_SCORE (PREVIOUS_APP_ADJ + 1)
+/* ro.lmk.proc_size_cache_ms property defaults */
+#define DEF_PROC_SIZE_CACHE_MS 1000
+/* ro.lmk.proc_pool_size property defaults */
+#define DEF_PROC_POOL_SIZE 512
 
 #define PSI_CONT_EVENT_THRESH (4)
 #define LMKD_REINIT_PROP "lmkd.reinit"
@@ -191,6 +321,9 @@ static inline void trace_kill_end() {}
 
 #define NATIVE_PID_FD (-128)
 
+/* Max number of other processes killed with a victim when ro.lmk.kill_uid_group is set */
+#define UID_GROUP_MAX_PROCS 16
+
 //#define ENABLE_TRACING
 
 /* default to old in-kernel interface if no memory pressure events */
@@ -228,16 +361,66 @@ static std::unique_ptr<android::bpf::memevents::MemEventListener> memevent_liste
 static struct timespec direct_reclaim_start_tm;
 static struct timespec kswapd_start_tm;
 
-/* io_uring for LMK_PROCS_PRIO */
+/* io_uring for LMK_PROCS_PRIO, created once in init() */
 static struct io_uring lmk_io_uring_ring;
+static bool lmk_io_uring_ring_initialized;
 /* IO_URING_OP_READ/WRITE opcodes were introduced only on 5.6 kernel */
 static const bool isIoUringSupported = android::bpf::isAtLeastKernelVersion(5, 6, 0);
+/* Opening and closing into direct descriptors is supported only starting from 5.15 kernel */
+static const bool isIoUringDirectFdSupported = android::bpf::isAtLeastKernelVersion(5, 15, 0);
+static bool lmk_io_uring_direct_fds;
+
+/* io_uring for memory state snapshots taken by mp_event_psi() */
+static struct io_uring snapshot_ring;
+static bool snapshot_ring_initialized;
 
 static int mpevfd[VMPRESS_LEVEL_COUNT] = { -1, -1, -1, -1 };
 static bool pidfd_supported;
 static int last_kill_pid_or_fd = -1;
 static struct timespec last_kill_tm;
+/* CLOCK_MONOTONIC time of the last kill request, used for LMK_LATENCY_EXIT */
+static struct timespec last_kill_request_tm;
+/* CLOCK_MONOTONIC time of the last wakeup caused by events, used for LMK_LATENCY_EVENT */
+static struct timespec event_wakeup_tm;
+/* Histograms of the stages run by the main thread, LMK_LATENCY_REAP one is kept by the reaper */
+static unsigned int latency_hist[LMK_LATENCY_STAGE_COUNT][LMK_LATENCY_BUCKET_COUNT];
+/* Latencies of the pressure event being handled and of the last kill it resulted in */
+static struct kill_latency_stat pressure_latency_st;
+static struct kill_latency_stat kill_latency_st;
+/* Memory freed by the last kill, measured once the killed process exits */
+static struct kill_efficacy_stat kill_efficacy_st;
+static bool kill_efficacy_pending;
+static int64_t kill_efficacy_base_free;
+static int64_t kill_efficacy_base_swap;
+static struct timespec kill_efficacy_base_tm;
+/* Moving average of the part of their estimated size the kills of an app uid freed */
+struct uid_efficacy {
+    /* In KILL_EFFICACY_SCALE units of a percent */
+    int scaled_pct;
+    /* Time of the last sample, the average decays toward 100% from it */
+    struct timespec tm;
+};
+static std::unordered_map<uid_t, struct uid_efficacy> uid_kill_efficacy;
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+/* Pressure snapshot shared with clients, created on the first subscription */
+static int pressure_snapshot_fd = -1;
+static struct lmk_pressure_snapshot *pressure_snapshot;
 static bool monitors_initialized;
+
+/* Settings the memory pressure monitors were set up with */
+struct monitor_config {
+    bool use_psi;
+    int psi_partial_stall_ms;
+    int psi_complete_stall_ms;
+    int psi_complete_stall_scrit_ms;
+    int psi_window_size_ms;
+    bool psi_auto_tune;
+};
+static struct monitor_config monitor_config;
 static bool boot_completed_handled = false;
 
 /* lmkd configurable parameters */
@@ -278,6 +461,36 @@ static bool delay_monitors_until_boot;
 static int direct_reclaim_threshold_ms;
 static int swap_compression_ratio;
 static int lowmem_min_oom_score;
+static long proc_size_cache_ms;
+static int proc_pool_size;
+static bool use_heaviest_index;
+static bool use_io_uring_snapshot;
+static int batch_kill_max_victims;
+static bool kill_uid_group;
+static bool numa_aware;
+static bool memevent_fast_kill;
+static int predictive_horizon_ms;
+static bool adaptive_polling;
+static int psi_poll_min_ms;
+static int psi_poll_max_ms;
+static bool memcg_reclaim;
+static int memcg_reclaim_budget_ms;
+static int memcg_reclaim_swap_util_max;
+static bool kill_cost_model;
+/* Read by the memory sampler thread */
+static std::atomic<int> zoneinfo_sample_ms;
+static bool psi_auto_tune;
+static int kill_cost_file_pct;
+static bool compaction_kill_suppress;
+static bool kill_efficacy;
+static int compaction_wait_ms;
+/*
+ * Number of memory nodes and the node victims are chosen for, -1 if none. numa_target_node indexes
+ * zoneinfo nodes, numa_target_node_id is its kernel node id which indexes proc node_pages.
+ */
+static int numa_node_count = 1;
+static int numa_target_node = -1;
+static int numa_target_node_id = -1;
 static struct psi_threshold psi_thresholds[VMPRESS_LEVEL_COUNT] = {
     { PSI_SOME, 70 },    /* 70ms out of 1sec for partial stall */
     { PSI_SOME, 100 },   /* 100ms out of 1sec for partial stall */
@@ -288,6 +501,8 @@ static int wmark_boost_factor = 1;
 static int wbf_step = 1, wbf_effective = 1;
 
 static android_log_context ctx;
+/* Serializes users of ctx and the prop_log_lmk_kill_occurred() counters */
+static std::mutex kill_report_lock;
 static Reaper reaper;
 static int reaper_comm_fd[2];
 static int32_t MGLRU_status = 0;
@@ -338,13 +553,19 @@ static struct sock_event_handler_info data_sock[MAX_DATA_CONN];
 
 /* vmpressure event handler data */
 static struct event_handler_info vmpressure_hinfo[VMPRESS_LEVEL_COUNT];
+/* PSI monitors of each level, identified by their index in the group or -1 */
+static struct psi_monitor_group psi_monitors;
+static int psi_monitor_idx[VMPRESS_LEVEL_COUNT] = { -1, -1, -1, -1 };
+/* Long window medium level psi trigger used by ro.lmk.psi_auto_tune, -1 if not registered */
+static struct event_handler_info psi_long_hinfo;
+static int psi_long_monitor_idx = -1;
 
 /*
- * 1 ctrl listen socket, 3 ctrl data socket, 3 memory pressure levels,
+ * 1 ctrl listen socket, 3 ctrl data socket, 3 memory pressure levels, 1 long window psi trigger,
  * 1 lmk events + 1 fd to wait for process death + 1 fd to receive kill failure notifications
- * + 1 fd to receive memevent_listener notifications
+ * + 1 fd to receive memevent_listener notifications + 1 fd to receive process exits
  */
-#define MAX_EPOLL_EVENTS (1 + MAX_DATA_CONN + VMPRESS_LEVEL_COUNT + 1 + 1 + 1 + 1)
+#define MAX_EPOLL_EVENTS (1 + MAX_DATA_CONN + VMPRESS_LEVEL_COUNT + 1 + 1 + 1 + 1 + 1 + 1)
 static int epollfd;
 static int maxevents;
 
@@ -370,7 +591,7 @@ enum zoneinfo_zone_field {
     ZI_ZONE_FIELD_COUNT
 };
 
-static const char* const zoneinfo_zone_field_names[ZI_ZONE_FIELD_COUNT] = {
+static constexpr const char* const zoneinfo_zone_field_names[ZI_ZONE_FIELD_COUNT] = {
     "nr_free_pages",
     "min",
     "low",
@@ -424,7 +645,7 @@ enum zoneinfo_node_field {
     ZI_NODE_FIELD_COUNT
 };
 
-static const char* const zoneinfo_node_field_names[ZI_NODE_FIELD_COUNT] = {
+static constexpr const char* const zoneinfo_node_field_names[ZI_NODE_FIELD_COUNT] = {
     "nr_inactive_file",
     "nr_active_file",
 };
@@ -478,7 +699,7 @@ enum meminfo_field {
     MI_FIELD_COUNT
 };
 
-static const char* const meminfo_field_names[MI_FIELD_COUNT] = {
+static constexpr const char* const meminfo_field_names[MI_FIELD_COUNT] = {
     "MemFree:",
     "Cached:",
     "SwapCached:",
@@ -545,12 +766,13 @@ enum vmstat_field {
     VS_PGSKIP_MOVABLE,
     VS_PGSKIP_LAST_ZONE = VS_PGSKIP_MOVABLE,
     VS_COMPACT_STALL,
+    VS_COMPACT_FAIL,
     VS_FIELD_COUNT
 };
 
 #define PGSKIP_IDX(x) (x - VS_PGSKIP_FIRST_ZONE)
 
-static const char* const vmstat_field_names[VS_FIELD_COUNT] = {
+static constexpr const char* const vmstat_field_names[VS_FIELD_COUNT] = {
     "nr_free_pages",
     "nr_inactive_file",
     "nr_active_file",
@@ -566,6 +788,7 @@ static const char* const vmstat_field_names[VS_FIELD_COUNT] = {
     "pgskip_high",
     "pgskip_movable",
     "compact_stall",
+    "compact_fail",
 };
 
 union vmstat {
@@ -585,6 +808,7 @@ union vmstat {
         int64_t pgskip_high;
         int64_t pgskip_movable;
         int64_t compact_stall;
+        int64_t compact_fail;
     } field;
     int64_t arr[VS_FIELD_COUNT];
 };
@@ -621,7 +845,22 @@ struct proc {
     int oomadj;
     pid_t reg_pid; /* PID of the process that registered this record */
     bool valid;
-    struct proc *pidhash_next;
+    long size_cache; /* process size in pages, valid for proc_size_cache_ms after size_cache_tm */
+    struct timespec size_cache_tm;
+    char name_cache[MAX_TASKNAME_LEN]; /* empty until the name is read for the first time */
+    bool name_final; /* name_cache holds the name of the specialized process */
+    int heap_idx; /* position in procadjslot_heap of its slot, -1 if not there */
+    long node_pages[MAX_NR_NODES]; /* resident pages per node, sampled with size_cache */
+    bool node_pages_valid;
+    struct timespec reclaim_tm; /* last time its memcg was asked to reclaim */
+    int64_t rss_kb; /* VmRSS, VmSwap, RssFile, RssAnon and RssShmem read with size_cache */
+    int64_t swap_kb;
+    int64_t rss_file_kb;
+    int64_t rss_anon_kb; /* -1 if not reported by the kernel */
+    int64_t rss_shmem_kb;
+    bool exit_tracked; /* pidfd is registered with proc_epollfd */
+    bool preferred; /* name is in the preferred apps list of generation preferred_gen */
+    uint32_t preferred_gen;
 };
 
 struct reread_data {
@@ -642,9 +881,10 @@ char *preferred_apps;
 void (*perf_ux_engine_trigger)(int, char *) = NULL;
 const char * (*perf_sync_request)(int) = NULL;
 
-#define PIDHASH_SZ 1024
-static struct proc *pidhash[PIDHASH_SZ];
-#define pid_hashfn(x) ((((x) >> 8) ^ (x)) & (PIDHASH_SZ - 1))
+/* Names parsed from preferred_apps, bumping the generation invalidates proc::preferred */
+#define PREFERRED_APPS_SEPARATORS " \t\n,;|/"
+static std::unordered_set<std::string> preferred_app_set;
+static uint32_t preferred_apps_gen;
 
 #define ADJTOSLOT(adj) ((adj) + -OOM_SCORE_ADJ_MIN)
 #define ADJTOSLOT_COUNT (ADJTOSLOT(OOM_SCORE_ADJ_MAX) + 1)
@@ -655,6 +895,53 @@ static std::shared_mutex adjslot_list_lock;
 // adjslot_list_lock. Readers from non-main threads should hold adjslot_list_lock shared lock.
 static struct adjslot_list procadjslot_list[ADJTOSLOT_COUNT];
 
+/*
+ * Process records indexed by pid in an open addressing table with linear probing, doubled when it
+ * gets 3/4 full. It is modified only from the main thread while exclusively holding
+ * adjslot_list_lock, so that the watchdog thread can look records up holding the shared lock.
+ */
+#define PID_TABLE_MIN_SIZE 1024
+static struct proc **pid_table;
+static size_t pid_table_size;
+static size_t pid_table_count;
+#define pid_hashfn(x, size) (((size_t)(((x) >> 8) ^ (x))) & ((size) - 1))
+
+/*
+ * Preallocated and prefaulted process records, so that registrations do not go to the heap.
+ * Free records are chained through asl.next. Records are allocated from the heap once the pool
+ * is exhausted.
+ */
+static struct proc *proc_pool;
+static size_t proc_pool_count;
+static struct proc *proc_pool_free;
+
+/* Epoll set of the pidfds of registered processes, reports their exits */
+static int proc_epollfd = -1;
+
+/*
+ * Unregistered native processes with oom_score_adj >= 0 that can be killed on userdebug and eng
+ * builds when there are no registered processes left to kill. Main thread only.
+ */
+struct native_proc {
+    int pid;
+    int pidfd; /* -1 if pidfds are not supported */
+};
+static struct native_proc native_index[NATIVE_INDEX_SIZE];
+static int native_index_count;
+
+/*
+ * Max-heap of processes in a slot keyed on their cached size. It is kept next to the LRU list so
+ * that the heaviest process of a slot can be found without walking the whole list. Main thread only.
+ */
+struct proc_heap {
+    struct proc **procs;
+    int count;
+    int capacity;
+    int unsized; /* number of processes with sizes never read */
+    bool incomplete; /* some slotted process could not be added */
+};
+static struct proc_heap procadjslot_heap[ADJTOSLOT_COUNT];
+
 #define MAX_DISTINCT_OOM_ADJ 32
 #define KILLCNT_INVALID_IDX 0xFF
 /*
@@ -683,7 +970,11 @@ static void * handle_perfd = NULL;
 static bool update_props();
 static bool init_monitors();
 static void destroy_monitors();
+static bool update_monitors();
+static void psi_tune_event(enum vmpressure_level level, struct timespec *tm);
+static void psi_tune_sample(enum vmpressure_level level, struct psi_data *psi_data);
 static bool init_memevent_listener_monitoring();
+static struct proc *pid_lookup(int pid);
 
 static int clamp(int low, int high, int value) {
     return std::max(std::min(value, high), low);
@@ -708,11 +999,78 @@ static int find_field(const char* name, const char* const field_names[], int fie
     return -1;
 }
 
+/*
+ * Perfect hash of a field name table generated at compile time, so that a name read from a /proc
+ * file is matched with a single comparison instead of a linear search through the table.
+ */
+template <size_t Size>
+struct field_hash {
+    static_assert((Size & (Size - 1)) == 0, "field_hash size should be a power of 2");
+    uint32_t seed;
+    int8_t slots[Size];
+};
+
+static constexpr uint32_t field_name_hash(const char* name, size_t len, uint32_t seed) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u ^ seed;
+
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ static_cast<uint8_t>(name[i])) * 16777619u;
+    }
+    return hash;
+}
+
+static constexpr size_t field_name_len(const char* name) {
+    size_t len = 0;
+
+    while (name[len]) len++;
+    return len;
+}
+
+/* Find a seed for which names don't collide. Fails to compile if there is none. */
+template <size_t Size, size_t N>
+static constexpr struct field_hash<Size> make_field_hash(const char* const (&names)[N]) {
+    static_assert(N < Size && N <= INT8_MAX, "field_hash is too small");
+    struct field_hash<Size> hash = {};
+
+    for (hash.seed = 0;; hash.seed++) {
+        bool collision = false;
+
+        for (size_t i = 0; i < Size; i++) {
+            hash.slots[i] = -1;
+        }
+        for (size_t i = 0; i < N && !collision; i++) {
+            uint32_t slot = field_name_hash(names[i], field_name_len(names[i]), hash.seed) &
+                            (Size - 1);
+            if (hash.slots[slot] >= 0) {
+                collision = true;
+            } else {
+                hash.slots[slot] = static_cast<int8_t>(i);
+            }
+        }
+        if (!collision) {
+            return hash;
+        }
+    }
+}
+
+template <size_t Size, size_t N>
+static inline int find_hashed_field(const char* name, size_t len, const char* const (&names)[N],
+                                    const struct field_hash<Size>& hash) {
+    int idx = hash.slots[field_name_hash(name, len, hash.seed) & (Size - 1)];
+
+    if (idx < 0 || memcmp(names[idx], name, len) || names[idx][len] != '\0') {
+        return -1;
+    }
+    return idx;
+}
+
+template <size_t Size, size_t N>
 static enum field_match_result match_field(const char* cp, const char* ap,
-                                   const char* const field_names[],
-                                   int field_count, int64_t* field,
-                                   int *field_idx) {
-    int i = find_field(cp, field_names, field_count);
+                                           const char* const (&field_names)[N],
+                                           const struct field_hash<Size>& hash, int64_t* field,
+                                           int *field_idx) {
+    int i = find_hashed_field(cp, strlen(cp), field_names, hash);
     if (i < 0) {
         return NO_MATCH;
     }
@@ -720,6 +1078,135 @@ static enum field_match_result match_field(const char* cp, const char* ap,
     return parse_int64(ap, field) ? PARSE_SUCCESS : PARSE_FAIL;
 }
 
+/*
+ * Lines of the fields found by the last full parse of a file. Layout of /proc/meminfo and
+ * /proc/vmstat does not change while the kernel is running, so later parses can go straight to
+ * these lines and only check that the expected names are still there.
+ */
+template <size_t N>
+struct field_line_map {
+    bool valid;
+    int count;
+    int lines[N]; /* in ascending order */
+    int8_t fields[N]; /* index of the field found on lines[i] */
+};
+
+/*
+ * Parse a buffer with "<name> <value>" lines in one pass and store values of the fields found in
+ * field_names. Lines with other names are skipped. Returns false if a line does not have a value
+ * or a value of a known field can't be parsed. If map is provided it records where the fields
+ * were found.
+ */
+template <size_t Size, size_t N>
+static bool parse_field_lines(const char* buf, const char* const (&field_names)[N],
+                              const struct field_hash<Size>& hash, int64_t values[],
+                              struct field_line_map<N>* map) {
+    const char* line = buf;
+    int line_no = 0;
+
+    if (map) {
+        map->valid = false;
+        map->count = 0;
+    }
+
+    for (; *line; line_no++) {
+        const char* name_end = line;
+        const char* val;
+        int idx;
+
+        if (*line == '\n') {
+            line++;
+            continue;
+        }
+        while (*name_end != ' ' && *name_end != '\n' && *name_end != '\0') name_end++;
+        val = name_end;
+        while (*val == ' ') val++;
+        if (val == name_end || *val == '\n' || *val == '\0') {
+            return false;
+        }
+
+        idx = find_hashed_field(line, name_end - line, field_names, hash);
+        if (idx >= 0) {
+            if (!parse_int64(val, &values[idx])) {
+                return false;
+            }
+            if (map && map->count < static_cast<int>(N)) {
+                map->lines[map->count] = line_no;
+                map->fields[map->count] = static_cast<int8_t>(idx);
+                map->count++;
+            }
+        }
+
+        line = strchr(val, '\n');
+        if (!line) {
+            break;
+        }
+        line++;
+    }
+
+    if (map) {
+        map->valid = true;
+    }
+    return true;
+}
+
+/*
+ * Parse only the lines recorded in map. Returns false if the layout does not match the map any
+ * longer, in which case some of the values might have been already updated.
+ */
+template <size_t N>
+static bool parse_mapped_field_lines(const char* buf, const char* const (&field_names)[N],
+                                     const struct field_line_map<N>& map, int64_t values[]) {
+    const char* line = buf;
+    int line_no = 0;
+
+    for (int i = 0; i < map.count; i++) {
+        const char* name = field_names[map.fields[i]];
+        size_t len = strlen(name);
+
+        while (line_no < map.lines[i]) {
+            line = strchr(line, '\n');
+            if (!line) {
+                return false;
+            }
+            line++;
+            line_no++;
+        }
+        if (memcmp(line, name, len) || line[len] != ' ' ||
+            !parse_int64(line + len, &values[map.fields[i]])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Parse fields using the line map of the previous parse when possible, otherwise do a full parse
+ * and record a new map. values[] should be prefilled with defaults for missing fields.
+ */
+template <size_t Size, size_t N>
+static bool parse_fields(const char* buf, const char* const (&field_names)[N],
+                         const struct field_hash<Size>& hash, struct field_line_map<N>* map,
+                         int64_t values[]) {
+    int64_t defaults[N];
+
+    if (map->valid) {
+        memcpy(defaults, values, sizeof(defaults));
+        if (parse_mapped_field_lines(buf, field_names, *map, values)) {
+            return true;
+        }
+        ALOGW("Field layout changed, falling back to full parse");
+        memcpy(values, defaults, sizeof(defaults));
+    }
+
+    return parse_field_lines(buf, field_names, hash, values, map);
+}
+
+static constexpr auto zoneinfo_zone_field_hash = make_field_hash<16>(zoneinfo_zone_field_names);
+static constexpr auto zoneinfo_node_field_hash = make_field_hash<4>(zoneinfo_node_field_names);
+static constexpr auto meminfo_field_hash = make_field_hash<64>(meminfo_field_names);
+static constexpr auto vmstat_field_hash = make_field_hash<64>(vmstat_field_names);
+
 /*
  * Read file content from the beginning up to max_len bytes or EOF
  * whichever happens first.
@@ -799,118 +1286,432 @@ static char *reread_file(struct reread_data *data) {
     return buf;
 }
 
-static bool claim_record(struct proc* procp, pid_t pid) {
-    if (procp->reg_pid == pid) {
-        /* Record already belongs to the registrant */
-        return true;
+/*
+ * Memory snapshot: files polled by mp_event_psi() are read with a single io_uring submission into
+ * registered buffers and then handed to the parsers instead of being read one after another.
+ */
+enum snapshot_file {
+    SNAPSHOT_VMSTAT = 0,
+    SNAPSHOT_MEMINFO,
+    SNAPSHOT_ZONEINFO,
+    SNAPSHOT_PSI_MEMORY,
+    SNAPSHOT_PSI_IO,
+    SNAPSHOT_PSI_CPU,
+    SNAPSHOT_FILE_COUNT
+};
+
+static_assert((int)SNAPSHOT_ZONEINFO == LMKD_TRACE_ZONEINFO &&
+              (int)SNAPSHOT_PSI_CPU == LMKD_TRACE_PSI_CPU &&
+              (int)SNAPSHOT_FILE_COUNT == LMKD_TRACE_FILE_COUNT,
+              "memory pressure trace file ids do not match snapshot files");
+
+struct snapshot_buffer {
+    const char* const filename;
+    char *buf;
+    size_t size;
+    bool ready; /* buf has data from the current snapshot that was not consumed yet */
+    bool grow; /* file did not fit into buf during the last snapshot */
+};
+
+static struct snapshot_buffer snapshot_buffers[SNAPSHOT_FILE_COUNT] = {
+    { VMSTAT_PATH, NULL, 0, false, false },
+    { MEMINFO_PATH, NULL, 0, false, false },
+    { ZONEINFO_PATH, NULL, 0, false, false },
+    { psi_resource_file[PSI_MEMORY], NULL, 0, false, false },
+    { psi_resource_file[PSI_IO], NULL, 0, false, false },
+    { psi_resource_file[PSI_CPU], NULL, 0, false, false },
+};
+
+static bool memory_snapshot_register_buffers() {
+    struct iovec iovs[SNAPSHOT_FILE_COUNT];
+    int ret;
+
+    for (int i = 0; i < SNAPSHOT_FILE_COUNT; i++) {
+        struct snapshot_buffer *sb = &snapshot_buffers[i];
+
+        if (!sb->buf || sb->grow) {
+            /* start with page-size buffer and double it when the file does not fit */
+            size_t size = sb->buf ? sb->size * 2 : getpagesize();
+            char *buf = static_cast<char*>(realloc(sb->buf, size));
+
+            if (!buf) {
+                ALOGE("Failed to allocate snapshot buffer for %s", sb->filename);
+                return false;
+            }
+            sb->buf = buf;
+            sb->size = size;
+            sb->grow = false;
+        }
+        iovs[i].iov_base = sb->buf;
+        iovs[i].iov_len = sb->size;
     }
-    if (procp->reg_pid == 0) {
-        /* Old registrant is gone, claim the record */
-        procp->reg_pid = pid;
-        return true;
+
+    ret = io_uring_register_buffers(&snapshot_ring, iovs, SNAPSHOT_FILE_COUNT);
+    if (ret) {
+        ALOGE("Failed to register snapshot buffers: %s", strerror(-ret));
+        return false;
     }
-    /* The record is owned by another registrant */
-    return false;
+
+    return true;
 }
 
-static void remove_claims(pid_t pid) {
+static bool memory_snapshot_init() {
+    int fds[SNAPSHOT_FILE_COUNT];
+    int ret;
     int i;
 
-    for (i = 0; i < PIDHASH_SZ; i++) {
-        struct proc* procp = pidhash[i];
-        while (procp) {
-            if (procp->reg_pid == pid) {
-                procp->reg_pid = 0;
-            }
-            procp = procp->pidhash_next;
+    ret = io_uring_queue_init(SNAPSHOT_FILE_COUNT, &snapshot_ring, 0);
+    if (ret) {
+        ALOGE("Failed to setup snapshot io_uring ring: %s", strerror(-ret));
+        return false;
+    }
+
+    for (i = 0; i < SNAPSHOT_FILE_COUNT; i++) {
+        fds[i] = TEMP_FAILURE_RETRY(open(snapshot_buffers[i].filename, O_RDONLY | O_CLOEXEC));
+        if (fds[i] < 0) {
+            ALOGE("%s open: %s", snapshot_buffers[i].filename, strerror(errno));
+            goto err;
         }
     }
-}
 
-static void ctrl_data_close(int dsock_idx) {
-    struct epoll_event epev;
+    /* Registered files keep their own references, so the descriptors are closed afterwards */
+    ret = io_uring_register_files(&snapshot_ring, fds, SNAPSHOT_FILE_COUNT);
+    if (ret) {
+        ALOGE("Failed to register snapshot files: %s", strerror(-ret));
+        goto err;
+    }
+    while (i > 0) close(fds[--i]);
 
-    ALOGI("closing lmkd data connection");
-    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, data_sock[dsock_idx].sock, &epev) == -1) {
-        // Log a warning and keep going
-        ALOGW("epoll_ctl for data connection socket failed; errno=%d", errno);
+    if (!memory_snapshot_register_buffers()) {
+        io_uring_queue_exit(&snapshot_ring);
+        return false;
     }
-    maxevents--;
 
-    close(data_sock[dsock_idx].sock);
-    data_sock[dsock_idx].sock = -1;
+    snapshot_ring_initialized = true;
+    return true;
 
-    /* Mark all records of the old registrant as unclaimed */
-    remove_claims(data_sock[dsock_idx].pid);
+err:
+    while (i > 0) close(fds[--i]);
+    io_uring_queue_exit(&snapshot_ring);
+    return false;
 }
 
-static ssize_t ctrl_data_read(int dsock_idx, char* buf, size_t bufsz, struct ucred* sender_cred) {
-    struct iovec iov = {buf, bufsz};
-    char control[CMSG_SPACE(sizeof(struct ucred))];
-    struct msghdr hdr = {
-            NULL, 0, &iov, 1, control, sizeof(control), 0,
-    };
-    ssize_t ret;
-    ret = TEMP_FAILURE_RETRY(recvmsg(data_sock[dsock_idx].sock, &hdr, 0));
-    if (ret == -1) {
-        ALOGE("control data socket read failed; %s", strerror(errno));
-        return -1;
+/*
+ * Start a new snapshot cycle. Data left over from the previous cycle is dropped and, if enabled,
+ * all snapshot files are read in one batch. Files which couldn't be read will be read by their
+ * parsers as usual.
+ */
+static void memory_snapshot_refresh() {
+    static bool init_failed = false;
+    struct io_uring_sqe* sqe;
+    struct io_uring_cqe* cqe;
+    bool regrow = false;
+    int submitted;
+    int ret;
+
+    for (int i = 0; i < SNAPSHOT_FILE_COUNT; i++) {
+        snapshot_buffers[i].ready = false;
+        regrow |= snapshot_buffers[i].grow;
     }
-    if (ret == 0) {
-        ALOGE("Got EOF on control data socket");
-        return -1;
+
+    if (!use_io_uring_snapshot || !isIoUringSupported || init_failed) {
+        return;
     }
 
-    struct ucred* cred = NULL;
-    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
-    while (cmsg != NULL) {
-        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS) {
-            cred = (struct ucred*)CMSG_DATA(cmsg);
-            break;
-        }
-        cmsg = CMSG_NXTHDR(&hdr, cmsg);
+    if (!snapshot_ring_initialized && !memory_snapshot_init()) {
+        ALOGE("Memory snapshots are disabled");
+        init_failed = true;
+        return;
     }
 
-    if (cred == NULL) {
-        ALOGE("Failed to retrieve sender credentials");
-        /* Close the connection */
-        ctrl_data_close(dsock_idx);
-        return -1;
+    if (regrow) {
+        io_uring_unregister_buffers(&snapshot_ring);
+        if (!memory_snapshot_register_buffers()) {
+            goto disable;
+        }
     }
 
-    memcpy(sender_cred, cred, sizeof(struct ucred));
+    for (int i = 0; i < SNAPSHOT_FILE_COUNT; i++) {
+        struct snapshot_buffer *sb = &snapshot_buffers[i];
 
-    /* Store PID of the peer */
-    data_sock[dsock_idx].pid = cred->pid;
+        sqe = io_uring_get_sqe(&snapshot_ring);
+        if (!sqe) {
+            ALOGE("Failed to get SQE for snapshot read of %s", sb->filename);
+            goto disable;
+        }
+        /* Leave space for the terminating zero */
+        io_uring_prep_read_fixed(sqe, i, sb->buf, sb->size - 1, 0, i);
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+        io_uring_sqe_set_data64(sqe, i);
+    }
 
-    return ret;
-}
+    /* Only the reads that were submitted will complete, do not wait for more */
+    submitted = io_uring_submit(&snapshot_ring);
+    if (submitted < 0) {
+        ALOGE("Failed to submit memory snapshot reads: %s", strerror(-submitted));
+        goto disable;
+    }
 
-static int ctrl_data_write(int dsock_idx, char* buf, size_t bufsz) {
-    int ret = 0;
+    for (int i = 0; i < submitted; i++) {
+        ret = TEMP_FAILURE_RETRY(io_uring_wait_cqe(&snapshot_ring, &cqe));
+        if (ret < 0 || !cqe) {
+            ALOGE("Failed to get CQE for memory snapshot: %s", strerror(-ret));
+            goto disable;
+        }
 
-    ret = TEMP_FAILURE_RETRY(write(data_sock[dsock_idx].sock, buf, bufsz));
+        int res = cqe->res;
+        unsigned long long idx = cqe->user_data;
+        io_uring_cqe_seen(&snapshot_ring, cqe);
 
-    if (ret == -1) {
-        ALOGE("control data socket write failed; errno=%d", errno);
-    } else if (ret == 0) {
-        ALOGE("Got EOF on control data socket");
-        ret = -1;
+        if (idx >= SNAPSHOT_FILE_COUNT) {
+            ALOGE("Invalid memory snapshot CQE data: %llu", idx);
+            continue;
+        }
+        struct snapshot_buffer *sb = &snapshot_buffers[idx];
+        if (res < 0) {
+            ALOGE("%s snapshot read: %s", sb->filename, strerror(-res));
+            continue;
+        }
+        if ((size_t)res >= sb->size - 1) {
+            /* Possibly truncated, use a bigger buffer next time */
+            sb->grow = true;
+            continue;
+        }
+        sb->buf[res] = '\0';
+        sb->ready = true;
     }
 
-    return ret;
+    if (submitted == SNAPSHOT_FILE_COUNT) {
+        return;
+    }
+    ALOGE("Submitted %d of %d memory snapshot reads", submitted, SNAPSHOT_FILE_COUNT);
+
+disable:
+    /*
+     * Requests left in the ring would be completed into the buffers during the next snapshot, so
+     * the ring is torn down and the parsers read the files themselves from now on.
+     */
+    ALOGE("Memory snapshots are disabled");
+    io_uring_queue_exit(&snapshot_ring);
+    snapshot_ring_initialized = false;
+    init_failed = true;
+    for (int i = 0; i < SNAPSHOT_FILE_COUNT; i++) {
+        snapshot_buffers[i].ready = false;
+    }
 }
 
 /*
- * Write the pid/uid pair over the data socket, note: all active clients
- * will receive this unsolicited notification.
+ * Returns file content captured by the current snapshot or NULL if it is not available.
+ * The buffer is handed out only once per snapshot cycle because parsers modify it.
  */
-static void ctrl_data_write_lmk_kill_occurred(pid_t pid, uid_t uid) {
-    LMKD_CTRL_PACKET packet;
-    size_t len = lmkd_pack_set_prockills(packet, pid, uid);
+static char *memory_snapshot_get(enum snapshot_file file) {
+    struct snapshot_buffer *sb = &snapshot_buffers[file];
 
-    for (int i = 0; i < MAX_DATA_CONN; i++) {
-        if (data_sock[i].sock >= 0 && data_sock[i].async_event_mask & 1 << LMK_ASYNC_EVENT_KILL) {
+    if (!sb->ready) {
+        return NULL;
+    }
+    sb->ready = false;
+
+    return sb->buf;
+}
+
+/* Memory pressure trace being recorded, see lmkd_replay.h */
+static FILE *trace_fp;
+
+static void trace_record_cycle(struct timespec *tm, int level, uint32_t events) {
+    if (!trace_fp) {
+        return;
+    }
+    /* Previous cycle is complete, make it visible */
+    fflush(trace_fp);
+    fprintf(trace_fp, "cycle %ld %ld %d %u\n", (long)tm->tv_sec, (long)tm->tv_nsec, level, events);
+}
+
+static void trace_record_file(enum snapshot_file file, const char *buf) {
+    size_t len;
+
+    if (!trace_fp) {
+        return;
+    }
+    len = strlen(buf);
+    fprintf(trace_fp, "file %d %zu\n", file, len);
+    fwrite(buf, 1, len, trace_fp);
+    fputc('\n', trace_fp);
+}
+
+static void update_trace_file() {
+    char path[PROPERTY_VALUE_MAX];
+
+    if (trace_fp) {
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+
+    property_get("lmkd.debug.trace_file", path, "");
+    if (path[0] == '\0') {
+        return;
+    }
+
+    trace_fp = fopen(path, "ae");
+    if (!trace_fp) {
+        ALOGE("Failed to open trace file %s; errno=%d", path, errno);
+        return;
+    }
+    if (ftell(trace_fp) == 0) {
+        fputs(LMKD_TRACE_HEADER "\n", trace_fp);
+    }
+    ALOGI("Recording memory pressure trace to %s", path);
+}
+
+/*
+ * Source of the memory state files parsed by the memory pressure checks. The returned buffer is
+ * modified by the parsers. Replaying recorded traces is done by installing another source.
+ */
+struct mem_source {
+    char *(*read)(enum snapshot_file file, struct reread_data *file_data);
+};
+
+static char *live_mem_source_read(enum snapshot_file file, struct reread_data *file_data) {
+    char *buf;
+
+    if ((buf = memory_snapshot_get(file)) == NULL && (buf = reread_file(file_data)) == NULL) {
+        return NULL;
+    }
+    trace_record_file(file, buf);
+
+    return buf;
+}
+
+static struct mem_source live_mem_source = { live_mem_source_read };
+static struct mem_source *mem_source = &live_mem_source;
+
+#ifdef LMKD_REPLAY
+static char *replay_mem_source_read(enum snapshot_file file,
+                                    struct reread_data *file_data __unused) {
+    return lmkd_replay_read((enum lmkd_trace_file)file);
+}
+
+static struct mem_source replay_mem_source = { replay_mem_source_read };
+#endif
+
+/* Time of the current memory pressure check, recorded time when replaying a trace */
+static int get_pressure_check_time(struct timespec *tm) {
+#ifdef LMKD_REPLAY
+    return lmkd_replay_time(tm);
+#else
+    return clock_gettime(CLOCK_MONOTONIC_COARSE, tm);
+#endif
+}
+
+static bool claim_record(struct proc* procp, pid_t pid) {
+    if (procp->reg_pid == pid) {
+        /* Record already belongs to the registrant */
+        return true;
+    }
+    if (procp->reg_pid == 0) {
+        /* Old registrant is gone, claim the record */
+        procp->reg_pid = pid;
+        return true;
+    }
+    /* The record is owned by another registrant */
+    return false;
+}
+
+static void remove_claims(pid_t pid) {
+    size_t i;
+
+    for (i = 0; i < pid_table_size; i++) {
+        struct proc* procp = pid_table[i];
+        if (procp && procp->reg_pid == pid) {
+            procp->reg_pid = 0;
+        }
+    }
+}
+
+static void ctrl_data_close(int dsock_idx) {
+    struct epoll_event epev;
+
+    ALOGI("closing lmkd data connection");
+    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, data_sock[dsock_idx].sock, &epev) == -1) {
+        // Log a warning and keep going
+        ALOGW("epoll_ctl for data connection socket failed; errno=%d", errno);
+    }
+    maxevents--;
+
+    close(data_sock[dsock_idx].sock);
+    data_sock[dsock_idx].sock = -1;
+
+    /* Mark all records of the old registrant as unclaimed */
+    remove_claims(data_sock[dsock_idx].pid);
+}
+
+static ssize_t ctrl_data_read(int dsock_idx, char* buf, size_t bufsz, struct ucred* sender_cred) {
+    struct iovec iov = {buf, bufsz};
+    char control[CMSG_SPACE(sizeof(struct ucred))];
+    struct msghdr hdr = {
+            NULL, 0, &iov, 1, control, sizeof(control), 0,
+    };
+    ssize_t ret;
+    ret = TEMP_FAILURE_RETRY(recvmsg(data_sock[dsock_idx].sock, &hdr, 0));
+    if (ret == -1) {
+        ALOGE("control data socket read failed; %s", strerror(errno));
+        return -1;
+    }
+    if (ret == 0) {
+        ALOGE("Got EOF on control data socket");
+        return -1;
+    }
+
+    struct ucred* cred = NULL;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    while (cmsg != NULL) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS) {
+            cred = (struct ucred*)CMSG_DATA(cmsg);
+            break;
+        }
+        cmsg = CMSG_NXTHDR(&hdr, cmsg);
+    }
+
+    if (cred == NULL) {
+        ALOGE("Failed to retrieve sender credentials");
+        /* Close the connection */
+        ctrl_data_close(dsock_idx);
+        return -1;
+    }
+
+    memcpy(sender_cred, cred, sizeof(struct ucred));
+
+    /* Store PID of the peer */
+    data_sock[dsock_idx].pid = cred->pid;
+
+    return ret;
+}
+
+static int ctrl_data_write(int dsock_idx, char* buf, size_t bufsz) {
+    int ret = 0;
+
+    ret = TEMP_FAILURE_RETRY(write(data_sock[dsock_idx].sock, buf, bufsz));
+
+    if (ret == -1) {
+        ALOGE("control data socket write failed; errno=%d", errno);
+    } else if (ret == 0) {
+        ALOGE("Got EOF on control data socket");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Write the pid/uid pair over the data socket, note: all active clients
+ * will receive this unsolicited notification.
+ */
+static void ctrl_data_write_lmk_kill_occurred(pid_t pid, uid_t uid) {
+    LMKD_CTRL_PACKET packet;
+    size_t len = lmkd_pack_set_prockills(packet, pid, uid);
+
+    for (int i = 0; i < MAX_DATA_CONN; i++) {
+        if (data_sock[i].sock >= 0 && data_sock[i].async_event_mask & 1 << LMK_ASYNC_EVENT_KILL) {
             ctrl_data_write(i, (char*)packet, len);
         }
     }
@@ -935,10 +1736,48 @@ static void stats_write_lmk_kill_occurred(struct kill_stat *kill_st,
 
 }
 
+/*
+ * Write the kill latencies over the data socket to be propagated via AMS to statsd
+ */
+static void stats_write_lmk_kill_latency(struct kill_latency_stat *latency_st) {
+    LMK_KILL_OCCURRED_PACKET packet;
+    const size_t len = lmkd_pack_set_kill_latency(packet, latency_st);
+    if (len == 0) {
+        return;
+    }
+
+    for (int i = 0; i < MAX_DATA_CONN; i++) {
+        if (data_sock[i].sock >= 0 &&
+            data_sock[i].async_event_mask & 1 << LMK_ASYNC_EVENT_LATENCY) {
+            ctrl_data_write(i, packet, len);
+        }
+    }
+}
+
+/*
+ * Write the memory freed by a kill over the data socket to be propagated via AMS to statsd
+ */
+static void stats_write_lmk_kill_efficacy(struct kill_efficacy_stat *efficacy_st) {
+    LMK_KILL_OCCURRED_PACKET packet;
+    const size_t len = lmkd_pack_set_kill_efficacy(packet, efficacy_st);
+    if (len == 0) {
+        return;
+    }
+
+    for (int i = 0; i < MAX_DATA_CONN; i++) {
+        if (data_sock[i].sock >= 0 &&
+            data_sock[i].async_event_mask & 1 << LMK_ASYNC_EVENT_EFFICACY) {
+            ctrl_data_write(i, packet, len);
+        }
+    }
+}
+
 static void stats_write_lmk_kill_occurred_pid(int pid, struct kill_stat *kill_st,
                                               struct memory_stat *mem_st) {
-    kill_st->taskname = stats_get_task_name(pid);
-    if (kill_st->taskname != NULL) {
+    struct proc *procp = pid_lookup(pid);
+
+    if (procp && procp->name_cache[0] != '\0') {
+        kill_st->taskname = procp->name_cache;
         stats_write_lmk_kill_occurred(kill_st, mem_st);
     }
 }
@@ -1050,16 +1889,129 @@ static bool init_poll_kernel() {
     return true;
 }
 
+/* Returns the index holding the record of pid or the empty one where it should be inserted */
+static size_t pid_table_slot(int pid) {
+    size_t idx = pid_hashfn(pid, pid_table_size);
+
+    while (pid_table[idx] && pid_table[idx]->pid != pid) {
+        idx = (idx + 1) & (pid_table_size - 1);
+    }
+
+    return idx;
+}
+
 static struct proc *pid_lookup(int pid) {
-    struct proc *procp;
+    if (!pid_table) {
+        return NULL;
+    }
 
-    for (procp = pidhash[pid_hashfn(pid)]; procp && procp->pid != pid;
-         procp = procp->pidhash_next)
-            ;
+    return pid_table[pid_table_slot(pid)];
+}
+
+static bool init_proc_pool() {
+    size_t size = proc_pool_size * sizeof(struct proc);
+    void *pool;
+
+    if (proc_pool_size <= 0) {
+        return true;
+    }
+
+    /* MAP_POPULATE faults the pool in so that it is locked by mlockall() right away */
+    pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+                -1, 0);
+    if (pool == MAP_FAILED) {
+        ALOGE("Failed to allocate a pool of %d process records: %s", proc_pool_size,
+              strerror(errno));
+        return false;
+    }
+
+    proc_pool = static_cast<struct proc *>(pool);
+    proc_pool_count = proc_pool_size;
+    for (size_t i = proc_pool_count; i > 0; i--) {
+        proc_pool[i - 1].asl.next = (struct adjslot_list *)proc_pool_free;
+        proc_pool_free = &proc_pool[i - 1];
+    }
+
+    return true;
+}
+
+/* Returns a zeroed process record */
+static struct proc *proc_alloc() {
+    struct proc *procp = proc_pool_free;
+
+    if (!procp) {
+        return static_cast<struct proc *>(calloc(1, sizeof(struct proc)));
+    }
+    proc_pool_free = (struct proc *)procp->asl.next;
+    memset(procp, 0, sizeof(*procp));
 
     return procp;
 }
 
+static void proc_free(struct proc *procp) {
+    if (procp < proc_pool || procp >= proc_pool + proc_pool_count) {
+        free(procp);
+        return;
+    }
+    procp->asl.next = (struct adjslot_list *)proc_pool_free;
+    proc_pool_free = procp;
+}
+
+// Should be called only from the main thread while exclusively holding adjslot_list_lock.
+static bool pid_table_grow() {
+    size_t new_size = pid_table_size ? pid_table_size * 2 : PID_TABLE_MIN_SIZE;
+    struct proc **new_table;
+    size_t i;
+
+    new_table = static_cast<struct proc**>(calloc(new_size, sizeof(struct proc*)));
+    if (!new_table) {
+        return false;
+    }
+
+    for (i = 0; i < pid_table_size; i++) {
+        struct proc *procp = pid_table[i];
+        size_t idx;
+
+        if (!procp) {
+            continue;
+        }
+        idx = pid_hashfn(procp->pid, new_size);
+        while (new_table[idx]) {
+            idx = (idx + 1) & (new_size - 1);
+        }
+        new_table[idx] = procp;
+    }
+
+    free(pid_table);
+    pid_table = new_table;
+    pid_table_size = new_size;
+
+    return true;
+}
+
+/*
+ * Empty the entry at idx and shift back the following entries of the probe sequence so that
+ * lookups never stop at the hole. Should be called only from the main thread while exclusively
+ * holding adjslot_list_lock.
+ */
+static void pid_table_remove(size_t idx) {
+    size_t mask = pid_table_size - 1;
+    size_t next = idx;
+
+    pid_table[idx] = NULL;
+    for (next = (next + 1) & mask; pid_table[next]; next = (next + 1) & mask) {
+        size_t home = pid_hashfn(pid_table[next]->pid, pid_table_size);
+
+        /* The entry can fill the hole unless its home index lies between the hole and itself */
+        if (((next - home) & mask) >= ((next - idx) & mask)) {
+            pid_table[idx] = pid_table[next];
+            pid_table[next] = NULL;
+            idx = next;
+        }
+    }
+    pid_table_count--;
+}
+
 static void adjslot_insert(struct adjslot_list *head, struct adjslot_list *new_element)
 {
     struct adjslot_list *next = head->next;
@@ -1083,12 +2035,123 @@ static struct adjslot_list *adjslot_tail(struct adjslot_list *head) {
     return asl == head ? NULL : asl;
 }
 
+static bool proc_size_unknown(struct proc *procp) {
+    return procp->size_cache_tm.tv_sec == 0 && procp->size_cache_tm.tv_nsec == 0;
+}
+
+static void proc_heap_swap(struct proc_heap *heap, int a, int b) {
+    struct proc *tmp = heap->procs[a];
+
+    heap->procs[a] = heap->procs[b];
+    heap->procs[b] = tmp;
+    heap->procs[a]->heap_idx = a;
+    heap->procs[b]->heap_idx = b;
+}
+
+static void proc_heap_sift_up(struct proc_heap *heap, int idx) {
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+
+        if (heap->procs[parent]->size_cache >= heap->procs[idx]->size_cache) {
+            break;
+        }
+        proc_heap_swap(heap, parent, idx);
+        idx = parent;
+    }
+}
+
+static void proc_heap_sift_down(struct proc_heap *heap, int idx) {
+    while (true) {
+        int largest = idx;
+        int child = 2 * idx + 1;
+
+        if (child < heap->count &&
+            heap->procs[child]->size_cache > heap->procs[largest]->size_cache) {
+            largest = child;
+        }
+        child++;
+        if (child < heap->count &&
+            heap->procs[child]->size_cache > heap->procs[largest]->size_cache) {
+            largest = child;
+        }
+        if (largest == idx) {
+            break;
+        }
+        proc_heap_swap(heap, largest, idx);
+        idx = largest;
+    }
+}
+
+static void proc_heap_insert(struct proc *procp) {
+    struct proc_heap *heap = &procadjslot_heap[ADJTOSLOT(procp->oomadj)];
+
+    if (heap->count == heap->capacity) {
+        int capacity = heap->capacity ? heap->capacity * 2 : 8;
+        struct proc **procs =
+                static_cast<struct proc **>(realloc(heap->procs, capacity * sizeof(*procs)));
+
+        if (!procs) {
+            ALOGE("Failed to grow process heap for oom_score_adj %d", procp->oomadj);
+            procp->heap_idx = -1;
+            heap->incomplete = true;
+            return;
+        }
+        heap->procs = procs;
+        heap->capacity = capacity;
+    }
+    procp->heap_idx = heap->count++;
+    heap->procs[procp->heap_idx] = procp;
+    if (proc_size_unknown(procp)) {
+        heap->unsized++;
+    }
+    proc_heap_sift_up(heap, procp->heap_idx);
+}
+
+static void proc_heap_remove(struct proc *procp) {
+    struct proc_heap *heap = &procadjslot_heap[ADJTOSLOT(procp->oomadj)];
+    int idx = procp->heap_idx;
+
+    if (idx < 0) {
+        return;
+    }
+    if (proc_size_unknown(procp)) {
+        heap->unsized--;
+    }
+    procp->heap_idx = -1;
+    heap->count--;
+    if (idx != heap->count) {
+        heap->procs[idx] = heap->procs[heap->count];
+        heap->procs[idx]->heap_idx = idx;
+        proc_heap_sift_up(heap, idx);
+        proc_heap_sift_down(heap, heap->procs[idx]->heap_idx);
+    }
+    if (heap->count == 0) {
+        heap->incomplete = false;
+    }
+}
+
+/* Called after the cached size of a process has been updated. */
+static void proc_heap_update(struct proc *procp, bool was_unknown) {
+    struct proc_heap *heap = &procadjslot_heap[ADJTOSLOT(procp->oomadj)];
+    int idx = procp->heap_idx;
+
+    if (idx < 0) {
+        return;
+    }
+    if (was_unknown) {
+        heap->unsized--;
+    }
+    proc_heap_sift_up(heap, idx);
+    proc_heap_sift_down(heap, procp->heap_idx);
+}
+
 // Should be modified only from the main thread.
 static void proc_slot(struct proc *procp) {
     int adjslot = ADJTOSLOT(procp->oomadj);
     std::scoped_lock lock(adjslot_list_lock);
 
     adjslot_insert(&procadjslot_list[adjslot], &procp->asl);
+    proc_heap_insert(procp);
 }
 
 // Should be modified only from the main thread.
@@ -1096,35 +2159,69 @@ static void proc_unslot(struct proc *procp) {
     std::scoped_lock lock(adjslot_list_lock);
 
     adjslot_remove(&procp->asl);
+    proc_heap_remove(procp);
 }
 
-static void proc_insert(struct proc *procp) {
-    int hval = pid_hashfn(procp->pid);
+// Should be called only from the main thread.
+static bool proc_insert(struct proc *procp) {
+    {
+        std::scoped_lock lock(adjslot_list_lock);
 
-    procp->pidhash_next = pidhash[hval];
-    pidhash[hval] = procp;
+        if ((pid_table_count + 1) * 4 > pid_table_size * 3 && !pid_table_grow()) {
+            ALOGE("Failed to grow the process table to fit %zu records", pid_table_count + 1);
+            return false;
+        }
+        pid_table[pid_table_slot(procp->pid)] = procp;
+        pid_table_count++;
+    }
     proc_slot(procp);
+
+    return true;
+}
+
+/*
+ * Register the pidfd of the process with proc_epollfd so that the record is removed as soon as
+ * the process exits instead of waiting for its removal to be requested.
+ */
+static void proc_track_exit(struct proc *procp) {
+    struct epoll_event epev;
+
+    if (proc_epollfd < 0 || procp->pidfd < 0) {
+        return;
+    }
+
+    epev.events = EPOLLIN;
+    epev.data.ptr = (void *)procp;
+    if (epoll_ctl(proc_epollfd, EPOLL_CTL_ADD, procp->pidfd, &epev) != 0) {
+        ALOGE("epoll_ctl for pid %d exit failed; errno=%d", procp->pid, errno);
+        return;
+    }
+    procp->exit_tracked = true;
 }
 
 // Can be called only from the main thread.
 static int pid_remove(int pid) {
-    int hval = pid_hashfn(pid);
     struct proc *procp;
-    struct proc *prevp;
+    size_t idx;
 
-    for (procp = pidhash[hval], prevp = NULL; procp && procp->pid != pid;
-         procp = procp->pidhash_next)
-            prevp = procp;
+    if (!pid_table) {
+        return -1;
+    }
 
+    idx = pid_table_slot(pid);
+    procp = pid_table[idx];
     if (!procp)
         return -1;
 
-    if (!prevp)
-        pidhash[hval] = procp->pidhash_next;
-    else
-        prevp->pidhash_next = procp->pidhash_next;
+    {
+        std::scoped_lock lock(adjslot_list_lock);
+        pid_table_remove(idx);
+    }
 
     proc_unslot(procp);
+    if (procp->exit_tracked && epoll_ctl(proc_epollfd, EPOLL_CTL_DEL, procp->pidfd, NULL) != 0) {
+        ALOGE("epoll_ctl for pid %d exit removal failed; errno=%d", pid, errno);
+    }
     /*
      * Close pidfd here if we are not waiting for corresponding process to die,
      * in which case stop_wait_for_proc_kill() will close the pidfd later
@@ -1134,7 +2231,7 @@ static int pid_remove(int pid) {
     }
 
     if (procp->pidfd != NATIVE_PID_FD) {
-        free(procp);
+        proc_free(procp);
     } else {
         memset(procp, 0, sizeof(struct proc));
     }
@@ -1185,6 +2282,33 @@ static inline long get_time_diff_ms(struct timespec *from,
            (to->tv_nsec - from->tv_nsec) / (long)NS_PER_MS;
 }
 
+static inline long get_time_diff_us(struct timespec *from,
+                                    struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * (long)US_PER_SEC +
+           (to->tv_nsec - from->tv_nsec) / (long)NS_PER_US;
+}
+
+/* Returns microseconds passed since CLOCK_MONOTONIC time from. */
+static long get_latency_us(struct timespec *from) {
+    struct timespec curr_tm;
+
+    clock_gettime(CLOCK_MONOTONIC, &curr_tm);
+    return std::max(get_time_diff_us(from, &curr_tm), 0L);
+}
+
+static void record_latency(enum lmk_latency_stage stage, long latency_us) {
+    static const char *stage_trace_names[LMK_LATENCY_STAGE_COUNT] = {
+        "lmkd_event_latency_us",
+        "lmkd_parse_latency_us",
+        "lmkd_select_latency_us",
+        "lmkd_reap_latency_us",
+        "lmkd_exit_latency_us",
+    };
+
+    latency_hist[stage][lmkd_latency_bucket(latency_us)]++;
+    trace_latency(stage_trace_names[stage], latency_us);
+}
+
 /* Reads /proc/pid/status into buf. */
 static bool read_proc_status(int pid, char *buf, size_t buf_sz) {
     static char path[PROCFS_PATH_MAX];
@@ -1357,6 +2481,338 @@ static char *proc_get_name(int pid, char *buf, size_t buf_size) {
     return buf;
 }
 
+static void numa_maps_parse_line(char *line, long *node_pages) {
+    long pages[MAX_NR_NODES] = { 0 };
+    long pagesize_k = page_k;
+    char *save_ptr;
+    char *tok;
+    int node;
+    long cnt;
+
+    for (tok = strtok_r(line, " ", &save_ptr); tok; tok = strtok_r(NULL, " ", &save_ptr)) {
+        if (sscanf(tok, "N%d=%ld", &node, &cnt) == 2) {
+            if (node >= 0 && node < MAX_NR_NODES) {
+                pages[node] += cnt;
+            }
+        } else if (!strncmp(tok, "kernelpagesize_kB=", strlen("kernelpagesize_kB="))) {
+            pagesize_k = strtol(tok + strlen("kernelpagesize_kB="), NULL, 10);
+        }
+    }
+    /* Huge page mappings are counted in huge pages */
+    for (node = 0; node < MAX_NR_NODES; node++) {
+        node_pages[node] += pages[node] * pagesize_k / page_k;
+    }
+}
+
+/*
+ * Read the number of pages a process has on each node from /proc/pid/numa_maps.
+ * Returns false if the process is gone.
+ */
+static bool proc_get_node_pages(int pid, long *node_pages) {
+    static char path[PROCFS_PATH_MAX];
+    static char buf[NUMA_MAPS_BUF_SIZE];
+    size_t len = 0;
+    ssize_t ret;
+    int fd;
+
+    /* gid containing AID_READPROC required */
+    snprintf(path, PROCFS_PATH_MAX, "/proc/%d/numa_maps", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    memset(node_pages, 0, sizeof(long) * MAX_NR_NODES);
+    while ((ret = TEMP_FAILURE_RETRY(read(fd, buf + len, sizeof(buf) - 1 - len))) > 0) {
+        char *line = buf;
+        char *eol;
+
+        len += ret;
+        buf[len] = '\0';
+        while ((eol = strchr(line, '\n')) != NULL) {
+            *eol = '\0';
+            numa_maps_parse_line(line, node_pages);
+            line = eol + 1;
+        }
+        /* Keep the incomplete last line, drop it if it does not fit into the buffer */
+        len -= line - buf;
+        if (len == sizeof(buf) - 1) {
+            len = 0;
+        } else {
+            memmove(buf, line, len);
+        }
+    }
+    close(fd);
+
+    return ret == 0;
+}
+
+/* Reads VmRSS, VmSwap, RssFile, RssAnon and RssShmem with a single read of /proc/<pid>/status */
+static bool proc_get_status_sizes(int pid, int64_t *rss_kb, int64_t *swap_kb,
+                                  int64_t *rss_file_kb, int64_t *rss_anon_kb,
+                                  int64_t *rss_shmem_kb) {
+    char buf[BUF_MAX];
+
+    /* Zombie processes will not have RSS / Swap fields */
+    if (!read_proc_status(pid, buf, sizeof(buf)) ||
+        !parse_status_tag(buf, PROC_STATUS_RSS_FIELD, rss_kb) ||
+        !parse_status_tag(buf, PROC_STATUS_SWAP_FIELD, swap_kb)) {
+        return false;
+    }
+    /* RssFile, RssAnon and RssShmem are missing on kernels older than 4.5 */
+    if (!parse_status_tag(buf, PROC_STATUS_RSS_FILE_FIELD, rss_file_kb)) {
+        *rss_file_kb = 0;
+    }
+    if (!parse_status_tag(buf, PROC_STATUS_RSS_ANON_FIELD, rss_anon_kb)) {
+        *rss_anon_kb = -1;
+    }
+    if (!parse_status_tag(buf, PROC_STATUS_RSS_SHMEM_FIELD, rss_shmem_kb)) {
+        *rss_shmem_kb = 0;
+    }
+
+    return true;
+}
+
+/*
+ * Physical memory used per swapped out kB in percent, from the zram compression ratio or
+ * ro.lmk.swap_compression_ratio when zram stats are not available.
+ */
+static int zram_swap_cost_pct(struct timespec *tm) {
+    static struct reread_data file_data = {
+        .filename = ZRAM_MM_STAT_PATH,
+        .fd = -1,
+    };
+    static struct timespec last_read_tm;
+    static int cost_pct = -1;
+    int64_t orig_size;
+    int64_t compr_size;
+    int64_t mem_used;
+    char *buf;
+
+    if (cost_pct >= 0 && get_time_diff_ms(&last_read_tm, tm) < ZRAM_STAT_INTERVAL_MS) {
+        return cost_pct;
+    }
+    last_read_tm = *tm;
+
+    /* mm_stat starts with orig_data_size compr_data_size mem_used_total, all in bytes */
+    if ((buf = reread_file(&file_data)) != NULL &&
+        sscanf(buf, "%" SCNd64 " %" SCNd64 " %" SCNd64, &orig_size, &compr_size, &mem_used) == 3 &&
+        orig_size > 0) {
+        cost_pct = std::min((int64_t)100, mem_used * 100 / orig_size);
+    } else {
+        cost_pct = swap_compression_ratio > 0 ? 100 / swap_compression_ratio : 100;
+    }
+
+    return cost_pct;
+}
+
+/*
+ * Estimate of the memory a kill of the process frees in pages: private anonymous memory is freed,
+ * file and shmem pages only partly as they are likely shared with other processes or read back,
+ * and swapped memory frees its compressed size only.
+ */
+static long proc_kill_cost(struct proc *procp, struct timespec *tm) {
+    int64_t shared_kb = procp->rss_file_kb + procp->rss_shmem_kb;
+    int64_t anon_kb = procp->rss_anon_kb >= 0 ? procp->rss_anon_kb :
+                      std::max((int64_t)0, procp->rss_kb - shared_kb);
+
+    return (anon_kb + shared_kb * kill_cost_file_pct / 100 +
+            procp->swap_kb * zram_swap_cost_pct(tm) / 100) / page_k;
+}
+
+/*
+ * Scaled efficacy of a uid at tm, halving its gap to 100% every KILL_EFFICACY_HALF_LIFE_MS. The
+ * gap is below 1/KILL_EFFICACY_SCALE of a percent after 17 half lives.
+ */
+static int uid_kill_efficacy_decayed(struct uid_efficacy *efficacy, struct timespec *tm) {
+    long half_lives = get_time_diff_ms(&efficacy->tm, tm) / KILL_EFFICACY_HALF_LIFE_MS;
+
+    if (half_lives >= 17) {
+        return KILL_EFFICACY_FULL;
+    }
+    return KILL_EFFICACY_FULL - ((KILL_EFFICACY_FULL - efficacy->scaled_pct) >>
+                                 std::max(half_lives, 0L));
+}
+
+/* Part of its estimated size a kill of a process of the uid is expected to free, scaled */
+static int uid_kill_efficacy_scaled(uid_t uid, struct timespec *tm) {
+    auto it = uid_kill_efficacy.find(uid);
+    int scaled_pct;
+
+    if (it == uid_kill_efficacy.end()) {
+        return KILL_EFFICACY_FULL;
+    }
+    scaled_pct = uid_kill_efficacy_decayed(&it->second, tm);
+    if (scaled_pct == KILL_EFFICACY_FULL) {
+        /* Nothing is left to remember about the uid */
+        uid_kill_efficacy.erase(it);
+    }
+
+    return scaled_pct;
+}
+
+static long proc_refresh_size(struct proc *procp, struct timespec *tm) {
+    bool was_unknown = proc_size_unknown(procp);
+
+    if (proc_get_status_sizes(procp->pid, &procp->rss_kb, &procp->swap_kb,
+                              &procp->rss_file_kb, &procp->rss_anon_kb, &procp->rss_shmem_kb)) {
+        procp->size_cache = kill_cost_model ? proc_kill_cost(procp, tm) :
+                (procp->rss_kb ? procp->rss_kb : procp->swap_kb) / page_k;
+        if (kill_efficacy && !uid_kill_efficacy.empty()) {
+            procp->size_cache = procp->size_cache * uid_kill_efficacy_scaled(procp->uid, tm) /
+                                KILL_EFFICACY_FULL;
+        }
+    } else {
+        procp->rss_kb = 0;
+        procp->swap_kb = 0;
+        procp->rss_file_kb = 0;
+        procp->rss_anon_kb = -1;
+        procp->rss_shmem_kb = 0;
+        procp->size_cache = -1;
+    }
+    procp->size_cache_tm = *tm;
+    /* numa_maps walks all process mappings, sample it only when there is a choice of nodes */
+    if (numa_aware && numa_node_count > 1 && procp->size_cache > 0) {
+        procp->node_pages_valid = proc_get_node_pages(procp->pid, procp->node_pages);
+    }
+    proc_heap_update(procp, was_unknown);
+
+    return procp->size_cache;
+}
+
+static bool proc_size_cache_valid(struct proc *procp, struct timespec *tm) {
+    return proc_size_cache_ms > 0 &&
+           get_time_diff_ms(&procp->size_cache_tm, tm) < proc_size_cache_ms;
+}
+
+/*
+ * Returns process size in pages using the value cached in the process record when it is recent
+ * enough. Returns a negative value if the process is gone.
+ */
+static long proc_get_cached_size(struct proc *procp, struct timespec *tm) {
+    return proc_size_cache_valid(procp, tm) ? procp->size_cache : proc_refresh_size(procp, tm);
+}
+
+/*
+ * Apps can register before they are specialized, while their command line still holds the name
+ * given by the zygote or by the unspecialized app process pool.
+ */
+static bool proc_name_is_final(const char *taskname) {
+    return strcmp(taskname, "<pre-initialized>") && strncmp(taskname, "usap", 4) &&
+           strncmp(taskname, "zygote", 6);
+}
+
+/*
+ * Process name does not change after the process is specialized, so it is read only once
+ * from then on.
+ */
+static const char *proc_get_cached_name(struct proc *procp) {
+    char buf[LINE_MAX];
+    char *taskname;
+
+    if (!procp->name_final) {
+        taskname = proc_get_name(procp->pid, buf, sizeof(buf));
+        if (!taskname) {
+            return NULL;
+        }
+        strlcpy(procp->name_cache, taskname, sizeof(procp->name_cache));
+        procp->name_final = proc_name_is_final(procp->name_cache);
+    }
+
+    return procp->name_cache;
+}
+
+static void parse_preferred_apps() {
+    char *save_ptr;
+    char *name;
+
+    preferred_app_set.clear();
+    for (name = strtok_r(preferred_apps, PREFERRED_APPS_SEPARATORS, &save_ptr); name;
+         name = strtok_r(NULL, PREFERRED_APPS_SEPARATORS, &save_ptr)) {
+        preferred_app_set.emplace(name);
+    }
+    /* Generation 0 is never current so that new records are always checked */
+    if (++preferred_apps_gen == 0) {
+        preferred_apps_gen = 1;
+    }
+}
+
+/* Fetch the preferred apps list from perf and rebuild preferred_app_set from it */
+static void update_preferred_apps() {
+    if (!use_perf_api_for_pref_apps) {
+        if (!perf_ux_engine_trigger) {
+            return;
+        }
+        perf_ux_engine_trigger(PAPP_OPCODE, preferred_apps);
+        preferred_apps[PREFERRED_OUT_LENGTH - 1] = '\0';
+    } else {
+        const char *tmp;
+
+        if (!perf_sync_request || (tmp = perf_sync_request(PAPP_PERF_TRIGGER)) == NULL) {
+            return;
+        }
+        strlcpy(preferred_apps, tmp, PREFERRED_OUT_LENGTH);
+        free((void *)tmp);
+    }
+    parse_preferred_apps();
+}
+
+/*
+ * Exact name match against the preferred apps list, evaluated at victim selection and then
+ * re-evaluated only when the list changes
+ */
+static bool proc_is_preferred(struct proc *procp) {
+    const char *taskname;
+
+    if (procp->preferred_gen != preferred_apps_gen) {
+        taskname = proc_get_cached_name(procp);
+        /* Retry next time if the name could not be read */
+        if (!taskname) {
+            return false;
+        }
+        procp->preferred = preferred_app_set.count(taskname) > 0;
+        /* Match the name again once the process is specialized */
+        if (procp->name_final) {
+            procp->preferred_gen = preferred_apps_gen;
+        }
+    }
+
+    return procp->preferred;
+}
+
+/*
+ * With the in-kernel lmk driver processes are killed by the kernel and only their names are kept
+ * to log the kills it reports. The records are not valid for killing by lmkd.
+ */
+static void register_kernel_lmk_proc(int pid, int oomadj, const char *taskname) {
+    struct proc *procp;
+
+    if (!taskname) {
+        return;
+    }
+
+    procp = pid_lookup(pid);
+    if (!procp) {
+        procp = proc_alloc();
+        if (!procp) {
+            return;
+        }
+        procp->pid = pid;
+        procp->pidfd = -1;
+        procp->oomadj = oomadj;
+        if (!proc_insert(procp)) {
+            proc_free(procp);
+            return;
+        }
+    } else if (procp->oomadj != oomadj) {
+        proc_unslot(procp);
+        procp->oomadj = oomadj;
+        proc_slot(procp);
+    }
+    strlcpy(procp->name_cache, taskname, sizeof(procp->name_cache));
+    procp->name_final = true;
+}
+
 static void register_oom_adj_proc(const struct lmk_procprio& proc, struct ucred* cred) {
     char val[20];
     int soft_limit_mult;
@@ -1424,7 +2880,7 @@ static void register_oom_adj_proc(const struct lmk_procprio& proc, struct ucred*
             }
         }
 
-        procp = static_cast<struct proc*>(calloc(1, sizeof(struct proc)));
+        procp = proc_alloc();
         if (!procp) {
             // Oh, the irony.  May need to rebuild our state.
             return;
@@ -1436,7 +2892,14 @@ static void register_oom_adj_proc(const struct lmk_procprio& proc, struct ucred*
         procp->reg_pid = cred->pid;
         procp->oomadj = oom_adj_score;
         procp->valid = true;
-        proc_insert(procp);
+        if (!proc_insert(procp)) {
+            if (pidfd >= 0) {
+                close(pidfd);
+            }
+            proc_free(procp);
+            return;
+        }
+        proc_track_exit(procp);
     } else {
         if (!claim_record(procp, cred->pid)) {
             char buf[LINE_MAX];
@@ -1491,7 +2954,8 @@ static void apply_proc_prio(const struct lmk_procprio& params, struct ucred* cre
     }
 
     if (use_inkernel_interface) {
-        stats_store_taskname(params.pid, proc_get_name(params.pid, path, sizeof(path)));
+        register_kernel_lmk_proc(params.pid, params.oomadj,
+                                 proc_get_name(params.pid, path, sizeof(path)));
         return;
     }
 
@@ -1520,7 +2984,7 @@ static void cmd_procremove(LMKD_CTRL_PACKET packet, struct ucred *cred) {
          */
         poll_kernel(kpoll_fd);
 
-        stats_remove_taskname(params.pid);
+        pid_remove(params.pid);
         return;
     }
 
@@ -1546,32 +3010,127 @@ static void cmd_procremove(LMKD_CTRL_PACKET packet, struct ucred *cred) {
 }
 
 static void cmd_procpurge(struct ucred *cred) {
-    int i;
+    size_t i;
     struct proc *procp;
-    struct proc *next;
 
     if (use_inkernel_interface) {
-        stats_purge_tasknames();
+        for (i = 0; i < pid_table_size;) {
+            /* A removal may shift another record into this index */
+            if (pid_table[i]) {
+                pid_remove(pid_table[i]->pid);
+            } else {
+                i++;
+            }
+        }
         return;
     }
 
-    for (i = 0; i < PIDHASH_SZ; i++) {
-        procp = pidhash[i];
-        while (procp) {
-            next = procp->pidhash_next;
-            /* Purge only records created by the requestor */
-            if (claim_record(procp, cred->pid)) {
-                pid_remove(procp->pid);
-            }
-            procp = next;
+    for (i = 0; i < pid_table_size;) {
+        procp = pid_table[i];
+        /* Purge only records created by the requestor */
+        if (procp && claim_record(procp, cred->pid)) {
+            pid_remove(procp->pid);
+            /* Removal shifts the following entry back into this index, check it again */
+            continue;
         }
+        i++;
     }
 }
 
+/*
+ * Create the memfd holding the pressure snapshot. Clients should not be able to modify it, so the
+ * memfd is sealed against new writable mappings and lmkd keeps the only one.
+ */
+static bool init_pressure_snapshot() {
+    struct lmk_pressure_snapshot *snapshot;
+    int fd;
+
+    if (pressure_snapshot) {
+        return true;
+    }
+
+    fd = memfd_create("lmkd_pressure_snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        ALOGE("memfd_create for pressure snapshot failed; errno=%d", errno);
+        return false;
+    }
+    if (ftruncate(fd, sizeof(*snapshot))) {
+        ALOGE("ftruncate for pressure snapshot failed; errno=%d", errno);
+        goto err_close;
+    }
+    snapshot = static_cast<struct lmk_pressure_snapshot *>(
+            mmap(NULL, sizeof(*snapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    if (snapshot == MAP_FAILED) {
+        ALOGE("mmap for pressure snapshot failed; errno=%d", errno);
+        goto err_close;
+    }
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL)) {
+        /* F_SEAL_FUTURE_WRITE requires 5.1 kernel */
+        ALOGE("Failed to seal pressure snapshot; errno=%d", errno);
+        munmap(snapshot, sizeof(*snapshot));
+        goto err_close;
+    }
+
+    snapshot->version = LMK_PRESSURE_SNAPSHOT_VERSION;
+    snapshot->size = sizeof(*snapshot);
+    pressure_snapshot = snapshot;
+    pressure_snapshot_fd = fd;
+    return true;
+
+err_close:
+    close(fd);
+    return false;
+}
+
+/* Update the shared pressure snapshot, readers detect concurrent updates by seq changes. */
+static void publish_pressure_snapshot(const struct lmk_pressure_snapshot *snapshot) {
+    uint32_t seq;
+
+    if (!pressure_snapshot) {
+        return;
+    }
+
+    seq = __atomic_load_n(&pressure_snapshot->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&pressure_snapshot->seq, seq + 1, __ATOMIC_RELAXED);
+    /* Make the odd seq visible before any field changes */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)pressure_snapshot + sizeof(seq), (const char *)snapshot + sizeof(seq),
+           sizeof(*snapshot) - sizeof(seq));
+    __atomic_store_n(&pressure_snapshot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Send the pressure snapshot memfd to a client as SCM_RIGHTS ancillary data. */
+static bool ctrl_data_write_pressure_snapshot(int dsock_idx) {
+    LMKD_CTRL_PACKET packet;
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    size_t len = lmkd_pack_set_pressure_snapshot(packet, LMK_PRESSURE_SNAPSHOT_VERSION,
+                                                 sizeof(struct lmk_pressure_snapshot));
+    struct iovec iov = {packet, len};
+    struct msghdr hdr = {
+            NULL, 0, &iov, 1, cmsg_buf, sizeof(cmsg_buf), 0,
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pressure_snapshot_fd, sizeof(int));
+
+    if (TEMP_FAILURE_RETRY(sendmsg(data_sock[dsock_idx].sock, &hdr, 0)) < 0) {
+        ALOGE("Failed to send pressure snapshot fd; errno=%d", errno);
+        return false;
+    }
+    return true;
+}
+
 static void cmd_subscribe(int dsock_idx, LMKD_CTRL_PACKET packet) {
     struct lmk_subscribe params;
 
     lmkd_pack_get_subscribe(packet, &params);
+    if (params.evt_type == LMK_ASYNC_EVENT_PRESSURE_SNAPSHOT &&
+        (!init_pressure_snapshot() || !ctrl_data_write_pressure_snapshot(dsock_idx))) {
+        return;
+    }
     data_sock[dsock_idx].async_event_mask |= 1 << params.evt_type;
 }
 
@@ -1633,7 +3192,28 @@ static int cmd_getkillcnt(LMKD_CTRL_PACKET packet) {
 
     lmkd_pack_get_getkillcnt(packet, &params);
 
-    return get_killcnt(params.min_oomadj, params.max_oomadj);
+    return get_killcnt(params.min_oomadj, params.max_oomadj);
+}
+
+static_assert((LMK_LATENCY_BUCKET_COUNT + 2) * sizeof(int) <= CTRL_PACKET_MAX_SIZE,
+              "LMK_GETLATENCYHIST reply does not fit into a packet");
+
+static void cmd_getlatencyhist(LMKD_CTRL_PACKET packet, struct lmk_getlatencyhist_reply *reply) {
+    struct lmk_getlatencyhist params;
+
+    lmkd_pack_get_getlatencyhist(packet, &params);
+    if ((int)params.stage < 0 || params.stage >= LMK_LATENCY_STAGE_COUNT) {
+        reply->stage = -1;
+        memset(reply->buckets, 0, sizeof(reply->buckets));
+        return;
+    }
+
+    reply->stage = params.stage;
+    if (params.stage == LMK_LATENCY_REAP) {
+        reaper.get_reap_latency_hist(reply->buckets);
+    } else {
+        memcpy(reply->buckets, latency_hist[params.stage], sizeof(reply->buckets));
+    }
 }
 
 static void cmd_target(int ntargets, LMKD_CTRL_PACKET packet) {
@@ -1712,178 +3292,308 @@ static void cmd_target(int ntargets, LMKD_CTRL_PACKET packet) {
     }
 }
 
-static void handle_io_uring_procs_prio(const struct lmk_procs_prio& params, const int procs_count,
-                                       struct ucred* cred) {
-    struct io_uring_sqe* sqe;
-    struct io_uring_cqe* cqe;
+/* open, read or write and close for each LMK_PROCS_PRIO record */
+#define PROCS_PRIO_RING_DEPTH (PROCS_PRIO_MAX_RECORD_COUNT * 4)
+#define PROCS_PRIO_BUF_SIZE 256
+
+enum procs_prio_op {
+    PROCS_PRIO_OP_OPEN = 0,
+    PROCS_PRIO_OP_IO,
+    PROCS_PRIO_OP_CLOSE,
+};
+
+#define PROCS_PRIO_USER_DATA(idx, op) (((unsigned long long)(idx) << 2) | (op))
+#define PROCS_PRIO_USER_DATA_IDX(data) ((data) >> 2)
+#define PROCS_PRIO_USER_DATA_OP(data) ((data) & 0x3)
+
+/* Registered with lmk_io_uring_ring as fixed buffers, one per record */
+static char procs_prio_buffers[PROCS_PRIO_MAX_RECORD_COUNT][PROCS_PRIO_BUF_SIZE];
+static char procs_prio_paths[PROCS_PRIO_MAX_RECORD_COUNT][PROCFS_PATH_MAX];
+
+static bool init_procs_prio_ring() {
+    struct iovec iovs[PROCS_PRIO_MAX_RECORD_COUNT];
     int fds[PROCS_PRIO_MAX_RECORD_COUNT];
-    char buffers[PROCS_PRIO_MAX_RECORD_COUNT]
-                [256]; /* Reading proc/stat and write to proc/oom_score_adj */
-    char path[PROCFS_PATH_MAX];
-    char val[20];
-    int64_t tgid;
     int ret;
-    int num_requests = 0;
 
-    ret = io_uring_queue_init(PROCS_PRIO_MAX_RECORD_COUNT, &lmk_io_uring_ring, 0);
+    ret = io_uring_queue_init(PROCS_PRIO_RING_DEPTH, &lmk_io_uring_ring, 0);
     if (ret) {
         ALOGE("LMK_PROCS_PRIO failed to setup io_uring ring: %s", strerror(-ret));
-        return;
+        return false;
+    }
+
+    for (size_t i = 0; i < PROCS_PRIO_MAX_RECORD_COUNT; i++) {
+        iovs[i].iov_base = procs_prio_buffers[i];
+        iovs[i].iov_len = sizeof(procs_prio_buffers[i]);
+    }
+    ret = io_uring_register_buffers(&lmk_io_uring_ring, iovs, PROCS_PRIO_MAX_RECORD_COUNT);
+    if (ret) {
+        ALOGE("LMK_PROCS_PRIO failed to register io_uring buffers: %s", strerror(-ret));
+        io_uring_queue_exit(&lmk_io_uring_ring);
+        return false;
+    }
+
+    /* Empty file table; slot i is used by the open/io/close chain of record i */
+    lmk_io_uring_direct_fds = false;
+    if (isIoUringDirectFdSupported) {
+        std::fill_n(fds, PROCS_PRIO_MAX_RECORD_COUNT, -1);
+        ret = io_uring_register_files(&lmk_io_uring_ring, fds, PROCS_PRIO_MAX_RECORD_COUNT);
+        if (ret) {
+            ALOGW("LMK_PROCS_PRIO failed to register io_uring files: %s", strerror(-ret));
+        } else {
+            lmk_io_uring_direct_fds = true;
+        }
+    }
+
+    lmk_io_uring_ring_initialized = true;
+    return true;
+}
+
+/*
+ * The ring can't be reused once submitting or reaping failed as SQEs or CQEs of the failed batch
+ * could be left in it, LMK_PROCS_PRIO records are applied one by one from then on.
+ */
+static void disable_procs_prio_ring() {
+    io_uring_queue_exit(&lmk_io_uring_ring);
+    lmk_io_uring_ring_initialized = false;
+    ALOGE("LMK_PROCS_PRIO io_uring batching is disabled");
+}
+
+/*
+ * Queue reading /proc/<pid>/status or writing /proc/<pid>/oom_score_adj of the record idx using
+ * its fixed buffer. With direct descriptors the open and close are linked with the I/O in the same
+ * submission, otherwise the file is opened here and fds[idx] should be closed on completion.
+ * Returns the number of queued SQEs or -1 if the ring ran out of SQEs.
+ */
+static int queue_io_uring_procs_prio(int idx, int pid, bool write, int fds[]) {
+    struct io_uring_sqe* sqe;
+    char *buf = procs_prio_buffers[idx];
+    char *path = procs_prio_paths[idx];
+    unsigned int len;
+    int fd = idx;
+    int flags = write ? O_WRONLY | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+
+    snprintf(path, PROCFS_PATH_MAX, write ? "/proc/%d/oom_score_adj" : "/proc/%d/status", pid);
+    /* Leave space for the terminating zero when reading */
+    len = write ? strlen(buf) : PROCS_PRIO_BUF_SIZE - 1;
+
+    if (!lmk_io_uring_direct_fds) {
+        fds[idx] = open(path, flags);
+        if (fds[idx] < 0) {
+            if (write) {
+                ALOGW("Failed to open %s; errno=%d: process %d might have been killed, skipping "
+                      "for LMK_PROCS_PRIO", path, errno, pid);
+            }
+            return 0;
+        }
+        sqe = io_uring_get_sqe(&lmk_io_uring_ring);
+        if (!sqe) {
+            close(fds[idx]);
+            fds[idx] = -1;
+            return -1;
+        }
+        if (write) {
+            io_uring_prep_write_fixed(sqe, fds[idx], buf, len, 0, idx);
+        } else {
+            io_uring_prep_read_fixed(sqe, fds[idx], buf, len, 0, idx);
+        }
+        io_uring_sqe_set_data64(sqe, PROCS_PRIO_USER_DATA(idx, PROCS_PRIO_OP_IO));
+        return 1;
+    }
+
+    /* Ring depth fits all chains of a packet, running out means the ring is in a bad state */
+    sqe = io_uring_get_sqe(&lmk_io_uring_ring);
+    if (!sqe) {
+        return -1;
+    }
+    io_uring_prep_openat_direct(sqe, AT_FDCWD, path, flags, 0, idx);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+    io_uring_sqe_set_data64(sqe, PROCS_PRIO_USER_DATA(idx, PROCS_PRIO_OP_OPEN));
+
+    sqe = io_uring_get_sqe(&lmk_io_uring_ring);
+    if (!sqe) {
+        return -1;
     }
+    if (write) {
+        io_uring_prep_write_fixed(sqe, fd, buf, len, 0, idx);
+    } else {
+        io_uring_prep_read_fixed(sqe, fd, buf, len, 0, idx);
+    }
+    /* Hard link so that the close runs even if the I/O fails */
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK);
+    io_uring_sqe_set_data64(sqe, PROCS_PRIO_USER_DATA(idx, PROCS_PRIO_OP_IO));
+
+    sqe = io_uring_get_sqe(&lmk_io_uring_ring);
+    if (!sqe) {
+        return -1;
+    }
+    io_uring_prep_close_direct(sqe, idx);
+    io_uring_sqe_set_data64(sqe, PROCS_PRIO_USER_DATA(idx, PROCS_PRIO_OP_CLOSE));
+
+    return 3;
+}
+
+/*
+ * Read /proc/<pid>/status or write /proc/<pid>/oom_score_adj for every record marked in
+ * pending[]. On return pending[] is set only for records which succeeded. Returns false and
+ * disables the ring if the batch could not be fully submitted or reaped.
+ */
+static bool run_io_uring_procs_prio(const struct lmk_procs_prio& params, const int procs_count,
+                                    bool write, bool pending[]) {
+    struct io_uring_cqe* cqe;
+    int fds[PROCS_PRIO_MAX_RECORD_COUNT];
+    bool done[PROCS_PRIO_MAX_RECORD_COUNT] = { false };
+    bool ring_ok = true;
+    int num_requests = 0;
+    int ret;
 
     std::fill_n(fds, PROCS_PRIO_MAX_RECORD_COUNT, -1);
     for (int i = 0; i < procs_count; i++) {
-        if (params.procs[i].oomadj < OOM_SCORE_ADJ_MIN ||
-            params.procs[i].oomadj > OOM_SCORE_ADJ_MAX)
-            ALOGW("Skipping invalid PROCS_PRIO oomadj=%d for pid=%d", params.procs[i].oomadj,
-                  params.procs[i].pid);
-        else if (params.procs[i].ptype < PROC_TYPE_FIRST ||
-                 params.procs[i].ptype >= PROC_TYPE_COUNT)
-            ALOGW("Skipping invalid PROCS_PRIO pid=%d for invalid process type arg %d",
-                  params.procs[i].pid, params.procs[i].ptype);
-        else {
-            snprintf(path, PROCFS_PATH_MAX, "/proc/%d/status", params.procs[i].pid);
-            fds[i] = open(path, O_RDONLY | O_CLOEXEC);
-            if (fds[i] < 0) continue;
-
-            sqe = io_uring_get_sqe(&lmk_io_uring_ring);
-            if (!sqe) {
-                ALOGE("LMK_PROCS_PRIO skipping pid (%d), failed to get SQE for read proc status",
-                      params.procs[i].pid);
-                close(fds[i]);
-                fds[i] = -1;
-                continue;
+        if (pending[i]) {
+            ret = queue_io_uring_procs_prio(i, params.procs[i].pid, write, fds);
+            if (ret < 0) {
+                ALOGE("LMK_PROCS_PRIO ran out of io_uring SQEs");
+                ring_ok = false;
+                goto out;
             }
-
-            io_uring_prep_read(sqe, fds[i], &buffers[i], sizeof(buffers[i]), 0);
-            sqe->user_data = i;
-            num_requests++;
+            num_requests += ret;
         }
     }
 
     if (num_requests == 0) {
-        ALOGW("LMK_PROCS_PRIO has no read proc status requests to process");
-        goto err;
+        ALOGW("LMK_PROCS_PRIO has no %s requests to process",
+              write ? "write proc oomadj" : "read proc status");
+        goto out;
     }
 
     ret = io_uring_submit(&lmk_io_uring_ring);
     if (ret <= 0 || ret != num_requests) {
-        ALOGE("Error submitting read processes' status to SQE: %s", strerror(ret));
-        goto err;
+        ALOGE("Error submitting LMK_PROCS_PRIO %s requests: %s", write ? "write" : "read",
+              strerror(ret < 0 ? -ret : EIO));
+        ring_ok = false;
+        goto out;
     }
 
     for (int i = 0; i < num_requests; i++) {
         ret = TEMP_FAILURE_RETRY(io_uring_wait_cqe(&lmk_io_uring_ring, &cqe));
         if (ret < 0 || !cqe) {
-            ALOGE("Failed to get CQE, in LMK_PROCS_PRIO, for read batching: %s", strerror(-ret));
-            goto err;
-        }
-        if (cqe->res < 0) {
-            ALOGE("Error in LMK_PROCS_PRIO for async proc status read operation: %s",
-                  strerror(-cqe->res));
-            continue;
-        }
-        if (cqe->user_data < 0 || static_cast<int>(cqe->user_data) > procs_count) {
-            ALOGE("Invalid LMK_PROCS_PRIO CQE read data: %llu", cqe->user_data);
-            continue;
+            ALOGE("Failed to get CQE, in LMK_PROCS_PRIO, for %s batching: %s",
+                  write ? "write" : "read", strerror(-ret));
+            ring_ok = false;
+            goto out;
         }
 
-        const int procs_idx = cqe->user_data;
-        close(fds[procs_idx]);
-        fds[procs_idx] = -1;
+        const int res = cqe->res;
+        const unsigned long long idx = PROCS_PRIO_USER_DATA_IDX(cqe->user_data);
+        const int op = PROCS_PRIO_USER_DATA_OP(cqe->user_data);
         io_uring_cqe_seen(&lmk_io_uring_ring, cqe);
 
-        if (parse_status_tag(buffers[procs_idx], PROC_STATUS_TGID_FIELD, &tgid) &&
-            tgid != params.procs[procs_idx].pid) {
-            ALOGE("Attempt to register a task that is not a thread group leader "
-                  "(tid %d, tgid %" PRId64 ")",
-                  params.procs[procs_idx].pid, tgid);
+        if (idx >= static_cast<unsigned long long>(procs_count)) {
+            ALOGE("Invalid LMK_PROCS_PRIO CQE data: %llu", idx);
             continue;
         }
-
-        /* Open write file to prepare for write batch */
-        snprintf(path, sizeof(path), "/proc/%d/oom_score_adj", params.procs[procs_idx].pid);
-        fds[procs_idx] = open(path, O_WRONLY | O_CLOEXEC);
-        if (fds[procs_idx] < 0) {
-            ALOGW("Failed to open %s; errno=%d: process %d might have been killed, skipping for "
-                  "LMK_PROCS_PRIO",
-                  path, errno, params.procs[procs_idx].pid);
+        if (op == PROCS_PRIO_OP_OPEN && res < 0 && write) {
+            ALOGW("Failed to open %s; errno=%d: process %d might have been killed, skipping "
+                  "for LMK_PROCS_PRIO", procs_prio_paths[idx], -res, params.procs[idx].pid);
+        }
+        if (op != PROCS_PRIO_OP_IO) {
+            continue;
+        }
+        if (fds[idx] >= 0) {
+            close(fds[idx]);
+            fds[idx] = -1;
+        }
+        /* -ECANCELED means the open in the same chain failed and was already handled */
+        if (res < 0 && res != -ECANCELED) {
+            ALOGE("Error in LMK_PROCS_PRIO for async proc %s operation: %s",
+                  write ? "oomadj write" : "status read", strerror(-res));
             continue;
         }
+        if (res >= 0) {
+            if (!write) {
+                procs_prio_buffers[idx][res] = '\0';
+            }
+            done[idx] = true;
+        }
     }
 
-    /* Prepare to write the new OOM score */
-    num_requests = 0;
-    for (int i = 0; i < procs_count; i++) {
-        if (fds[i] < 0) continue;
+out:
+    if (!ring_ok) {
+        /* Tear the ring down first so that no request still uses the descriptors */
+        disable_procs_prio_ring();
+    }
+    for (int fd : fds)
+        if (fd >= 0) close(fd);
+    for (int i = 0; i < procs_count; i++) pending[i] = done[i];
 
-        /* gid containing AID_READPROC required */
-        /* CAP_SYS_RESOURCE required */
-        /* CAP_DAC_OVERRIDE required */
-        snprintf(buffers[i], sizeof(buffers[i]), "%d", params.procs[i].oomadj);
-        sqe = io_uring_get_sqe(&lmk_io_uring_ring);
-        if (!sqe) {
-            ALOGE("LMK_PROCS_PRIO skipping pid (%d), failed to get SQE for write",
+    return ring_ok;
+}
+
+static void handle_io_uring_procs_prio(const struct lmk_procs_prio& params, const int procs_count,
+                                       struct ucred* cred) {
+    bool pending[PROCS_PRIO_MAX_RECORD_COUNT] = { false };
+    char path[PROCFS_PATH_MAX];
+    int64_t tgid;
+
+    for (int i = 0; i < procs_count; i++) {
+        if (params.procs[i].oomadj < OOM_SCORE_ADJ_MIN ||
+            params.procs[i].oomadj > OOM_SCORE_ADJ_MAX)
+            ALOGW("Skipping invalid PROCS_PRIO oomadj=%d for pid=%d", params.procs[i].oomadj,
                   params.procs[i].pid);
-            close(fds[i]);
-            fds[i] = -1;
-            continue;
-        }
-        io_uring_prep_write(sqe, fds[i], &buffers[i], sizeof(buffers[i]), 0);
-        sqe->user_data = i;
-        num_requests++;
+        else if (params.procs[i].ptype < PROC_TYPE_FIRST ||
+                 params.procs[i].ptype >= PROC_TYPE_COUNT)
+            ALOGW("Skipping invalid PROCS_PRIO pid=%d for invalid process type arg %d",
+                  params.procs[i].pid, params.procs[i].ptype);
+        else
+            pending[i] = true;
     }
 
-    if (num_requests == 0) {
-        ALOGW("LMK_PROCS_PRIO has no write proc oomadj requests to process");
-        goto err;
+    /*
+     * Status has to be checked before oom_score_adj is written because writing it for a thread
+     * would change the score of its whole thread group, hence two submissions.
+     */
+    if (!run_io_uring_procs_prio(params, procs_count, false, pending)) {
+        goto fallback;
     }
 
-    ret = io_uring_submit(&lmk_io_uring_ring);
-    if (ret <= 0 || ret != num_requests) {
-        ALOGE("Error submitting write data to sqe: %s", strerror(ret));
-        goto err;
-    }
+    for (int i = 0; i < procs_count; i++) {
+        if (!pending[i]) continue;
 
-    /* Handle async write completions for proc/<pid>/oom_score_adj */
-    for (int i = 0; i < num_requests; i++) {
-        ret = TEMP_FAILURE_RETRY(io_uring_wait_cqe(&lmk_io_uring_ring, &cqe));
-        if (ret < 0 || !cqe) {
-            ALOGE("Failed to get CQE, in LMK_PROCS_PRIO, for write batching: %s", strerror(-ret));
-            goto err;
-        }
-        if (cqe->res < 0) {
-            ALOGE("Error in LMK_PROCS_PRIO for async proc status read operation: %s",
-                  strerror(-cqe->res));
-            continue;
-        }
-        if (cqe->user_data < 0 || static_cast<int>(cqe->user_data) > procs_count) {
-            ALOGE("Invalid LMK_PROCS_PRIO CQE read data: %llu", cqe->user_data);
+        if (parse_status_tag(procs_prio_buffers[i], PROC_STATUS_TGID_FIELD, &tgid) &&
+            tgid != params.procs[i].pid) {
+            ALOGE("Attempt to register a task that is not a thread group leader "
+                  "(tid %d, tgid %" PRId64 ")",
+                  params.procs[i].pid, tgid);
+            pending[i] = false;
             continue;
         }
 
-        const int procs_idx = cqe->user_data;
-        close(fds[procs_idx]);
-        fds[procs_idx] = -1;
-        io_uring_cqe_seen(&lmk_io_uring_ring, cqe);
+        /* gid containing AID_READPROC required */
+        /* CAP_SYS_RESOURCE required */
+        /* CAP_DAC_OVERRIDE required */
+        snprintf(procs_prio_buffers[i], sizeof(procs_prio_buffers[i]), "%d",
+                 params.procs[i].oomadj);
+    }
+
+    if (!run_io_uring_procs_prio(params, procs_count, true, pending)) {
+        goto fallback;
+    }
+
+    for (int i = 0; i < procs_count; i++) {
+        if (!pending[i]) continue;
 
         if (use_inkernel_interface) {
-            stats_store_taskname(params.procs[procs_idx].pid,
-                                 proc_get_name(params.procs[procs_idx].pid, path, sizeof(path)));
+            register_kernel_lmk_proc(params.procs[i].pid, params.procs[i].oomadj,
+                                     proc_get_name(params.procs[i].pid, path, sizeof(path)));
             continue;
         }
 
-        register_oom_adj_proc(params.procs[procs_idx], cred);
+        register_oom_adj_proc(params.procs[i], cred);
     }
-
-    io_uring_queue_exit(&lmk_io_uring_ring);
     return;
 
-err:
-    for (int fd : fds)
-        if (fd >= 0) close(fd);
-    io_uring_queue_exit(&lmk_io_uring_ring);
-    return;
+fallback:
+    /* Writing oom_score_adj again is harmless for records the failed batch already applied */
+    for (int i = 0; i < procs_count; i++) apply_proc_prio(params.procs[i], cred);
 }
 
 static void cmd_procs_prio(LMKD_CTRL_PACKET packet, const int field_count, struct ucred* cred) {
@@ -1895,31 +3605,71 @@ static void cmd_procs_prio(LMKD_CTRL_PACKET packet, const int field_count, struc
         return;
     }
 
-    if (isIoUringSupported) {
+    if (lmk_io_uring_ring_initialized) {
         handle_io_uring_procs_prio(params, procs_count, cred);
     } else {
         for (int i = 0; i < procs_count; i++) apply_proc_prio(params.procs[i], cred);
     }
 }
 
-static void ctrl_command_handler(int dsock_idx) {
-    LMKD_CTRL_PACKET packet;
-    struct ucred cred;
-    int len;
+/*
+ * Replies of the commands in LMK_BATCH packet, sent together once all commands are executed.
+ * Used only from the main thread.
+ */
+static struct {
+    bool active;
+    int count;
+    int sizes[LMK_BATCH_MAX_CMDS];
+    LMKD_CTRL_PACKET packets[LMK_BATCH_MAX_CMDS];
+} batch_reply;
+
+/* Send a command reply or store it if the command is a part of LMK_BATCH packet */
+static int ctrl_data_reply(int dsock_idx, char* buf, size_t bufsz) {
+    if (!batch_reply.active) {
+        return ctrl_data_write(dsock_idx, buf, bufsz);
+    }
+
+    if (batch_reply.count == LMK_BATCH_MAX_CMDS) {
+        /* Can't happen as each command has at most one reply */
+        return -1;
+    }
+    memcpy(batch_reply.packets[batch_reply.count], buf, bufsz);
+    batch_reply.sizes[batch_reply.count++] = bufsz;
+    return bufsz;
+}
+
+/* Send all stored replies of LMK_BATCH commands in one message */
+static void ctrl_data_write_batch_reply(int dsock_idx) {
+    int header[LMK_BATCH_HEADER_SIZE / sizeof(int)];
+    int sizes[LMK_BATCH_MAX_CMDS];
+    struct iovec iov[1 + 2 * LMK_BATCH_MAX_CMDS];
+    int iovcnt = 0;
+
+    if (!batch_reply.count) {
+        return;
+    }
+
+    lmkd_pack_set_batch_header(header, batch_reply.count);
+    iov[iovcnt++] = {header, sizeof(header)};
+    for (int i = 0; i < batch_reply.count; i++) {
+        sizes[i] = htonl(batch_reply.sizes[i]);
+        iov[iovcnt++] = {&sizes[i], sizeof(int)};
+        iov[iovcnt++] = {batch_reply.packets[i], (size_t)batch_reply.sizes[i]};
+    }
+
+    if (TEMP_FAILURE_RETRY(writev(data_sock[dsock_idx].sock, iov, iovcnt)) < 0) {
+        ALOGE("control data socket write failed; errno=%d", errno);
+    }
+}
+
+static void ctrl_command_exec(int dsock_idx, LMKD_CTRL_PACKET packet, int len,
+                              struct ucred *cred) {
     enum lmk_cmd cmd;
     int nargs;
     int targets;
     int kill_cnt;
     int result;
-
-    len = ctrl_data_read(dsock_idx, (char *)packet, CTRL_PACKET_MAX_SIZE, &cred);
-    if (len <= 0)
-        return;
-
-    if (len < (int)sizeof(int)) {
-        ALOGE("Wrong control socket read length len=%d", len);
-        return;
-    }
+    struct lmk_getlatencyhist_reply latency_reply;
 
     cmd = lmkd_pack_get_cmd(packet);
     nargs = len / sizeof(int) - 1;
@@ -1938,24 +3688,24 @@ static void ctrl_command_handler(int dsock_idx) {
         /* process type field is optional for backward compatibility */
         if (nargs < 3 || nargs > 4)
             goto wronglen;
-        cmd_procprio(packet, nargs, &cred);
+        cmd_procprio(packet, nargs, cred);
         break;
     case LMK_PROCREMOVE:
         if (nargs != 1)
             goto wronglen;
-        cmd_procremove(packet, &cred);
+        cmd_procremove(packet, cred);
         break;
     case LMK_PROCPURGE:
         if (nargs != 0)
             goto wronglen;
-        cmd_procpurge(&cred);
+        cmd_procpurge(cred);
         break;
     case LMK_GETKILLCNT:
         if (nargs != 2)
             goto wronglen;
         kill_cnt = cmd_getkillcnt(packet);
         len = lmkd_pack_set_getkillcnt_repl(packet, kill_cnt);
-        if (ctrl_data_write(dsock_idx, (char *)packet, len) != len)
+        if (ctrl_data_reply(dsock_idx, (char *)packet, len) != len)
             return;
         break;
     case LMK_SUBSCRIBE:
@@ -1973,9 +3723,7 @@ static void ctrl_command_handler(int dsock_idx) {
         result = -1;
         if (update_props()) {
             if (!use_inkernel_interface && monitors_initialized) {
-                /* Reinitialize monitors to apply new settings */
-                destroy_monitors();
-                if (init_monitors()) {
+                if (update_monitors()) {
                     result = 0;
                 }
             } else {
@@ -1989,7 +3737,7 @@ static void ctrl_command_handler(int dsock_idx) {
         }
 
         len = lmkd_pack_set_update_props_repl(packet, result);
-        if (ctrl_data_write(dsock_idx, (char *)packet, len) != len) {
+        if (ctrl_data_reply(dsock_idx, (char *)packet, len) != len) {
             ALOGE("Failed to report operation results");
         }
         if (!result) {
@@ -2046,12 +3794,24 @@ static void ctrl_command_handler(int dsock_idx) {
         }
 
         len = lmkd_pack_set_boot_completed_notif_repl(packet, result);
-        if (ctrl_data_write(dsock_idx, (char*)packet, len) != len) {
+        if (ctrl_data_reply(dsock_idx, (char*)packet, len) != len) {
             ALOGE("Failed to report boot-completed operation results");
         }
         break;
     case LMK_PROCS_PRIO:
-        cmd_procs_prio(packet, nargs, &cred);
+        cmd_procs_prio(packet, nargs, cred);
+        break;
+    case LMK_BATCH:
+        /* Batches can't be nested */
+        ALOGE("Received unexpected command code %d", cmd);
+        break;
+    case LMK_GETLATENCYHIST:
+        if (nargs != 1)
+            goto wronglen;
+        cmd_getlatencyhist(packet, &latency_reply);
+        len = lmkd_pack_set_getlatencyhist_repl(packet, &latency_reply);
+        if (ctrl_data_reply(dsock_idx, (char *)packet, len) != len)
+            return;
         break;
     default:
         ALOGE("Received unknown command code %d", cmd);
@@ -2064,6 +3824,49 @@ wronglen:
     ALOGE("Wrong control socket read length cmd=%d len=%d", cmd, len);
 }
 
+static void ctrl_command_handler(int dsock_idx) {
+    LMKD_BATCH_PACKET buf;
+    LMKD_CTRL_PACKET packet;
+    struct ucred cred;
+    size_t offset;
+    int cmd_count;
+    int len;
+    int size = 0;
+
+    len = ctrl_data_read(dsock_idx, (char *)buf, sizeof(buf), &cred);
+    if (len <= 0)
+        return;
+
+    if (len < (int)sizeof(int)) {
+        ALOGE("Wrong control socket read length len=%d", len);
+        return;
+    }
+
+    if (lmkd_pack_get_cmd(buf) != LMK_BATCH) {
+        /* Longer packets used to be truncated by the read, keep ignoring the excess */
+        len = std::min(len, (int)CTRL_PACKET_MAX_SIZE);
+        memcpy(packet, buf, len);
+        ctrl_command_exec(dsock_idx, packet, len, &cred);
+        return;
+    }
+
+    batch_reply.active = true;
+    batch_reply.count = 0;
+    offset = LMK_BATCH_HEADER_SIZE;
+    for (cmd_count = 0; cmd_count < LMK_BATCH_MAX_CMDS; cmd_count++) {
+        size = lmkd_pack_get_batch_next(buf, len, &offset, packet);
+        if (size <= 0) {
+            break;
+        }
+        ctrl_command_exec(dsock_idx, packet, size, &cred);
+    }
+    if (size < 0 || (size > 0 && offset != (size_t)len)) {
+        ALOGE("Malformed batch packet len=%d offset=%zu", len, offset);
+    }
+    batch_reply.active = false;
+    ctrl_data_write_batch_reply(dsock_idx);
+}
+
 static void ctrl_data_handler(int data, uint32_t events,
                               struct polling_params *poll_params __unused) {
     if (events & EPOLLIN) {
@@ -2189,7 +3992,7 @@ static int zoneinfo_parse_zone(char **buf, struct zoneinfo_zone *zone) {
             continue;
         }
 
-        match_res = match_field(cp, ap, zoneinfo_zone_field_names, ZI_ZONE_FIELD_COUNT,
+        match_res = match_field(cp, ap, zoneinfo_zone_field_names, zoneinfo_zone_field_hash,
             &val, &field_idx);
         if (match_res == PARSE_FAIL) {
             return false;
@@ -2239,7 +4042,7 @@ static int zoneinfo_parse_node(char **buf, struct zoneinfo_node *node, char *nam
             return false;
         }
 
-        match_res = match_field(cp, ap, zoneinfo_node_field_names, ZI_NODE_FIELD_COUNT,
+        match_res = match_field(cp, ap, zoneinfo_node_field_names, zoneinfo_node_field_hash,
             &val, &field_idx);
         if (match_res == PARSE_FAIL) {
             return false;
@@ -2255,12 +4058,8 @@ static int zoneinfo_parse_node(char **buf, struct zoneinfo_node *node, char *nam
     return false;
 }
 
-static int zoneinfo_parse(struct zoneinfo *zi) {
-    static struct reread_data file_data = {
-        .filename = ZONEINFO_PATH,
-        .fd = -1,
-    };
-    char *buf;
+/* Parses zoneinfo content in buf, which is modified. Safe to call from any thread. */
+static int zoneinfo_parse_buf(char *buf, struct zoneinfo *zi) {
     char *save_ptr;
     char *line;
     char zone_name[LINE_MAX + 1];
@@ -2270,10 +4069,6 @@ static int zoneinfo_parse(struct zoneinfo *zi) {
 
     memset(zi, 0, sizeof(struct zoneinfo));
 
-    if ((buf = reread_file(&file_data)) == NULL) {
-        return -1;
-    }
-
     for (line = strtok_r(buf, "\n", &save_ptr); line;
          line = strtok_r(NULL, "\n", &save_ptr)) {
         int node_id;
@@ -2285,7 +4080,7 @@ static int zoneinfo_parse(struct zoneinfo *zi) {
                     node_idx++;
                     if (node_idx == MAX_NR_NODES) {
                         /* max node count exceeded */
-                        ALOGE("%s parse error", file_data.filename);
+                        ALOGE("%s parse error", ZONEINFO_PATH);
                         return -1;
                     }
                 }
@@ -2293,7 +4088,7 @@ static int zoneinfo_parse(struct zoneinfo *zi) {
                 node->id = node_id;
                 zone_idx = 0;
                 if (!zoneinfo_parse_node(&save_ptr, node, zone_name)) {
-                    ALOGE("%s parse error", file_data.filename);
+                    ALOGE("%s parse error", ZONEINFO_PATH);
                     return -1;
                 }
             } else {
@@ -2301,14 +4096,14 @@ static int zoneinfo_parse(struct zoneinfo *zi) {
                 zone_idx++;
             }
             if (!zoneinfo_parse_zone(&save_ptr, &node->zones[zone_idx])) {
-                ALOGE("%s parse error", file_data.filename);
+                ALOGE("%s parse error", ZONEINFO_PATH);
                 return -1;
             }
             strlcpy(node->zones[zone_idx].name, zone_name, LINE_MAX);
         }
     }
     if (!node) {
-        ALOGE("%s parse error", file_data.filename);
+        ALOGE("%s parse error", ZONEINFO_PATH);
         return -1;
     }
     node->zone_count = zone_idx + 1;
@@ -2327,33 +4122,87 @@ static int zoneinfo_parse(struct zoneinfo *zi) {
     return 0;
 }
 
-/* /proc/meminfo parsing routines */
-static bool meminfo_parse_line(char *line, union meminfo *mi) {
-    char *cp = line;
-    char *ap;
-    char *save_ptr;
-    int64_t val;
-    int field_idx;
-    enum field_match_result match_res;
+static int zoneinfo_parse(struct zoneinfo *zi) {
+    static struct reread_data file_data = {
+        .filename = ZONEINFO_PATH,
+        .fd = -1,
+    };
+    char *buf;
+
+    if ((buf = mem_source->read(SNAPSHOT_ZONEINFO, &file_data)) == NULL) {
+        memset(zi, 0, sizeof(struct zoneinfo));
+        return -1;
+    }
+
+    return zoneinfo_parse_buf(buf, zi);
+}
+
+/*
+ * Starts a detached worker thread. Workers must not inherit SCHED_FIFO of the main thread
+ * so that they never compete with it for the CPU.
+ */
+static bool start_worker_thread(void *(*start_routine)(void *), const char *name) {
+    pthread_t thread;
+    struct sched_param param = {
+        .sched_priority = 0,
+    };
+
+    if (pthread_create(&thread, NULL, start_routine, NULL)) {
+        ALOGE("pthread_create failed: %s", strerror(errno));
+        return false;
+    }
+    if (pthread_setschedparam(thread, SCHED_OTHER, &param)) {
+        ALOGW("set SCHED_OTHER failed %s", strerror(errno));
+    }
+    if (pthread_setname_np(thread, name)) {
+        ALOGW("pthread_setname_np failed: %s", strerror(errno));
+    }
+    pthread_detach(thread);
+
+    return true;
+}
+
+/*
+ * Blocks a worker thread until its eventfd is signaled. On failure the worker backs off
+ * instead of spinning on a broken eventfd.
+ */
+static bool worker_wait_event(int fd, const char *what) {
+    uint64_t val;
 
-    cp = strtok_r(line, " ", &save_ptr);
-    if (!cp) {
-        return false;
+    if (TEMP_FAILURE_RETRY(read(fd, &val, sizeof(val))) == sizeof(val)) {
+        return true;
     }
+    ALOGE("Failed to wait for %s: %s", what, strerror(errno));
+    usleep(WORKER_WAIT_RETRY_MS * US_PER_MS);
 
-    ap = strtok_r(NULL, " ", &save_ptr);
-    if (!ap) {
-        return false;
-    }
+    return false;
+}
+
+/* Reads the whole file into *buf, growing it as needed. Used only by the sampler thread. */
+static char *memory_sampler_read(int fd, char **buf, ssize_t *buf_size) {
+    ssize_t size;
 
-    match_res = match_field(cp, ap, meminfo_field_names, MI_FIELD_COUNT,
-        &val, &field_idx);
-    if (match_res == PARSE_SUCCESS) {
-        mi->arr[field_idx] = val / page_k;
+    while (true) {
+        size = read_all(fd, *buf, *buf_size - 1);
+        if (size < 0) {
+            return NULL;
+        }
+        if (size < *buf_size - 1) {
+            break;
+        }
+        char *new_buf = static_cast<char *>(realloc(*buf, *buf_size * 2));
+        if (!new_buf) {
+            return NULL;
+        }
+        *buf = new_buf;
+        *buf_size *= 2;
     }
-    return (match_res != PARSE_FAIL);
+    (*buf)[size] = '\0';
+
+    return *buf;
 }
 
+/* /proc/meminfo parsing routines */
 static int64_t read_gpu_total_kb() {
     static int fd = android::bpf::bpfFdGet(
             "/sys/fs/bpf/map_gpuMem_gpu_mem_total_map", BPF_F_RDONLY);
@@ -2369,32 +4218,38 @@ static int64_t read_gpu_total_kb() {
             : (int32_t)(value / 1024);
 }
 
+/* line_map caches the field layout of the buffers parsed by the calling thread */
+static int meminfo_parse_buf(char *buf, union meminfo *mi,
+                             struct field_line_map<MI_FIELD_COUNT> *line_map) {
+    memset(mi, 0, sizeof(union meminfo));
+
+    if (!parse_fields(buf, meminfo_field_names, meminfo_field_hash, line_map, mi->arr)) {
+        ALOGE("%s parse error", MEMINFO_PATH);
+        return -1;
+    }
+    for (int i = 0; i < MI_FIELD_COUNT; i++) {
+        mi->arr[i] /= page_k;
+    }
+    mi->field.total_gpu_kb = read_gpu_total_kb();
+    mi->field.easy_available = mi->field.nr_free_pages + mi->field.inactive_file;
+
+    return 0;
+}
+
 static int meminfo_parse(union meminfo *mi) {
     static struct reread_data file_data = {
         .filename = MEMINFO_PATH,
         .fd = -1,
     };
+    static struct field_line_map<MI_FIELD_COUNT> line_map;
     char *buf;
-    char *save_ptr;
-    char *line;
 
-    memset(mi, 0, sizeof(union meminfo));
-
-    if ((buf = reread_file(&file_data)) == NULL) {
+    if ((buf = mem_source->read(SNAPSHOT_MEMINFO, &file_data)) == NULL) {
+        memset(mi, 0, sizeof(union meminfo));
         return -1;
     }
 
-    for (line = strtok_r(buf, "\n", &save_ptr); line;
-         line = strtok_r(NULL, "\n", &save_ptr)) {
-        if (!meminfo_parse_line(line, mi)) {
-            ALOGE("%s parse error", file_data.filename);
-            return -1;
-        }
-    }
-    mi->field.total_gpu_kb = read_gpu_total_kb();
-    mi->field.easy_available = mi->field.nr_free_pages + mi->field.inactive_file;
-
-    return 0;
+    return meminfo_parse_buf(buf, mi, &line_map);
 }
 
 // In the case of ZRAM, mi->field.free_swap can't be used directly because swap space is taken
@@ -2410,30 +4265,28 @@ static inline int64_t get_free_swap(union meminfo *mi) {
 }
 
 /* /proc/vmstat parsing routines */
-static bool vmstat_parse_line(char *line, union vmstat *vs) {
-    char *cp;
-    char *ap;
-    char *save_ptr;
-    int64_t val;
-    int field_idx;
-    enum field_match_result match_res;
+static void vmstat_init(union vmstat *vs) {
+    memset(vs, 0, sizeof(union vmstat));
 
-    cp = strtok_r(line, " ", &save_ptr);
-    if (!cp) {
-        return false;
-    }
+    /*
+     * Per-zone related info need not present. Prefill them.
+     * If exist, they can be overridden. This change helps
+     * us to check which all zone info we can look into.
+     */
+    for (int i = VS_PGSKIP_FIRST_ZONE; i <= VS_PGSKIP_LAST_ZONE; i++)
+        vs->arr[i] = -EINVAL;
+}
 
-    ap = strtok_r(NULL, " ", &save_ptr);
-    if (!ap) {
-        return false;
+/* line_map caches the field layout of the buffers parsed by the calling thread */
+static int vmstat_parse_buf(char *buf, union vmstat *vs,
+                            struct field_line_map<VS_FIELD_COUNT> *line_map) {
+    vmstat_init(vs);
+    if (!parse_fields(buf, vmstat_field_names, vmstat_field_hash, line_map, vs->arr)) {
+        ALOGE("%s parse error", VMSTAT_PATH);
+        return -1;
     }
 
-    match_res = match_field(cp, ap, vmstat_field_names, VS_FIELD_COUNT,
-        &val, &field_idx);
-    if (match_res == PARSE_SUCCESS) {
-        vs->arr[field_idx] = val;
-    }
-    return (match_res != PARSE_FAIL);
+    return 0;
 }
 
 static int vmstat_parse(union vmstat *vs) {
@@ -2441,41 +4294,128 @@ static int vmstat_parse(union vmstat *vs) {
         .filename = VMSTAT_PATH,
         .fd = -1,
     };
+    static struct field_line_map<VS_FIELD_COUNT> line_map;
     char *buf;
-    char *save_ptr;
-    char *line;
-    int i;
-
-    memset(vs, 0, sizeof(union vmstat));
 
-    /*
-     * Per-zone related info need not present. Prefill them.
-     * If exist, they can be overridden. This change helps
-     * us to check which all zone info we can look into.
-     */
-    for (i = VS_PGSKIP_FIRST_ZONE; i <= VS_PGSKIP_LAST_ZONE; i++)
-        vs->arr[i] = -EINVAL;
-    if ((buf = reread_file(&file_data)) == NULL) {
+    if ((buf = mem_source->read(SNAPSHOT_VMSTAT, &file_data)) == NULL) {
+        vmstat_init(vs);
         return -1;
     }
 
-    for (line = strtok_r(buf, "\n", &save_ptr); line;
-         line = strtok_r(NULL, "\n", &save_ptr)) {
-        if (!vmstat_parse_line(line, vs)) {
-            ALOGE("%s parse error", file_data.filename);
-            return -1;
+    return vmstat_parse_buf(buf, vs, &line_map);
+}
+
+/*
+ * With ro.lmk.zoneinfo_sample_ms set, a sampler thread keeps re-reading and parsing
+ * /proc/vmstat, /proc/meminfo and /proc/zoneinfo at that interval, and pressure checks take its
+ * latest sample instead of reading the files on the main thread. Samples are not used when
+ * memory state comes from an io_uring snapshot, is traced or replayed, since those have to see
+ * every read.
+ */
+struct memory_sample {
+    union vmstat vs;
+    union meminfo mi;
+    struct zoneinfo zi;
+    struct timespec tm;
+};
+static struct memory_sample memory_sample;
+static bool memory_sample_valid;
+/* Guards the published sample, held only to copy it */
+static std::mutex memory_sample_lock;
+static bool memory_sampler_started;
+
+/* Reads the file at path into *buf, opening it on first use */
+static char *memory_sampler_read_file(const char *path, int *fd, char **buf, ssize_t *buf_size) {
+    if (*fd < 0 && (*fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC))) < 0) {
+        return NULL;
+    }
+
+    return memory_sampler_read(*fd, buf, buf_size);
+}
+
+static void *memory_sampler_main(void *param __unused) {
+    static struct memory_sample sample;
+    static struct field_line_map<VS_FIELD_COUNT> vs_line_map;
+    static struct field_line_map<MI_FIELD_COUNT> mi_line_map;
+    ssize_t buf_size = getpagesize();
+    char *buf = static_cast<char *>(malloc(buf_size));
+    int vs_fd = -1;
+    int mi_fd = -1;
+    int zi_fd = -1;
+
+    if (!buf) {
+        ALOGE("Failed to set up memory sampling: %s", strerror(errno));
+        return NULL;
+    }
+
+    for (;;) {
+        int sample_ms = zoneinfo_sample_ms;
+
+        if (sample_ms <= 0) {
+            /* Disabled by a property update, wait to be enabled again */
+            usleep(PSI_WINDOW_SIZE_MS * US_PER_MS);
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &sample.tm);
+        if (memory_sampler_read_file(VMSTAT_PATH, &vs_fd, &buf, &buf_size) &&
+            vmstat_parse_buf(buf, &sample.vs, &vs_line_map) == 0 &&
+            memory_sampler_read_file(MEMINFO_PATH, &mi_fd, &buf, &buf_size) &&
+            meminfo_parse_buf(buf, &sample.mi, &mi_line_map) == 0 &&
+            memory_sampler_read_file(ZONEINFO_PATH, &zi_fd, &buf, &buf_size) &&
+            zoneinfo_parse_buf(buf, &sample.zi) == 0) {
+            std::scoped_lock lock(memory_sample_lock);
+
+            memory_sample = sample;
+            memory_sample_valid = true;
         }
+        usleep(sample_ms * US_PER_MS);
     }
 
-    return 0;
+    return NULL;
+}
+
+/* Starts the sampler once ro.lmk.zoneinfo_sample_ms is set, it keeps running from then on */
+static bool init_memory_sampler() {
+#ifdef LMKD_REPLAY
+    return true;
+#else
+    if (zoneinfo_sample_ms <= 0 || memory_sampler_started) {
+        return true;
+    }
+    memory_sampler_started = start_worker_thread(memory_sampler_main, "lmkd_memsample");
+
+    return memory_sampler_started;
+#endif
+}
+
+/*
+ * Copies the sampler's vmstat, meminfo and zoneinfo into vs, mi and zi when they were read
+ * within zoneinfo_sample_ms before tm. Returns false if the files have to be parsed instead.
+ */
+static bool memory_sample_get(union vmstat *vs, union meminfo *mi, struct zoneinfo *zi,
+                              struct timespec *tm) {
+    std::scoped_lock lock(memory_sample_lock);
+
+    if (!memory_sampler_started || zoneinfo_sample_ms <= 0 || use_io_uring_snapshot ||
+        trace_fp || mem_source != &live_mem_source || !memory_sample_valid ||
+        get_time_diff_ms(&memory_sample.tm, tm) > zoneinfo_sample_ms) {
+        return false;
+    }
+    *vs = memory_sample.vs;
+    *mi = memory_sample.mi;
+    *zi = memory_sample.zi;
+
+    return true;
 }
 
-static int psi_parse(struct reread_data *file_data, struct psi_stats stats[], bool full) {
+static int psi_parse(struct reread_data *file_data, enum snapshot_file snapshot,
+                     struct psi_stats stats[], bool full) {
     char *buf;
     char *save_ptr;
     char *line;
 
-    if ((buf = reread_file(file_data)) == NULL) {
+    if ((buf = mem_source->read(snapshot, file_data)) == NULL) {
         return -1;
     }
 
@@ -2498,7 +4438,7 @@ static int psi_parse_mem(struct psi_data *psi_data) {
             .filename = psi_resource_file[PSI_MEMORY],
             .fd = -1,
     };
-    return psi_parse(&file_data, psi_data->mem_stats, true);
+    return psi_parse(&file_data, SNAPSHOT_PSI_MEMORY, psi_data->mem_stats, true);
 }
 
 static int psi_parse_io(struct psi_data *psi_data) {
@@ -2506,7 +4446,7 @@ static int psi_parse_io(struct psi_data *psi_data) {
             .filename = psi_resource_file[PSI_IO],
             .fd = -1,
     };
-    return psi_parse(&file_data, psi_data->io_stats, true);
+    return psi_parse(&file_data, SNAPSHOT_PSI_IO, psi_data->io_stats, true);
 }
 
 static int psi_parse_cpu(struct psi_data *psi_data) {
@@ -2514,7 +4454,7 @@ static int psi_parse_cpu(struct psi_data *psi_data) {
             .filename = psi_resource_file[PSI_CPU],
             .fd = -1,
     };
-    return psi_parse(&file_data, psi_data->cpu_stats, false);
+    return psi_parse(&file_data, SNAPSHOT_PSI_CPU, psi_data->cpu_stats, false);
 }
 
 enum wakeup_reason {
@@ -2528,6 +4468,7 @@ struct wakeup_info {
     struct timespec last_event_tm;
     int wakeups_since_event;
     int skipped_wakeups;
+    int saved_wakeups; /* wakeups avoided by adaptive polling */
 };
 
 /*
@@ -2547,6 +4488,7 @@ static void record_wakeup_time(struct timespec *tm, enum wakeup_reason reason,
         wi->last_event_tm = *tm;
         wi->wakeups_since_event = 0;
         wi->skipped_wakeups = 0;
+        wi->saved_wakeups = 0;
     } else {
         wi->wakeups_since_event++;
     }
@@ -2757,173 +4699,421 @@ static struct proc *proc_adj_head(int oomadj) {
     return (struct proc *)&procadjslot_list[ADJTOSLOT(oomadj)];
 }
 
-// When called from a non-main thread, adjslot_list_lock read lock should be taken.
-static struct proc *proc_adj_tail(int oomadj) {
-    return (struct proc *)adjslot_tail(&procadjslot_list[ADJTOSLOT(oomadj)]);
+// When called from a non-main thread, adjslot_list_lock read lock should be taken.
+static struct proc *proc_adj_tail(int oomadj) {
+    return (struct proc *)adjslot_tail(&procadjslot_list[ADJTOSLOT(oomadj)]);
+}
+
+// When called from a non-main thread, adjslot_list_lock read lock should be taken.
+static struct proc *proc_adj_prev(int oomadj, int pid) {
+    struct adjslot_list *head = &procadjslot_list[ADJTOSLOT(oomadj)];
+    struct adjslot_list *curr = adjslot_tail(&procadjslot_list[ADJTOSLOT(oomadj)]);
+
+    while (curr != head) {
+        if (((struct proc *)curr)->pid == pid) {
+            return (struct proc *)curr->prev;
+        }
+        curr = curr->prev;
+    }
+
+    return NULL;
+}
+
+// Can be called only from the main thread.
+static struct proc *proc_get_heaviest_indexed(int oomadj) {
+    struct proc_heap *heap = &procadjslot_heap[ADJTOSLOT(oomadj)];
+    struct proc *procp;
+    struct timespec curr_tm;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &curr_tm);
+    if (heap->unsized > 0) {
+        /* Processes that were never sized could be the heaviest ones, size them first */
+        struct adjslot_list *head = &procadjslot_list[ADJTOSLOT(oomadj)];
+        struct adjslot_list *curr = head->next;
+
+        while (curr != head) {
+            procp = (struct proc *)curr;
+            curr = curr->next;
+            if (proc_size_unknown(procp) && proc_refresh_size(procp, &curr_tm) < 0) {
+                pid_remove(procp->pid);
+            }
+        }
+    }
+
+    /* Verify the top of the heap until it holds a size read during this call */
+    while (heap->count > 0) {
+        procp = heap->procs[0];
+        if (get_time_diff_ms(&procp->size_cache_tm, &curr_tm) <= 0) {
+            return procp->size_cache > 0 ? procp : NULL;
+        }
+        if (proc_refresh_size(procp, &curr_tm) < 0) {
+            pid_remove(procp->pid);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * When one node is starving, rank processes by the memory they have on that node so that the
+ * kill relieves it. Processes without a node sample are assumed to be spread evenly.
+ */
+static long proc_numa_weighted_size(struct proc *procp, long size) {
+    /* numa_maps counts of nodes with higher ids are not kept */
+    if (procp->node_pages_valid && numa_target_node_id < MAX_NR_NODES) {
+        return std::min(procp->node_pages[numa_target_node_id], size);
+    }
+    return size / numa_node_count;
+}
+
+/*
+ * Cached sizes of app uids summed over their processes at or above the oom_score_adj level being
+ * looked at, which are the processes killed together by ro.lmk.kill_uid_group with a victim at
+ * that level. Levels are added from the top as victim selection walks down. Main thread only.
+ */
+static std::unordered_map<uid_t, long> uid_footprint;
+
+static void uid_footprint_add_level(int oomadj) {
+    struct adjslot_list *head = &procadjslot_list[ADJTOSLOT(oomadj)];
+
+    for (struct adjslot_list *curr = head->next; curr != head; curr = curr->next) {
+        struct proc *procp = (struct proc *)curr;
+
+        if (procp->uid >= AID_APP_START && procp->size_cache > 0) {
+            uid_footprint[procp->uid] += procp->size_cache;
+        }
+    }
+}
+
+static long uid_footprint_get(uid_t uid) {
+    auto it = uid_footprint.find(uid);
+
+    return it == uid_footprint.end() ? 0 : it->second;
+}
+
+// Can be called only from the main thread.
+static struct proc *proc_get_heaviest(int oomadj) {
+    struct adjslot_list *head = &procadjslot_list[ADJTOSLOT(oomadj)];
+    struct adjslot_list *curr;
+    struct proc *maxprocp;
+    long maxsize;
+    struct timespec curr_tm;
+
+    /* Filter out PApps */
+    struct proc *maxprocp_pa;
+    long maxsize_pa;
+
+    if (head->next == head) {
+        return NULL;
+    }
+
+    /*
+     * The heap is keyed on size only and can't be used to filter out PApps or rank by node or by
+     * app uid footprint
+     */
+    if (use_heaviest_index && proc_size_cache_ms > 0 && !enable_preferred_apps &&
+        numa_target_node < 0 && !kill_uid_group &&
+        !procadjslot_heap[ADJTOSLOT(oomadj)].incomplete) {
+        return proc_get_heaviest_indexed(oomadj);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &curr_tm);
+retry:
+    maxprocp = NULL;
+    maxsize = 0;
+    maxprocp_pa = NULL;
+    maxsize_pa = 0;
+    curr = head->next;
+    while (curr != head) {
+        struct proc *procp = (struct proc *)curr;
+        long tasksize = proc_get_cached_size(procp, &curr_tm);
+        if (tasksize < 0) {
+            struct adjslot_list *next = curr->next;
+            pid_remove(procp->pid);
+            curr = next;
+        } else {
+            if (numa_target_node >= 0) {
+                tasksize = proc_numa_weighted_size(procp, tasksize);
+            }
+            if (!uid_footprint.empty()) {
+                tasksize = std::max(tasksize, uid_footprint_get(procp->uid));
+            }
+            if (enable_preferred_apps && proc_is_preferred(procp)) {
+                if (tasksize > maxsize_pa) {
+                    maxsize_pa = tasksize;
+                    maxprocp_pa = procp;
+                }
+            } else {
+                if (tasksize > maxsize) {
+                    maxsize = tasksize;
+                    maxprocp = procp;
+                }
+            }
+            curr = curr->next;
+        }
+    }
+    if (maxsize <= 0) {
+        maxprocp = maxprocp_pa;
+    }
+
+    /*
+     * The choice was made using cached sizes, verify the chosen process with a fresh read. A freshly
+     * read entry is not picked up for verification again, so this repeats a bounded number of times.
+     */
+    if (maxprocp && get_time_diff_ms(&maxprocp->size_cache_tm, &curr_tm) > 0) {
+        long tasksize = proc_refresh_size(maxprocp, &curr_tm);
+        if (tasksize < 0) {
+            pid_remove(maxprocp->pid);
+            goto retry;
+        }
+        if (tasksize == 0) {
+            goto retry;
+        }
+    }
+
+    return maxprocp;
+}
+
+/*
+ * Refresh up to max_count stale process size cache entries so that victim selection under
+ * pressure can be done without reading /proc for each candidate. Slots are walked from the most
+ * killable one and each pass resumes where the previous one stopped.
+ */
+static void proc_size_cache_refresh(int max_count) {
+    static int slot = ADJTOSLOT(OOM_SCORE_ADJ_MAX);
+    int slots_left = ADJTOSLOT(OOM_SCORE_ADJ_MAX) - ADJTOSLOT(0) + 1;
+    struct timespec curr_tm;
+
+    if (proc_size_cache_ms <= 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &curr_tm);
+    while (slots_left-- > 0) {
+        struct adjslot_list *head = &procadjslot_list[slot];
+        struct adjslot_list *curr = head->next;
+
+        while (curr != head) {
+            struct proc *procp = (struct proc *)curr;
+
+            curr = curr->next;
+            if (proc_size_cache_valid(procp, &curr_tm)) {
+                continue;
+            }
+            if (max_count-- <= 0) {
+                /* Continue from this slot next time */
+                return;
+            }
+            if (proc_refresh_size(procp, &curr_tm) < 0) {
+                pid_remove(procp->pid);
+            }
+        }
+        slot = slot > ADJTOSLOT(0) ? slot - 1 : ADJTOSLOT(OOM_SCORE_ADJ_MAX);
+    }
+}
+
+static bool proc_get_oomadj(int pid, int *oomadj) {
+    static char path[PROCFS_PATH_MAX];
+    static char line[LINE_MAX];
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/oom_score_adj", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    len = read_all(fd, line, sizeof(line) - 1);
+    close(fd);
+    if (len < 0) {
+        return false;
+    }
+    line[len] = '\0';
+
+    if (sscanf(line, "%d", oomadj) != 1) {
+        ALOGE("Parsing oomadj %s failed", line);
+        return false;
+    }
+
+    return true;
+}
+
+static int native_index_find(int pid) {
+    for (int i = 0; i < native_index_count; i++) {
+        if (native_index[i].pid == pid) {
+            return i;
+        }
+    }
+
+    return -1;
 }
 
-// When called from a non-main thread, adjslot_list_lock read lock should be taken.
-static struct proc *proc_adj_prev(int oomadj, int pid) {
-    struct adjslot_list *head = &procadjslot_list[ADJTOSLOT(oomadj)];
-    struct adjslot_list *curr = adjslot_tail(&procadjslot_list[ADJTOSLOT(oomadj)]);
+static void native_index_add(int pid) {
+    int pidfd = -1;
 
-    while (curr != head) {
-        if (((struct proc *)curr)->pid == pid) {
-            return (struct proc *)curr->prev;
+    if (pidfd_supported) {
+        pidfd = TEMP_FAILURE_RETRY(pidfd_open(pid, 0));
+        if (pidfd < 0) {
+            /* The process is gone */
+            return;
         }
-        curr = curr->prev;
     }
 
-    return NULL;
+    native_index[native_index_count].pid = pid;
+    native_index[native_index_count].pidfd = pidfd;
+    native_index_count++;
 }
 
-// Can be called only from the main thread.
-static struct proc *proc_get_heaviest(int oomadj) {
-    struct adjslot_list *head = &procadjslot_list[ADJTOSLOT(oomadj)];
-    struct adjslot_list *curr = head->next;
-    struct proc *maxprocp = NULL;
-    int maxsize = 0;
+static void native_index_remove(int idx) {
+    if (native_index[idx].pidfd >= 0) {
+        close(native_index[idx].pidfd);
+    }
+    native_index[idx] = native_index[--native_index_count];
+}
 
-    /* Filter out PApps */
-    struct proc *maxprocp_pa = NULL;
-    int maxsize_pa = 0;
-    char *tmp_taskname;
-    char buf[LINE_MAX];
+static int native_proc_signal(const struct native_proc *np, int sig) {
+    return np->pidfd >= 0 ? pidfd_send_signal(np->pidfd, sig, NULL, 0) : kill(np->pid, sig);
+}
 
-    while (curr != head) {
-        int pid = ((struct proc *)curr)->pid;
-        long tasksize = proc_get_size(pid);
-        if (tasksize < 0) {
-            struct adjslot_list *next = curr->next;
-            pid_remove(pid);
-            curr = next;
-        } else {
-            tmp_taskname = proc_get_name(pid, buf, sizeof(buf));
-            if (enable_preferred_apps && tmp_taskname != NULL && strstr(preferred_apps, tmp_taskname)) {
-                if (tasksize > maxsize_pa) {
-                    maxsize_pa = tasksize;
-                    maxprocp_pa = (struct proc *)curr;
-                }
-            } else {
-                if (tasksize > maxsize) {
-                    maxsize = tasksize;
-                    maxprocp = (struct proc *)curr;
-                }
-            }
-            curr = curr->next;
+/* Drop entries of the processes that exited */
+static void native_index_prune() {
+    for (int i = native_index_count - 1; i >= 0; i--) {
+        if (native_proc_signal(&native_index[i], 0) && errno == ESRCH) {
+            native_index_remove(i);
         }
     }
-    if (maxsize > 0) {
-        return maxprocp;
-    } else {
-        return maxprocp_pa;
+}
+
+/* /proc being scanned by native_index_scan(), NULL if the next scan starts over */
+static DIR* native_index_dir;
+
+/* Make the next scan start from the beginning of /proc */
+static void native_index_rewind() {
+    if (native_index_dir) {
+        closedir(native_index_dir);
+        native_index_dir = NULL;
     }
 }
 
 /*
- * Allow lmkd to "find" shell scripts with oom_score_adj >= 0
- * Since we are not informed when a shell script exit, the generated
- * list may be obsolete. This case is handled by the loop in
- * find_and_kill_processes.
+ * Look at up to max_count /proc entries for unregistered processes with oom_score_adj >= 0 to
+ * add them to the native process index. Each call resumes the scan where the previous one stopped.
+ * Returns false once the end of /proc is reached, true if the scan stopped before.
  */
-static long proc_get_script(void)
-{
-    static DIR* d = NULL;
+static bool native_index_scan(int max_count) {
     struct dirent* de;
-    static char path[PATH_MAX];
-    static char line[LINE_MAX];
-    ssize_t len;
-    int fd, oomadj = OOM_SCORE_ADJ_MIN;
-    int r;
-    uint32_t pid;
-    long total_vm;
-    long tasksize = 0;
-    static bool retry_eligible = false;
-    struct timespec curr_tm;
-    static struct timespec last_traverse_time;
-    static bool check_time = false;
+    bool pruned = false;
+    int pid;
+    int oomadj;
 
-    if (check_time) {
-        clock_gettime(CLOCK_MONOTONIC_COARSE, &curr_tm);
-        if (get_time_diff_ms(&last_traverse_time, &curr_tm) <
-                PSI_PROC_TRAVERSE_DELAY_MS) {
-            return 0;
+    if (!native_index_dir) {
+        native_index_prune();
+        pruned = true;
+        if (!(native_index_dir = opendir("/proc"))) {
+            ALOGE("Failed to open /proc");
+            return false;
         }
     }
-repeat:
-    if (!d && !(d = opendir("/proc"))) {
-        ALOGE("Failed to open /proc");
-        return 0;
-    }
 
-    while ((de = readdir(d))) {
-        if (sscanf(de->d_name, "%u", &pid) != 1) {
-            continue;
+    while (max_count-- > 0) {
+        if (native_index_count == NATIVE_INDEX_SIZE) {
+            /* Make room by dropping the exited processes, at most once per call */
+            if (!pruned) {
+                native_index_prune();
+                pruned = true;
+            }
+            if (native_index_count == NATIVE_INDEX_SIZE) {
+                return true;
+            }
+        }
+        if (!(de = readdir(native_index_dir))) {
+            native_index_rewind();
+            return false;
         }
 
         /* Don't attempt to kill init */
-        if (pid == 1) {
+        if (sscanf(de->d_name, "%d", &pid) != 1 || pid == 1) {
             continue;
         }
 
-        /*
-     * Don't attempt to kill kthreads. Rely on total_vm for this.
-     */
-        total_vm = proc_get_vm(pid);
-        if (total_vm <= 0) {
+        /* Registered processes are killed using their records */
+        if (pid_lookup(pid) || native_index_find(pid) >= 0) {
             continue;
         }
 
-        snprintf(path, sizeof(path), "/proc/%u/oom_score_adj", pid);
-        fd = open(path, O_RDONLY | O_CLOEXEC);
-        if (fd < 0) {
+        if (!proc_get_oomadj(pid, &oomadj) || oomadj < 0) {
             continue;
         }
 
-        len = read_all(fd, line, sizeof(line) - 1);
-        close(fd);
-
-        if (len < 0) {
+        /* Don't attempt to kill kthreads. Rely on total_vm for this. */
+        if (proc_get_vm(pid) <= 0) {
             continue;
         }
 
-        line[LINE_MAX - 1] = '\0';
+        native_index_add(pid);
+    }
 
-        if (sscanf(line, "%d", &oomadj) != 1) {
-            ALOGE("Parsing oomadj %s failed", line);
-            continue;
-        }
+    return true;
+}
 
-        if (oomadj < 0) {
-            continue;
-        }
+/*
+ * Allow lmkd to "find" shell scripts with oom_score_adj >= 0
+ * Since we are not informed when a shell script exit, the index
+ * may be obsolete. Entries are verified before the kill and the
+ * failed ones are dropped. If none of them can be killed, up to
+ * NATIVE_INDEX_KILL_SCAN_COUNT more /proc entries are indexed, at
+ * most once per PSI_PROC_TRAVERSE_DELAY_MS.
+ */
+static long proc_get_script(void)
+{
+    int oomadj;
+    long tasksize;
+    bool scanned = false;
+    struct timespec curr_tm;
+    static struct timespec last_traverse_time;
 
-        tasksize = proc_get_size(pid);
-        if (tasksize <= 0) {
-            continue;
-        }
+    for (;;) {
+        /* Removing an entry moves the last one into its place, so walk the index backwards */
+        for (int i = native_index_count - 1; i >= 0; i--) {
+            struct native_proc *np = &native_index[i];
+            int pid = np->pid;
 
-        retry_eligible = true;
-        check_time = false;
-        r = kill(pid, SIGKILL);
-        if (r) {
-            ALOGE("kill(%d): errno=%d", pid, errno);
-            tasksize = 0;
-        } else {
-            ULMK_LOG(I, "Kill native with pid %u, oom_adj %d, to free %ld pages",
-                            pid, oomadj, tasksize);
-        }
+            /* The process could have registered or changed its oom_score_adj since indexed */
+            if (pid_lookup(pid) || !proc_get_oomadj(pid, &oomadj) || oomadj < 0) {
+                native_index_remove(i);
+                continue;
+            }
 
-        return tasksize;
-    }
-    closedir(d);
-    d = NULL;
-    if (retry_eligible) {
-        retry_eligible = false;
-        goto repeat;
+            tasksize = proc_get_size(pid);
+            if (tasksize <= 0) {
+                native_index_remove(i);
+                continue;
+            }
+
+            if (native_proc_signal(np, SIGKILL)) {
+                ALOGE("kill(%d): errno=%d", pid, errno);
+                native_index_remove(i);
+                continue;
+            }
+            ULMK_LOG(I, "Kill native with pid %d, oom_adj %d, to free %ld pages",
+                     pid, oomadj, tasksize);
+            native_index_remove(i);
+
+            return tasksize;
+        }
+        /* None of the indexed processes could be killed, resume indexing /proc */
+        if (scanned) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &curr_tm);
+        if (get_time_diff_ms(&last_traverse_time, &curr_tm) < PSI_PROC_TRAVERSE_DELAY_MS) {
+            break;
+        }
+        last_traverse_time = curr_tm;
+        native_index_scan(NATIVE_INDEX_KILL_SCAN_COUNT);
+        scanned = true;
     }
-    check_time = true;
-    clock_gettime(CLOCK_MONOTONIC_COARSE, &last_traverse_time);
     ALOGI("proc_get_script: No tasks are found to kill");
 
     return 0;
@@ -2969,7 +5159,11 @@ static void watchdog_callback() {
 
         if (target.valid && reaper.kill({ target.pidfd, target.pid, target.uid }, true) == 0) {
             ALOGW("lmkd watchdog killed process %d, oom_score_adj %d", target.pid, oom_score);
-            killinfo_log(&target, 0, 0, 0, NULL, NULL, NULL, NULL, NULL);
+            {
+                std::scoped_lock lock(kill_report_lock);
+
+                killinfo_log(&target, 0, 0, 0, NULL, NULL, NULL, NULL, NULL);
+            }
             // Can't call pid_remove() from non-main thread, therefore just invalidate the record
             pid_invalidate(target.pid);
             break;
@@ -3004,6 +5198,112 @@ static bool is_waiting_for_kill(void) {
     return pidfd_supported && last_kill_pid_or_fd >= 0;
 }
 
+/*
+ * Starts measuring the memory freed by a kill from base_mi, the memory state the kill decision
+ * was made on, or stops measuring without it. Kills done by the same decision are added to the
+ * measurement started by the first one.
+ */
+static void kill_efficacy_start(uid_t uid, int oomadj, enum kill_reasons kill_reason,
+                                int64_t estimated_pages, union meminfo *base_mi, bool in_batch) {
+    if (in_batch && kill_efficacy_pending) {
+        /* Freed memory of a batch can't be split between different uids */
+        if (kill_efficacy_st.uid != static_cast<int32_t>(uid)) {
+            kill_efficacy_st.uid = -1;
+        }
+        kill_efficacy_st.estimated_kb += estimated_pages * page_k;
+        return;
+    }
+    if (!base_mi) {
+        kill_efficacy_pending = false;
+        return;
+    }
+
+    kill_efficacy_st.uid = static_cast<int32_t>(uid);
+    kill_efficacy_st.oom_score = oomadj;
+    kill_efficacy_st.kill_reason = kill_reason;
+    kill_efficacy_st.estimated_kb = estimated_pages * page_k;
+    kill_efficacy_base_free = base_mi->field.nr_free_pages;
+    kill_efficacy_base_swap = get_free_swap(base_mi);
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &kill_efficacy_base_tm);
+    kill_efficacy_pending = true;
+}
+
+/*
+ * Measures the memory freed by the kills once the last killed process exited, reports it and
+ * updates the expected kill efficacy of the victim uid used to rank kill candidates. Samples are
+ * dropped when other memory activity could account for most of the change: the kill took too long
+ * to free its memory or allocations outpaced it and free memory went down.
+ */
+static void kill_efficacy_finish() {
+    struct timespec curr_tm;
+    union meminfo mi;
+    int64_t free_delta;
+    int64_t freed_pages;
+    long elapsed_ms;
+    int scaled_pct;
+
+    if (!kill_efficacy_pending) {
+        return;
+    }
+    kill_efficacy_pending = false;
+    if (kill_efficacy_st.estimated_kb <= 0 || meminfo_parse(&mi) < 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &curr_tm);
+    elapsed_ms = get_time_diff_ms(&kill_efficacy_base_tm, &curr_tm);
+    free_delta = mi.field.nr_free_pages - kill_efficacy_base_free;
+    if (elapsed_ms > KILL_EFFICACY_MAX_SAMPLE_MS || free_delta < 0) {
+        ULMK_LOG(D, "Dropping efficacy sample of uid %d: free memory changed by %" PRId64
+                 "kB in %ldms", kill_efficacy_st.uid, free_delta * page_k, elapsed_ms);
+        return;
+    }
+
+    /* Swap released by the kill frees the memory zram used to store it */
+    freed_pages = free_delta + std::max((int64_t)0, get_free_swap(&mi) - kill_efficacy_base_swap) *
+                  zram_swap_cost_pct(&curr_tm) / 100;
+    kill_efficacy_st.freed_kb = freed_pages * page_k;
+    scaled_pct = std::min((int64_t)KILL_EFFICACY_FULL,
+                          kill_efficacy_st.freed_kb * KILL_EFFICACY_FULL /
+                          kill_efficacy_st.estimated_kb);
+
+    if (kill_efficacy_st.uid >= static_cast<int32_t>(AID_APP_START)) {
+        uid_t uid = static_cast<uid_t>(kill_efficacy_st.uid);
+        auto it = uid_kill_efficacy.find(uid);
+
+        if (it != uid_kill_efficacy.end()) {
+            int avg = uid_kill_efficacy_decayed(&it->second, &curr_tm);
+
+            it->second.scaled_pct = std::max(avg + (scaled_pct - avg) / KILL_EFFICACY_EWMA_DIV,
+                                             KILL_EFFICACY_MIN_PCT * KILL_EFFICACY_SCALE);
+        } else {
+            struct uid_efficacy efficacy = {
+                std::max(scaled_pct, KILL_EFFICACY_MIN_PCT * KILL_EFFICACY_SCALE), curr_tm };
+
+            if (uid_kill_efficacy.size() >= KILL_EFFICACY_MAX_UIDS) {
+                /* Forget the uid sampled least recently */
+                auto oldest = uid_kill_efficacy.begin();
+                for (auto e = uid_kill_efficacy.begin(); e != uid_kill_efficacy.end(); ++e) {
+                    if (get_time_diff_ms(&e->second.tm, &oldest->second.tm) > 0) {
+                        oldest = e;
+                    }
+                }
+                uid_kill_efficacy.erase(oldest);
+            }
+            it = uid_kill_efficacy.emplace(uid, efficacy).first;
+        }
+        it->second.tm = curr_tm;
+        scaled_pct = it->second.scaled_pct;
+    }
+    kill_efficacy_st.efficacy_pct = (scaled_pct + KILL_EFFICACY_SCALE / 2) / KILL_EFFICACY_SCALE;
+
+    ULMK_LOG(I, "Kill of uid %d (adj %d, reason %d) freed %" PRId64 "kB of %" PRId64
+             "kB estimated, efficacy %d%%", kill_efficacy_st.uid, kill_efficacy_st.oom_score,
+             kill_efficacy_st.kill_reason, kill_efficacy_st.freed_kb,
+             kill_efficacy_st.estimated_kb, kill_efficacy_st.efficacy_pct);
+    stats_write_lmk_kill_efficacy(&kill_efficacy_st);
+}
+
 static void stop_wait_for_proc_kill(bool finished) {
     struct epoll_event epev;
 
@@ -3011,6 +5311,13 @@ static void stop_wait_for_proc_kill(bool finished) {
         return;
     }
 
+    if (finished) {
+        kill_latency_st.exit_us = get_latency_us(&last_kill_request_tm);
+        record_latency(LMK_LATENCY_EXIT, kill_latency_st.exit_us);
+        stats_write_lmk_kill_latency(&kill_latency_st);
+        kill_efficacy_finish();
+    }
+
     if (debug_process_killing) {
         struct timespec curr_tm;
 
@@ -3044,6 +5351,46 @@ static void stop_wait_for_proc_kill(bool finished) {
     last_kill_pid_or_fd = -1;
 }
 
+#define PROC_EXIT_EVENTS_MAX 32
+
+/* Remove records of the registered processes that exited */
+static void proc_exit_handler(int data __unused, uint32_t events __unused,
+                              struct polling_params *poll_params __unused) {
+    struct epoll_event exit_events[PROC_EXIT_EVENTS_MAX];
+    int nevents;
+    int i;
+
+    do {
+        nevents = epoll_wait(proc_epollfd, exit_events, PROC_EXIT_EVENTS_MAX, 0);
+        for (i = 0; i < nevents; i++) {
+            pid_remove(static_cast<struct proc*>(exit_events[i].data.ptr)->pid);
+        }
+    } while (nevents == PROC_EXIT_EVENTS_MAX);
+}
+
+static bool init_proc_exit_tracking() {
+    static struct event_handler_info proc_exit_hinfo = { 0, proc_exit_handler };
+    struct epoll_event epev;
+
+    proc_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (proc_epollfd < 0) {
+        ALOGE("epoll_create for process exits failed; errno=%d", errno);
+        return false;
+    }
+
+    epev.events = EPOLLIN;
+    epev.data.ptr = (void *)&proc_exit_hinfo;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, proc_epollfd, &epev) != 0) {
+        ALOGE("epoll_ctl for process exits failed; errno=%d", errno);
+        close(proc_epollfd);
+        proc_epollfd = -1;
+        return false;
+    }
+    maxevents++;
+
+    return true;
+}
+
 static void kill_done_handler(int data __unused, uint32_t events __unused,
                               struct polling_params *poll_params) {
     stop_wait_for_proc_kill(true);
@@ -3063,11 +5410,17 @@ static void kill_fail_handler(int data __unused, uint32_t events __unused,
     poll_params->update = POLLING_RESUME;
 }
 
-static void start_wait_for_proc_kill(int pid_or_fd) {
+/*
+ * Start waiting for death of the killed process. When several processes are killed at once only
+ * the last one is waited for, replace_wait indicates that.
+ */
+static void start_wait_for_proc_kill(int pid_or_fd, bool replace_wait) {
     static struct event_handler_info kill_done_hinfo = { 0, kill_done_handler };
     struct epoll_event epev;
 
-    if (last_kill_pid_or_fd >= 0) {
+    if (replace_wait) {
+        stop_wait_for_proc_kill(false);
+    } else if (last_kill_pid_or_fd >= 0) {
         /* Should not happen but if it does we should stop previous wait */
         ALOGE("Attempt to wait for a kill while another wait is in progress");
         stop_wait_for_proc_kill(false);
@@ -3091,14 +5444,185 @@ static void start_wait_for_proc_kill(int pid_or_fd) {
     maxevents++;
 }
 
-/* Kill one process specified by procp.  Returns the size (in pages) of the process killed */
+/*
+ * Kill logging that is not needed for the next decision (kill log line, killinfo event and the
+ * sys.lmk.count property) is done by a low priority thread from a snapshot taken at the kill. The
+ * data socket writes stay on the main thread which owns the sockets and the memory stat is read
+ * before the kill while the process still exists.
+ */
+#define KILL_REPORT_QUEUE_SIZE 8
+static_assert((KILL_REPORT_QUEUE_SIZE & (KILL_REPORT_QUEUE_SIZE - 1)) == 0,
+              "KILL_REPORT_QUEUE_SIZE should be a power of 2");
+
+struct kill_report {
+    struct proc proc; /* only pid, uid and oomadj are set */
+    struct kill_stat kill_st;
+    char taskname[MAX_TASKNAME_LEN];
+    int64_t rss_kb;
+    int64_t swap_kb;
+    bool has_ki;
+    struct kill_info ki;
+    char kill_desc[LINE_MAX];
+    union meminfo mi;
+    bool has_wi;
+    struct wakeup_info wi;
+    struct timespec tm;
+    bool has_pd;
+    struct psi_data pd;
+};
+
+/* Single-producer single-consumer ring, filled by the main thread and drained by the worker */
+static struct kill_report kill_report_queue[KILL_REPORT_QUEUE_SIZE];
+static std::atomic<uint32_t> kill_report_head; /* modified only by the worker */
+static std::atomic<uint32_t> kill_report_tail; /* modified only by the main thread */
+static int kill_report_event_fd = -1;
+
+static void kill_report_emit(struct kill_report *r) {
+    std::scoped_lock lock(kill_report_lock);
+
+    if (r->has_ki) {
+        ULMK_LOG(I,"Kill '%s' (%d), uid %d, oom_score_adj %d to free %" PRId64 "kB rss, %" PRId64
+              "kB swap; reason: %s", r->taskname, r->proc.pid, r->proc.uid, r->proc.oomadj,
+              r->rss_kb, r->swap_kb, r->kill_desc);
+    } else {
+        ULMK_LOG(I,"Kill '%s' (%d), uid %d, oom_score_adj %d to free %" PRId64 "kB rss, %" PRId64
+              "kb swap", r->taskname, r->proc.pid, r->proc.uid, r->proc.oomadj, r->rss_kb,
+              r->swap_kb);
+    }
+    killinfo_log(&r->proc, r->kill_st.min_oom_score, r->rss_kb, r->swap_kb,
+                 r->has_ki ? &r->ki : NULL, &r->mi, r->has_wi ? &r->wi : NULL, &r->tm,
+                 r->has_pd ? &r->pd : NULL);
+    prop_log_lmk_kill_occurred(&r->kill_st);
+}
+
+/*
+ * Counts published as sys.lmk.compaction_stats: compactions requested in the upper and kills
+ * avoided in the lower 32 bits. Updated by the main thread and published by the worker.
+ */
+static std::atomic<uint64_t> compaction_stats_report;
+
+static void kill_report_publish_compaction_stats() {
+    static uint64_t published;
+    uint64_t stats = compaction_stats_report.load(std::memory_order_relaxed);
+    char value[PROPERTY_VALUE_MAX];
+
+    if (stats == published) {
+        return;
+    }
+    published = stats;
+    snprintf(value, sizeof(value), "%u,%u", (unsigned int)(stats >> 32), (unsigned int)stats);
+    property_set("sys.lmk.compaction_stats", value);
+}
+
+static void *kill_report_main(void *param __unused) {
+    if (setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_BACKGROUND)) {
+        ALOGW("Unable to lower priority of the kill report thread: errno=%d", errno);
+    }
+
+    for (;;) {
+        if (!worker_wait_event(kill_report_event_fd, "kill reports")) {
+            continue;
+        }
+
+        uint32_t head = kill_report_head.load(std::memory_order_relaxed);
+        while (head != kill_report_tail.load(std::memory_order_acquire)) {
+            kill_report_emit(&kill_report_queue[head & (KILL_REPORT_QUEUE_SIZE - 1)]);
+            kill_report_head.store(++head, std::memory_order_release);
+        }
+        kill_report_publish_compaction_stats();
+    }
+
+    return NULL;
+}
+
+static bool init_kill_report() {
+    kill_report_event_fd = eventfd(0, EFD_CLOEXEC);
+    if (kill_report_event_fd < 0) {
+        ALOGE("eventfd failed: %s", strerror(errno));
+        return false;
+    }
+    if (!start_worker_thread(kill_report_main, "lmkd_report")) {
+        close(kill_report_event_fd);
+        kill_report_event_fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+/* Report the kill from the worker or synchronously when it is unavailable or behind */
+static void kill_report_submit(struct proc *procp, struct kill_stat *kill_st, int64_t rss_kb,
+                               int64_t swap_kb, struct kill_info *ki, union meminfo *mi,
+                               struct wakeup_info *wi, struct timespec *tm, struct psi_data *pd) {
+    static struct kill_report sync_report;
+    uint32_t tail = kill_report_tail.load(std::memory_order_relaxed);
+    bool queued = kill_report_event_fd >= 0 &&
+                  tail - kill_report_head.load(std::memory_order_acquire) < KILL_REPORT_QUEUE_SIZE;
+    struct kill_report *r = queued ? &kill_report_queue[tail & (KILL_REPORT_QUEUE_SIZE - 1)] :
+                                     &sync_report;
+    uint64_t val = 1;
+
+    r->proc.pid = procp->pid;
+    r->proc.uid = procp->uid;
+    r->proc.oomadj = procp->oomadj;
+    strlcpy(r->taskname, kill_st->taskname, sizeof(r->taskname));
+    r->kill_st = *kill_st;
+    r->kill_st.taskname = r->taskname;
+    r->rss_kb = rss_kb;
+    r->swap_kb = swap_kb;
+    r->has_ki = ki != NULL;
+    if (ki) {
+        r->ki = *ki;
+        strlcpy(r->kill_desc, ki->kill_desc ? ki->kill_desc : "", sizeof(r->kill_desc));
+        r->ki.kill_desc = r->kill_desc;
+    }
+    r->mi = *mi;
+    r->has_wi = wi != NULL;
+    if (wi) {
+        r->wi = *wi;
+    }
+    r->tm = *tm;
+    r->has_pd = pd != NULL;
+    if (pd) {
+        r->pd = *pd;
+    }
+
+    if (!queued) {
+        kill_report_emit(r);
+        return;
+    }
+    kill_report_tail.store(tail + 1, std::memory_order_release);
+    if (TEMP_FAILURE_RETRY(write(kill_report_event_fd, &val, sizeof(val))) != sizeof(val)) {
+        ALOGE("Failed to wake up the kill report thread: %s", strerror(errno));
+    }
+}
+
+/* Publish compaction stats from the worker or synchronously when it is unavailable */
+static void kill_report_compaction_stats(unsigned int compactions, unsigned int kills_avoided) {
+    uint64_t val = 1;
+
+    compaction_stats_report.store((uint64_t)compactions << 32 | kills_avoided,
+                                  std::memory_order_relaxed);
+    if (kill_report_event_fd < 0) {
+        kill_report_publish_compaction_stats();
+        return;
+    }
+    if (TEMP_FAILURE_RETRY(write(kill_report_event_fd, &val, sizeof(val))) != sizeof(val)) {
+        ALOGE("Failed to wake up the kill report thread: %s", strerror(errno));
+    }
+}
+
+/*
+ * Kill one process specified by procp.  Returns the size (in pages) of the process killed.
+ * in_batch should be set for all but the first process killed by the same decision.
+ */
 static int kill_one_process(struct proc* procp, int min_oom_score, struct kill_info *ki,
                             union meminfo *mi, struct wakeup_info *wi, struct timespec *tm,
-                            struct psi_data *pd) {
+                            struct psi_data *pd, bool in_batch) {
     int pid = procp->pid;
     int pidfd = procp->pidfd;
     uid_t uid = procp->uid;
-    char *taskname;
+    const char *taskname;
     int kill_result;
     int result = -1;
     struct memory_stat *mem_st;
@@ -3109,27 +5633,42 @@ static int kill_one_process(struct proc* procp, int min_oom_score, struct kill_i
     char buf[BUF_MAX];
     char desc[LINE_MAX];
 
-    if (!procp->valid || !read_proc_status(pid, buf, sizeof(buf))) {
-        goto out;
-    }
-    if (!parse_status_tag(buf, PROC_STATUS_TGID_FIELD, &tgid)) {
-        ALOGE("Unable to parse tgid from /proc/%d/status", pid);
-        goto out;
-    }
-    if (tgid != pid) {
-        ALOGE("Possible pid reuse detected (pid %d, tgid %" PRId64 ")!", pid, tgid);
+    if (!procp->valid) {
         goto out;
     }
-    // Zombie processes will not have RSS / Swap fields.
-    if (!parse_status_tag(buf, PROC_STATUS_RSS_FIELD, &rss_kb)) {
-        goto out;
-    }
-    if (!parse_status_tag(buf, PROC_STATUS_SWAP_FIELD, &swap_kb)) {
-        goto out;
+    if (procp->exit_tracked) {
+        /*
+         * The kill goes through the pidfd which can't refer to a reused pid and exited processes
+         * are removed when their pidfd reports it, so the sizes read for victim selection are
+         * used instead of re-reading the status.
+         */
+        if (!proc_size_cache_valid(procp, tm) && proc_refresh_size(procp, tm) < 0) {
+            goto out;
+        }
+        rss_kb = procp->rss_kb;
+        swap_kb = procp->swap_kb;
+    } else {
+        if (!read_proc_status(pid, buf, sizeof(buf))) {
+            goto out;
+        }
+        if (!parse_status_tag(buf, PROC_STATUS_TGID_FIELD, &tgid)) {
+            ALOGE("Unable to parse tgid from /proc/%d/status", pid);
+            goto out;
+        }
+        if (tgid != pid) {
+            ALOGE("Possible pid reuse detected (pid %d, tgid %" PRId64 ")!", pid, tgid);
+            goto out;
+        }
+        // Zombie processes will not have RSS / Swap fields.
+        if (!parse_status_tag(buf, PROC_STATUS_RSS_FIELD, &rss_kb)) {
+            goto out;
+        }
+        if (!parse_status_tag(buf, PROC_STATUS_SWAP_FIELD, &swap_kb)) {
+            goto out;
+        }
     }
 
-    taskname = proc_get_name(pid, buf, sizeof(buf));
-    // taskname will point inside buf, do not reuse buf onwards.
+    taskname = proc_get_cached_name(procp);
     if (!taskname) {
         goto out;
     }
@@ -3152,7 +5691,8 @@ static int kill_one_process(struct proc* procp, int min_oom_score, struct kill_i
 
     trace_kill_start(desc);
 
-    start_wait_for_proc_kill(pidfd < 0 ? pid : pidfd);
+    start_wait_for_proc_kill(pidfd < 0 ? pid : pidfd, in_batch);
+    clock_gettime(CLOCK_MONOTONIC, &last_kill_request_tm);
     kill_result = reaper.kill({ pidfd, pid, uid }, false);
 
     trace_kill_end();
@@ -3165,6 +5705,10 @@ static int kill_one_process(struct proc* procp, int min_oom_score, struct kill_i
     }
 
     last_kill_tm = *tm;
+    kill_latency_st = pressure_latency_st;
+    kill_latency_st.uid = static_cast<int32_t>(uid);
+    kill_latency_st.oom_score = procp->oomadj;
+    kill_latency_st.kill_reason = ki ? ki->kill_reason : NONE;
 
     inc_killcnt(procp->oomadj);
 
@@ -3172,18 +5716,11 @@ static int kill_one_process(struct proc* procp, int min_oom_score, struct kill_i
         kill_st.kill_reason = ki->kill_reason;
         kill_st.thrashing = ki->thrashing;
         kill_st.max_thrashing = ki->max_thrashing;
-        ULMK_LOG(I,"Kill '%s' (%d), uid %d, oom_score_adj %d to free %" PRId64 "kB rss, %" PRId64
-              "kB swap; reason: %s", taskname, pid, uid, procp->oomadj, rss_kb, swap_kb,
-              ki->kill_desc);
     } else {
         kill_st.kill_reason = NONE;
         kill_st.thrashing = 0;
         kill_st.max_thrashing = 0;
-        ULMK_LOG(I,"Kill '%s' (%d), uid %d, oom_score_adj %d to free %" PRId64 "kB rss, %" PRId64
-              "kb swap", taskname, pid, uid, procp->oomadj, rss_kb, swap_kb);
     }
-    killinfo_log(procp, min_oom_score, rss_kb, swap_kb, ki, mi, wi, tm, pd);
-
     kill_st.uid = static_cast<int32_t>(uid);
     kill_st.taskname = taskname;
     kill_st.oom_score = procp->oomadj;
@@ -3194,9 +5731,17 @@ static int kill_one_process(struct proc* procp, int min_oom_score, struct kill_i
 
     ctrl_data_write_lmk_kill_occurred((pid_t)pid, uid);
 
-    prop_log_lmk_kill_occurred(&kill_st);
+    kill_report_submit(procp, &kill_st, rss_kb, swap_kb, ki, mi, wi, tm, pd);
 
     result = rss_kb / page_k;
+    if (kill_efficacy && pidfd_supported) {
+        /*
+         * Compare with the estimate before scaling by efficacy to not feed back on itself. The
+         * memory state of the decision is the base so that nothing is read before the kill.
+         */
+        kill_efficacy_start(uid, procp->oomadj, kill_st.kill_reason,
+                            kill_cost_model ? proc_kill_cost(procp, tm) : result, mi, in_batch);
+    }
 
 out:
     /*
@@ -3208,19 +5753,97 @@ out:
 }
 
 /*
- * Find one process to kill at or above the given oom_score_adj level.
- * Returns size of the killed process.
+ * Kill the remaining processes of an app uid at or above victim_adj, the oom_score_adj of the
+ * process of the uid that was killed, so that the app neither keeps their memory nor restarts the
+ * killed one from them. More important processes of the app and preferred apps are left alone.
+ * Returns total size of the killed processes.
  */
-static int find_and_kill_process(int min_score_adj, struct kill_info *ki, union meminfo *mi,
-                                 struct wakeup_info *wi, struct timespec *tm,
-                                 struct psi_data *pd) {
+static int kill_uid_group_procs(uid_t uid, int victim_adj, int min_score_adj,
+                                struct kill_info *ki, union meminfo *mi, struct wakeup_info *wi,
+                                struct timespec *tm, struct psi_data *pd) {
+    int pids[UID_GROUP_MAX_PROCS];
+    int count = 0;
+    int killed = 0;
+    int total_size = 0;
+
+    /* Shared system uids group unrelated processes */
+    if (uid < AID_APP_START) {
+        return 0;
+    }
+
+    /* Collect the pids first, the kills modify the lists */
+    for (int i = OOM_SCORE_ADJ_MAX; i >= victim_adj && count < UID_GROUP_MAX_PROCS; i--) {
+        struct adjslot_list *head = &procadjslot_list[ADJTOSLOT(i)];
+
+        for (struct adjslot_list *curr = head->next; curr != head && count < UID_GROUP_MAX_PROCS;
+             curr = curr->next) {
+            struct proc *procp = (struct proc *)curr;
+
+            if (procp->uid == uid && procp->valid &&
+                !(enable_preferred_apps && proc_is_preferred(procp))) {
+                pids[count++] = procp->pid;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct proc *procp = pid_lookup(pids[i]);
+        int killed_size;
+
+        if (!procp) {
+            continue;
+        }
+        killed_size = kill_one_process(procp, min_score_adj, ki, mi, wi, tm, pd, true);
+        if (killed_size > 0) {
+            total_size += killed_size;
+            killed++;
+        }
+    }
+    if (killed > 0) {
+        ALOGI("Killed %d more processes of uid %d to free %ldkB", killed, uid,
+              total_size * page_k);
+    }
+
+    return total_size;
+}
+
+/*
+ * Find and kill processes at or above the given oom_score_adj level until their total size
+ * reaches target_pages or max_victims processes are killed. At least one process is killed if
+ * possible. Returns total size of the killed processes.
+ */
+#ifdef LMKD_REPLAY
+/* Replays have no processes to kill, report the decision instead */
+static int find_and_kill_processes(int min_score_adj, int64_t target_pages __unused,
+                                   int max_victims __unused, struct kill_info *ki,
+                                   union meminfo *mi __unused, struct wakeup_info *wi __unused,
+                                   struct timespec *tm __unused, struct psi_data *pd __unused) {
+    return lmkd_replay_kill(ki ? (int)ki->kill_reason : -1, min_score_adj,
+                            ki ? ki->kill_desc : NULL);
+}
+#else
+static int find_and_kill_processes(int min_score_adj, int64_t target_pages, int max_victims,
+                                   struct kill_info *ki, union meminfo *mi,
+                                   struct wakeup_info *wi, struct timespec *tm,
+                                   struct psi_data *pd) {
     int i;
-    int killed_size = 0;
+    int killed_size;
+    int total_size = 0;
+    int victims = 0;
     bool choose_heaviest_task = kill_heaviest_task;
+    /* Apps whose processes die together are ranked by their total size */
+    bool rank_by_uid = kill_uid_group && numa_target_node < 0;
+    struct timespec select_start_tm;
 
+    clock_gettime(CLOCK_MONOTONIC, &select_start_tm);
+    uid_footprint.clear();
     for (i = OOM_SCORE_ADJ_MAX; i >= min_score_adj; i--) {
         struct proc *procp;
 
+        if (rank_by_uid) {
+            uid_footprint_add_level(i);
+        }
+
         if (!choose_heaviest_task && i <= PERCEPTIBLE_APP_ADJ) {
             /*
              * If we have to choose a perceptible process, choose the heaviest one to
@@ -3230,27 +5853,59 @@ static int find_and_kill_process(int min_score_adj, struct kill_info *ki, union
         }
 
         while (true) {
+            uid_t uid;
+            int oomadj;
+
             procp = choose_heaviest_task ?
                 proc_get_heaviest(i) : proc_adj_tail(i);
 
             if (!procp)
                 break;
 
-            killed_size = kill_one_process(procp, min_score_adj, ki, mi, wi, tm, pd);
-            if (killed_size >= 0) {
+            pressure_latency_st.select_us = get_latency_us(&select_start_tm);
+            record_latency(LMK_LATENCY_SELECT, pressure_latency_st.select_us);
+            uid = procp->uid;
+            oomadj = procp->oomadj;
+            killed_size = kill_one_process(procp, min_score_adj, ki, mi, wi, tm, pd, victims > 0);
+            if (killed_size > 0 && kill_uid_group) {
+                /* The whole group counts as one victim */
+                killed_size += kill_uid_group_procs(uid, oomadj, min_score_adj, ki, mi, wi, tm,
+                                                    pd);
+                /* Processes of the uid left at lower levels are added back as they are reached */
+                uid_footprint.erase(uid);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &select_start_tm);
+            if (killed_size < 0) {
+                continue;
+            }
+            if (killed_size == 0) {
+                /* Nothing was freed, look for a victim at the next level */
                 break;
             }
-        }
-        if (killed_size) {
-            break;
+            total_size += killed_size;
+            if (++victims >= max_victims || total_size >= target_pages) {
+                goto done;
+            }
         }
     }
 
-    if (!killed_size && !min_score_adj && is_userdebug_or_eng_build) {
-        killed_size = proc_get_script();
+done:
+    if (!total_size && !min_score_adj && is_userdebug_or_eng_build) {
+        total_size = proc_get_script();
     }
 
-    return killed_size;
+    return total_size;
+}
+#endif
+
+/*
+ * Find one process to kill at or above the given oom_score_adj level.
+ * Returns size of the killed process.
+ */
+static int find_and_kill_process(int min_score_adj, struct kill_info *ki, union meminfo *mi,
+                                 struct wakeup_info *wi, struct timespec *tm,
+                                 struct psi_data *pd) {
+    return find_and_kill_processes(min_score_adj, 0, 1, ki, mi, wi, tm, pd);
 }
 
 static int64_t get_memory_usage(struct reread_data *file_data) {
@@ -3303,6 +5958,119 @@ void record_low_pressure_levels(union meminfo *mi) {
     }
 }
 
+struct pressure_sample {
+    struct timespec tm;
+    int64_t free_pages; /* excluding free CMA pages */
+    int64_t file_lru;
+    int64_t refault;
+    float psi_some_avg10;
+};
+
+/* Ring buffer of the samples taken by the recent memory pressure checks */
+static struct pressure_sample pressure_samples[PRESSURE_SAMPLE_COUNT];
+static int pressure_sample_next;
+static int pressure_sample_count;
+
+static void pressure_history_reset() {
+    pressure_sample_count = 0;
+}
+
+static void pressure_history_add(struct pressure_sample *sample) {
+    if (pressure_sample_count > 0) {
+        int last = (pressure_sample_next + PRESSURE_SAMPLE_COUNT - 1) % PRESSURE_SAMPLE_COUNT;
+
+        if (get_time_diff_ms(&pressure_samples[last].tm, &sample->tm) >
+                PRESSURE_SAMPLE_MAX_GAP_MS) {
+            pressure_history_reset();
+        }
+    }
+
+    pressure_samples[pressure_sample_next] = *sample;
+    pressure_sample_next = (pressure_sample_next + 1) % PRESSURE_SAMPLE_COUNT;
+    if (pressure_sample_count < PRESSURE_SAMPLE_COUNT) {
+        pressure_sample_count++;
+    }
+}
+
+/*
+ * Fit a line through the free memory samples with least squares and return the time in ms left
+ * until free memory drops to min_wmark pages at that rate. Returns -1 if free memory is not
+ * declining, there are not enough samples or the decline is not caused by memory pressure, which
+ * is assumed when neither refaults grow nor PSI reports stalls.
+ */
+static long predict_exhaustion_ms(int64_t min_wmark) {
+    int first = (pressure_sample_next + PRESSURE_SAMPLE_COUNT - pressure_sample_count) %
+                PRESSURE_SAMPLE_COUNT;
+    int last = (pressure_sample_next + PRESSURE_SAMPLE_COUNT - 1) % PRESSURE_SAMPLE_COUNT;
+    struct pressure_sample *oldest = &pressure_samples[first];
+    struct pressure_sample *newest = &pressure_samples[last];
+    double sum_t = 0, sum_f = 0, sum_tt = 0, sum_tf = 0;
+    double slope;
+
+    if (pressure_sample_count < PRESSURE_SAMPLE_MIN ||
+        get_time_diff_ms(&oldest->tm, &newest->tm) < PRESSURE_SAMPLE_MIN_SPAN_MS) {
+        return -1;
+    }
+    if (newest->refault <= oldest->refault && newest->psi_some_avg10 <= 0) {
+        return -1;
+    }
+    if (newest->free_pages <= min_wmark) {
+        return 0;
+    }
+
+    for (int i = 0; i < pressure_sample_count; i++) {
+        struct pressure_sample *sample = &pressure_samples[(first + i) % PRESSURE_SAMPLE_COUNT];
+        double t = get_time_diff_ms(&oldest->tm, &sample->tm);
+        double f = sample->free_pages;
+
+        sum_t += t;
+        sum_f += f;
+        sum_tt += t * t;
+        sum_tf += t * f;
+    }
+    /* Pages per ms, a span of at least PRESSURE_SAMPLE_MIN_SPAN_MS keeps the divisor non-zero */
+    slope = (pressure_sample_count * sum_tf - sum_t * sum_f) /
+            (pressure_sample_count * sum_tt - sum_t * sum_t);
+    if (slope >= 0) {
+        return -1;
+    }
+
+    return (long)((newest->free_pages - min_wmark) / -slope);
+}
+
+/*
+ * Choose the polling interval from the rate at which free memory changed between the last two
+ * samples: poll rarely while it is flat or growing and often enough to catch it before the min
+ * watermark while it drops. Returns -1 if there are not enough samples, the last one was not
+ * taken by the check at curr_tm or the two are too far apart to tell the current rate.
+ */
+static int adaptive_poll_interval_ms(int64_t min_wmark, struct timespec *curr_tm) {
+    int last = (pressure_sample_next + PRESSURE_SAMPLE_COUNT - 1) % PRESSURE_SAMPLE_COUNT;
+    int prev = (pressure_sample_next + PRESSURE_SAMPLE_COUNT - 2) % PRESSURE_SAMPLE_COUNT;
+    long elapsed_ms;
+    int64_t dropped;
+    int64_t interval_ms;
+
+    if (pressure_sample_count < 2 || pressure_samples[last].tm.tv_sec != curr_tm->tv_sec ||
+        pressure_samples[last].tm.tv_nsec != curr_tm->tv_nsec) {
+        return -1;
+    }
+
+    elapsed_ms = get_time_diff_ms(&pressure_samples[prev].tm, &pressure_samples[last].tm);
+    if (elapsed_ms > PRESSURE_SAMPLE_MAX_GAP_MS) {
+        return -1;
+    }
+    dropped = pressure_samples[prev].free_pages - pressure_samples[last].free_pages;
+    if (dropped <= 0 || elapsed_ms <= 0) {
+        return psi_poll_max_ms;
+    }
+
+    interval_ms = std::max<int64_t>(pressure_samples[last].free_pages - min_wmark, 0) *
+                  elapsed_ms / dropped / ADAPTIVE_POLL_CHECKS;
+
+    return (int)std::clamp<int64_t>(interval_ms, psi_poll_min_ms, psi_poll_max_ms);
+}
+
 enum zone_watermark {
     WMARK_MIN = 0,
     WMARK_LOW,
@@ -3430,6 +6198,50 @@ static void log_zone_watermarks(struct zoneinfo *zi) {
     }
 }
 
+/*
+ * Returns the node whose free memory went below its low watermark while another node is still
+ * above its high watermark, or -1 if memory is balanced across nodes. All nodes being low is
+ * handled by the aggregate watermarks.
+ */
+static int find_starving_node(struct zoneinfo *zi) {
+    int64_t max_headroom = INT64_MIN;
+    int64_t min_headroom = INT64_MAX;
+    int starving_node = -1;
+
+    for (int node_idx = 0; node_idx < zi->node_count; node_idx++) {
+        struct zoneinfo_node *node = &zi->nodes[node_idx];
+        int64_t nr_free = 0;
+        int64_t max_low = 0;
+        int64_t max_high = 0;
+        int64_t max_protection = 0;
+
+        for (int zone_idx = 0; zone_idx < node->zone_count; zone_idx++) {
+            struct zoneinfo_zone *zone = &node->zones[zone_idx];
+
+            if (!zone->fields.field.present) {
+                continue;
+            }
+            nr_free += zone->fields.field.nr_free_pages - zone->fields.field.nr_free_cma;
+            max_low = std::max(max_low, zone->fields.field.low);
+            max_high = std::max(max_high, zone->fields.field.high);
+            max_protection = std::max(max_protection, zone->max_protection);
+        }
+
+        if (debug_process_killing) {
+            ULMK_LOG(D, "Node %d free: %" PRId64 " low: %" PRId64 " high: %" PRId64,
+                     node->id, nr_free, max_low + max_protection, max_high + max_protection);
+        }
+        int64_t low_headroom = nr_free - (max_low + max_protection) * wbf_effective;
+        if (low_headroom < 0 && low_headroom < min_headroom) {
+            min_headroom = low_headroom;
+            starving_node = node_idx;
+        }
+        max_headroom = std::max(max_headroom, nr_free - (max_high + max_protection) * wbf_effective);
+    }
+
+    return max_headroom > 0 ? starving_node : -1;
+}
+
 int64_t get_zone_pgskip_deltas_val(const char* name, int64_t *pgskip_deltas) {
     int idx;
 
@@ -3532,46 +6344,314 @@ int32_t get_MGLRU_status() {
         return MGLRU_status;
     }
 
-    buf[16] = '\0'; //this cannot be more than 15 characters.
-    MGLRU_status = (int32_t)strtol(buf, NULL, 16);
+    buf[16] = '\0'; //this cannot be more than 15 characters.
+    MGLRU_status = (int32_t)strtol(buf, NULL, 16);
+
+    if (debug_process_killing) {
+        ALOGD("MGLRU status : %d", MGLRU_status);
+    }
+
+    return MGLRU_status;
+}
+
+static void fill_log_pgskip_stats(union vmstat *vs, int64_t *init_pgskip, int64_t *pgskip_deltas)
+{
+    unsigned int i;
+
+    for (i = VS_PGSKIP_FIRST_ZONE; i <= VS_PGSKIP_LAST_ZONE; i++) {
+        if (vs->arr[i] >= 0) {
+            pgskip_deltas[PGSKIP_IDX(i)] = vs->arr[i] -
+                                           init_pgskip[PGSKIP_IDX(i)];
+        } else {
+            pgskip_deltas[PGSKIP_IDX(i)] = -1;
+        }
+    }
+
+    if (MGLRU_status > 0) {
+        /* When MGLRU is enabled, don't set the pgskip delta for Normal zone.
+           Because it could be because of page-isolation failure as well.
+           In which case, we need to consider Normal Zone watermarks and
+           free memory values for making kill decisions. */
+        pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_NORMAL)] = 0;
+    }
+
+    if (debug_process_killing) {
+        ULMK_LOG(D, "pgskip deltas: DMA: %" PRId64 " DMA32: %" PRId64 " Normal: %" PRId64 " High: %"
+             PRId64 " Movable: %" PRId64,
+             pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_DMA)],
+             pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_DMA32)],
+             pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_NORMAL)],
+             pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_HIGH)],
+             pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_MOVABLE)]);
+    }
+}
+
+enum class MemcgVersion {
+    kNotFound,
+    kV1,
+    kV2,
+};
+
+static MemcgVersion __memcg_version() {
+    std::string cgroupv2_path, memcg_path;
+
+    if (!CgroupGetControllerPath("memory", &memcg_path)) {
+        return MemcgVersion::kNotFound;
+    }
+    return CgroupGetControllerPath(CGROUPV2_HIERARCHY_NAME, &cgroupv2_path) &&
+                           cgroupv2_path == memcg_path
+                   ? MemcgVersion::kV2
+                   : MemcgVersion::kV1;
+}
+
+static MemcgVersion memcg_version() {
+    static MemcgVersion version = __memcg_version();
+
+    return version;
+}
+
+/* Writes the number of bytes to reclaim into memory.reclaim of the cgroup of the process */
+/*
+ * Ask the memcg of the process to reclaim up to bytes, at most MEMCG_RECLAIM_CHUNK_KB per write,
+ * and stop once memcg_reclaim_budget_ms passed since start_tm. Returns the bytes reclaimed.
+ */
+static int64_t memcg_reclaim_proc(int pid, int64_t bytes, struct timespec *start_tm) {
+    struct timespec curr_tm;
+    std::string path;
+    int64_t reclaimed = 0;
+    char val[24];
+    size_t pos;
+    int fd;
+
+    if (!CgroupGetAttributePathForTask("MemStats", pid, &path) ||
+        (pos = path.rfind('/')) == std::string::npos) {
+        return 0;
+    }
+    path.replace(pos + 1, std::string::npos, "memory.reclaim");
+
+    fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    while (reclaimed < bytes) {
+        int64_t chunk = std::min<int64_t>(bytes - reclaimed, MEMCG_RECLAIM_CHUNK_KB * 1024);
+        ssize_t len = snprintf(val, sizeof(val), "%" PRId64, chunk);
+
+        /* The write fails with EAGAIN when less than requested could be reclaimed */
+        if (TEMP_FAILURE_RETRY(write(fd, val, len)) != len) {
+            break;
+        }
+        reclaimed += chunk;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &curr_tm);
+        if (get_time_diff_ms(start_tm, &curr_tm) >= memcg_reclaim_budget_ms) {
+            break;
+        }
+    }
+    close(fd);
+
+    return reclaimed;
+}
+
+/*
+ * Reclaim up to target_pages from the memcgs of cached apps, starting from the least recently
+ * used process with the highest oom_score_adj. Each process is asked for at most its cached size
+ * and is not asked again for MEMCG_RECLAIM_INTERVAL_MS. Stops after memcg_reclaim_budget_ms.
+ * Returns the number of pages the memcgs reported as reclaimed, anon pages moved to zram still
+ * use their compressed size.
+ */
+static int64_t memcg_reclaim_cached_apps(int64_t target_pages) {
+    struct timespec start_tm;
+    struct timespec curr_tm;
+    int64_t reclaimed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &start_tm);
+    curr_tm = start_tm;
+    for (int oomadj = OOM_SCORE_ADJ_MAX; oomadj >= lowmem_min_oom_score; oomadj--) {
+        struct adjslot_list *head = &procadjslot_list[ADJTOSLOT(oomadj)];
+
+        for (struct adjslot_list *curr = head->prev; curr != head; curr = curr->prev) {
+            struct proc *procp = (struct proc *)curr;
+            int64_t pages;
+
+            if (get_time_diff_ms(&start_tm, &curr_tm) >= memcg_reclaim_budget_ms) {
+                return reclaimed;
+            }
+            if ((procp->reclaim_tm.tv_sec || procp->reclaim_tm.tv_nsec) &&
+                get_time_diff_ms(&procp->reclaim_tm, &curr_tm) < MEMCG_RECLAIM_INTERVAL_MS) {
+                continue;
+            }
+
+            /*
+             * The cached size can be a kill cost estimate, the reclaimable footprint is the
+             * resident memory since swapped out memory was already reclaimed.
+             */
+            if (proc_get_cached_size(procp, &curr_tm) < 0) {
+                continue;
+            }
+            pages = std::min<int64_t>(procp->rss_kb / page_k, target_pages - reclaimed);
+            if (pages <= 0) {
+                continue;
+            }
+            procp->reclaim_tm = curr_tm;
+            reclaimed += memcg_reclaim_proc(procp->pid, pages * page_k * 1024, &start_tm) /
+                         (page_k * 1024);
+            if (reclaimed >= target_pages) {
+                return reclaimed;
+            }
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &curr_tm);
+        }
+    }
+
+    return reclaimed;
+}
+
+/* State of the compaction requested instead of a kill */
+static struct {
+    /* Time compaction was last requested, zero if no request is pending */
+    struct timespec request_tm;
+    int64_t request_compact_stall;
+    int64_t request_compact_fail;
+    /* Kills are not held off for compaction until this time */
+    struct timespec backoff_tm;
+    unsigned int compaction_count;
+    unsigned int kills_avoided;
+} compaction_st;
+
+#ifndef LMKD_REPLAY
+/*
+ * Writes to the compact files run compaction synchronously in the writer's context, so requests
+ * are handed to a worker thread instead of stalling the main thread.
+ */
+static int compaction_event_fd = -1;
+static std::atomic<int> compaction_node_id;
+/* Set by the main thread when it queues a request, cleared by the worker when it is done */
+static std::atomic<bool> compaction_busy;
+
+static void *compaction_main(void *param __unused) {
+    char path[PATH_MAX];
+
+    for (;;) {
+        if (!worker_wait_event(compaction_event_fd, "compaction requests")) {
+            continue;
+        }
+
+        int node_id = compaction_node_id.load(std::memory_order_acquire);
+        if (node_id < 0) {
+            strlcpy(path, COMPACT_MEMORY_PATH, sizeof(path));
+        } else {
+            snprintf(path, sizeof(path), NODE_COMPACT_PATH_FMT, node_id);
+        }
+        writefilestring(path, "1", true);
+        compaction_busy.store(false, std::memory_order_release);
+    }
+
+    return NULL;
+}
+
+#endif
+
+/* Starts the compaction worker once ro.lmk.compaction_kill_suppress is set */
+static bool init_compaction() {
+#ifdef LMKD_REPLAY
+    return true;
+#else
+    if (!compaction_kill_suppress || compaction_event_fd >= 0) {
+        return true;
+    }
+
+    compaction_event_fd = eventfd(0, EFD_CLOEXEC);
+    if (compaction_event_fd < 0) {
+        ALOGE("eventfd failed: %s", strerror(errno));
+        return false;
+    }
+    if (!start_worker_thread(compaction_main, "lmkd_compact")) {
+        close(compaction_event_fd);
+        compaction_event_fd = -1;
+        return false;
+    }
+
+    return true;
+#endif
+}
 
-    if (debug_process_killing) {
-        ALOGD("MGLRU status : %d", MGLRU_status);
+/*
+ * Asks the worker to compact node_id, or all nodes if negative. Returns false if compaction can
+ * not be requested, including while a compaction from an earlier request is still running.
+ */
+#ifdef LMKD_REPLAY
+static bool request_compaction(int node_id __unused) {
+    return true;
+}
+#else
+static bool request_compaction(int node_id) {
+    uint64_t val = 1;
+
+    if (compaction_event_fd < 0) {
+        return false;
+    }
+    if (compaction_busy.exchange(true, std::memory_order_acq_rel)) {
+        ULMK_LOG(D, "Compaction requested earlier is still running");
+        return false;
+    }
+    compaction_node_id.store(node_id, std::memory_order_release);
+    if (TEMP_FAILURE_RETRY(write(compaction_event_fd, &val, sizeof(val))) != sizeof(val)) {
+        ALOGE("Failed to wake up the compaction thread: %s", strerror(errno));
+        compaction_busy.store(false, std::memory_order_release);
+        return false;
     }
 
-    return MGLRU_status;
+    return true;
 }
+#endif
 
-static void fill_log_pgskip_stats(union vmstat *vs, int64_t *init_pgskip, int64_t *pgskip_deltas)
-{
-    unsigned int i;
+/*
+ * Holds off a kill when memory pressure comes from fragmentation rather than from a lack of free
+ * memory: allocations stall in compaction while free memory stays above the min watermark.
+ * Compaction of node_id, or of all nodes if negative, is requested instead and kills wait up to
+ * compaction_wait_ms for it. Kills are not held off for COMPACTION_BACKOFF_MS if most compaction
+ * attempts failed while waiting. Returns true if the kill should be skipped.
+ */
+static bool compaction_avoids_kill(union vmstat *vs, enum zone_watermark wmark, int node_id,
+                                   struct timespec *curr_tm) {
+    if (wmark <= WMARK_MIN ||
+        ((compaction_st.backoff_tm.tv_sec || compaction_st.backoff_tm.tv_nsec) &&
+         get_time_diff_ms(curr_tm, &compaction_st.backoff_tm) > 0)) {
+        return false;
+    }
 
-    for (i = VS_PGSKIP_FIRST_ZONE; i <= VS_PGSKIP_LAST_ZONE; i++) {
-        if (vs->arr[i] >= 0) {
-            pgskip_deltas[PGSKIP_IDX(i)] = vs->arr[i] -
-                                           init_pgskip[PGSKIP_IDX(i)];
-        } else {
-            pgskip_deltas[PGSKIP_IDX(i)] = -1;
+    if (compaction_st.request_tm.tv_sec || compaction_st.request_tm.tv_nsec) {
+        int64_t stalls = vs->field.compact_stall - compaction_st.request_compact_stall;
+        int64_t fails = vs->field.compact_fail - compaction_st.request_compact_fail;
+
+        if (get_time_diff_ms(&compaction_st.request_tm, curr_tm) < compaction_wait_ms) {
+            ULMK_LOG(D, "Waiting for compaction instead of a kill");
+            return true;
+        }
+        compaction_st.request_tm = {};
+        if (fails * 2 > stalls) {
+            ULMK_LOG(I, "Compaction failed %" PRId64 " of %" PRId64 " times, not waiting for it "
+                     "for %dms", fails, stalls, COMPACTION_BACKOFF_MS);
+            compaction_st.backoff_tm = *curr_tm;
+            compaction_st.backoff_tm.tv_sec += COMPACTION_BACKOFF_MS / MS_PER_SEC;
+            return false;
         }
     }
 
-    if (MGLRU_status > 0) {
-        /* When MGLRU is enabled, don't set the pgskip delta for Normal zone.
-           Because it could be because of page-isolation failure as well.
-           In which case, we need to consider Normal Zone watermarks and
-           free memory values for making kill decisions. */
-        pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_NORMAL)] = 0;
+    if (!request_compaction(node_id)) {
+        return false;
     }
+    compaction_st.request_tm = *curr_tm;
+    compaction_st.request_compact_stall = vs->field.compact_stall;
+    compaction_st.request_compact_fail = vs->field.compact_fail;
+    compaction_st.compaction_count++;
+    /* Kills held off while waiting for the same compaction count once */
+    compaction_st.kills_avoided++;
 
-    if (debug_process_killing) {
-        ULMK_LOG(D, "pgskip deltas: DMA: %" PRId64 " DMA32: %" PRId64 " Normal: %" PRId64 " High: %"
-             PRId64 " Movable: %" PRId64,
-             pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_DMA)],
-             pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_DMA32)],
-             pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_NORMAL)],
-             pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_HIGH)],
-             pgskip_deltas[PGSKIP_IDX(VS_PGSKIP_MOVABLE)]);
-    }
+    ULMK_LOG(I, "Requested compaction instead of a kill; compactions: %u, kills avoided: %u",
+             compaction_st.compaction_count, compaction_st.kills_avoided);
+    kill_report_compaction_stats(compaction_st.compaction_count, compaction_st.kills_avoided);
+
+    return true;
 }
 
 static int calc_swap_utilization(union meminfo *mi) {
@@ -3606,10 +6686,11 @@ static void mp_event_psi(int data, uint32_t events, struct polling_params *poll_
     static int64_t prev_thrash_growth = 0;
     static bool check_filecache = false;
     static int max_thrashing = 0;
+    static bool first_kill = true;
 
     union meminfo mi;
     union vmstat vs;
-    struct psi_data psi_data;
+    struct psi_data psi_data = {};
     struct timespec curr_tm;
     int64_t thrashing = 0;
     bool swap_is_low = false;
@@ -3630,6 +6711,11 @@ static void mp_event_psi(int data, uint32_t events, struct polling_params *poll_
     bool critical_stall = false;
     int64_t pgskip_deltas[VS_PGSKIP_LAST_ZONE - VS_PGSKIP_FIRST_ZONE + 1] = {0};
     struct zoneinfo zi;
+    bool sampled;
+    struct timespec parse_start_tm;
+    bool watermarks_reparsed = false;
+    /* Published at the end of every evaluation with the fields known by then */
+    struct lmk_pressure_snapshot snapshot = {};
 
     if (events &&
        (!poll_params->poll_handler || data >= poll_params->poll_handler->data)) {
@@ -3639,29 +6725,36 @@ static void mp_event_psi(int data, uint32_t events, struct polling_params *poll_
     long direct_reclaim_duration_ms;
     bool in_kswapd_reclaim;
 
-    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &curr_tm) != 0) {
+    if (get_pressure_check_time(&curr_tm) != 0) {
         ALOGE("Failed to get current time");
         return;
     }
+    trace_record_cycle(&curr_tm, level, events);
 
     record_wakeup_time(&curr_tm, events ? Event : Polling, &wi);
-
+    pressure_latency_st = {};
+    snapshot.version = LMK_PRESSURE_SNAPSHOT_VERSION;
+    snapshot.size = sizeof(struct lmk_pressure_snapshot);
+    snapshot.level = level;
+    snapshot.timestamp_ms = curr_tm.tv_sec * (int64_t)MS_PER_SEC + curr_tm.tv_nsec / NS_PER_MS;
+    snapshot.wmark = WMARK_NONE;
+    snapshot.kill_reason = NONE;
+    snapshot.max_thrashing = max_thrashing;
+    snapshot.thrashing_limit = thrashing_limit;
+    if (events) {
+        pressure_latency_st.event_us = get_latency_us(&event_wakeup_tm);
+        record_latency(LMK_LATENCY_EVENT, pressure_latency_st.event_us);
+    }
+
+    bool psi_tuning = psi_auto_tune && events && psi_monitor_idx[level] >= 0 &&
+            (level == VMPRESS_LEVEL_MEDIUM || level == VMPRESS_LEVEL_CRITICAL);
+    if (psi_tuning) {
+        psi_tune_event(level, &curr_tm);
+    }
     if (level == VMPRESS_LEVEL_MEDIUM) {
         if (enable_preferred_apps &&
                 (get_time_diff_ms(&last_pa_update_tm, &curr_tm) >= pa_update_timeout_ms)) {
-            if (!use_perf_api_for_pref_apps) {
-                if (perf_ux_engine_trigger) {
-                    perf_ux_engine_trigger(PAPP_OPCODE, preferred_apps);
-                }
-            } else {
-                if (perf_sync_request) {
-                    const char * tmp = perf_sync_request(PAPP_PERF_TRIGGER);
-                    if (tmp != NULL) {
-                        strlcpy(preferred_apps, tmp, strlen(tmp));
-                        free((void *)tmp);
-                    }
-                }
-            }
+            update_preferred_apps();
             last_pa_update_tm = curr_tm;
         }
     }
@@ -3681,17 +6774,22 @@ static void mp_event_psi(int data, uint32_t events, struct polling_params *poll_
      */
     stop_wait_for_proc_kill(!kill_pending);
 
-    if (vmstat_parse(&vs) < 0) {
+    clock_gettime(CLOCK_MONOTONIC, &parse_start_tm);
+    memory_snapshot_refresh();
+    sampled = memory_sample_get(&vs, &mi, &zi, &curr_tm);
+
+    if (!sampled && vmstat_parse(&vs) < 0) {
         ALOGE("Failed to parse vmstat!");
         return;
     }
     /* Starting 5.9 kernel workingset_refault vmstat field was renamed workingset_refault_file */
     workingset_refault_file = vs.field.workingset_refault ? : vs.field.workingset_refault_file;
 
-    if (meminfo_parse(&mi) < 0) {
+    if (!sampled && meminfo_parse(&mi) < 0) {
         ALOGE("Failed to parse meminfo!");
         return;
     }
+    pressure_latency_st.parse_us = get_latency_us(&parse_start_tm);
 
     /* Reset states after process got killed */
     if (killing) {
@@ -3702,6 +6800,8 @@ static void mp_event_psi(int data, uint32_t events, struct polling_params *poll_
         init_ws_refault = workingset_refault_file;
         thrashing_reset_tm = curr_tm;
         prev_thrash_growth = 0;
+        /* Free memory trend before the kill does not apply anymore */
+        pressure_history_reset();
     }
 
     if (debug_process_killing) {
@@ -3780,23 +6880,16 @@ static void mp_event_psi(int data, uint32_t events, struct polling_params *poll_
     } else if (workingset_refault_file == prev_workingset_refault) {
         if (enable_preferred_apps &&
                   (get_time_diff_ms(&last_pa_update_tm, &curr_tm) >= pa_update_timeout_ms)) {
-              if (!use_perf_api_for_pref_apps) {
-                  if (perf_ux_engine_trigger) {
-                      perf_ux_engine_trigger(PAPP_OPCODE, preferred_apps);
-                  }
-              } else {
-                  if (perf_sync_request) {
-                      const char * tmp = perf_sync_request(PAPP_PERF_TRIGGER);
-                      if (tmp != NULL) {
-                          strlcpy(preferred_apps, tmp, strlen(tmp));
-                          free((void *)tmp);
-                      }
-                  }
-              }
+              update_preferred_apps();
               last_pa_update_tm = curr_tm;
         }
 
         if (!in_compaction) {
+            record_latency(LMK_LATENCY_PARSE, pressure_latency_st.parse_us);
+            snapshot.swap_util = calc_swap_utilization(&mi);
+            snapshot.file_lru_kb = (vs.field.nr_inactive_file + vs.field.nr_active_file) * page_k;
+            snapshot.free_swap_kb = get_free_swap(&mi) * page_k;
+            snapshot.total_swap_kb = mi.field.total_swap * page_k;
             /* Skip if system is not reclaiming */
             ULMK_LOG(D, "Ignoring %s pressure event; system is not in reclaim or compaction and no refaults",
                      level_name[level]);
@@ -3853,12 +6946,16 @@ static void mp_event_psi(int data, uint32_t events, struct polling_params *poll_
     }
 
 update_watermarks:
-    if (zoneinfo_parse(&zi) < 0) {
+    clock_gettime(CLOCK_MONOTONIC, &parse_start_tm);
+    if (!sampled && zoneinfo_parse(&zi) < 0) {
         ALOGE("Failed to parse zoneinfo!");
         return;
     }
 
     calc_zone_watermarks(&zi, &zone_mem_info, pgskip_deltas);
+    numa_node_count = zi.node_count;
+    numa_target_node = numa_aware ? find_starving_node(&zi) : -1;
+    numa_target_node_id = numa_target_node >= 0 ? zi.nodes[numa_target_node].id : -1;
 
     /* Find out which watermark is breached if any */
     wmark = get_lowest_watermark(&mi, &zone_mem_info, level, events, in_compaction);
@@ -3870,7 +6967,24 @@ update_watermarks:
 
     if (!psi_parse_mem(&psi_data)) {
         critical_stall = psi_data.mem_stats[PSI_FULL].avg10 > (float)stall_limit_critical;
+        if (psi_tuning) {
+            psi_tune_sample(level, &psi_data);
+        }
+    }
+    pressure_latency_st.parse_us += get_latency_us(&parse_start_tm);
+
+    /* Memory state re-parsed before the first kill was already added to the history */
+    if ((predictive_horizon_ms > 0 || adaptive_polling) && !watermarks_reparsed) {
+        struct pressure_sample sample = {
+            .tm = curr_tm,
+            .free_pages = zone_mem_info.nr_free_pages - zone_mem_info.cma_free,
+            .file_lru = vs.field.nr_inactive_file + vs.field.nr_active_file,
+            .refault = workingset_refault_file,
+            .psi_some_avg10 = psi_data.mem_stats[PSI_SOME].avg10,
+        };
+        pressure_history_add(&sample);
     }
+
     /*
      * TODO: move this logic into a separate function
      * Decide if killing a process is necessary and record the reason
@@ -3998,6 +7112,58 @@ update_watermarks:
         min_score_adj = lowmem_min_oom_score;
     }
 
+    /* Kill a cached app before the device stalls if free memory is about to run out */
+    if (kill_reason == NONE && predictive_horizon_ms > 0) {
+        long exhaustion_ms = predict_exhaustion_ms(zone_mem_info.watermarks.min_wmark);
+
+        if (exhaustion_ms >= 0 && exhaustion_ms < predictive_horizon_ms) {
+            kill_reason = PREDICTED_LOW_MEM;
+            snprintf(kill_desc, sizeof(kill_desc),
+                "min watermark is predicted to be breached in %ldms", exhaustion_ms);
+            min_score_adj = lowmem_min_oom_score;
+        }
+    }
+
+    /* Make sure watermarks are correct before the first kill */
+    if (kill_reason != NONE && first_kill) {
+        first_kill = false;
+        watermarks_reparsed = true;
+        sampled = false;
+        // watermarks.high_wmark = 0;  // force recomputation
+        goto update_watermarks;
+    }
+    record_latency(LMK_LATENCY_PARSE, pressure_latency_st.parse_us);
+
+    if (pressure_snapshot) {
+        snapshot = {
+            .seq = 0,
+            .version = LMK_PRESSURE_SNAPSHOT_VERSION,
+            .size = sizeof(struct lmk_pressure_snapshot),
+            .level = level,
+            .timestamp_ms = snapshot.timestamp_ms,
+            .wmark = wmark,
+            .reclaim = reclaim,
+            .in_compaction = in_compaction,
+            .critical_stall = critical_stall,
+            .thrashing = (int32_t)thrashing,
+            .max_thrashing = max_thrashing,
+            .thrashing_limit = thrashing_limit,
+            .swap_util = swap_util ? : calc_swap_utilization(&mi),
+            .kill_reason = kill_reason,
+            .min_score_adj = min_score_adj,
+            .free_kb = zone_mem_info.nr_free_pages * page_k,
+            .cma_free_kb = zone_mem_info.cma_free * page_k,
+            .file_lru_kb = (vs.field.nr_inactive_file + vs.field.nr_active_file) * page_k,
+            .free_swap_kb = get_free_swap(&mi) * page_k,
+            .total_swap_kb = mi.field.total_swap * page_k,
+            .min_wmark_kb = zone_mem_info.watermarks.min_wmark * page_k,
+            .low_wmark_kb = zone_mem_info.watermarks.low_wmark * page_k,
+            .high_wmark_kb = zone_mem_info.watermarks.high_wmark * page_k,
+            .psi_some_avg10 = psi_data.mem_stats[PSI_SOME].avg10,
+            .psi_full_avg10 = psi_data.mem_stats[PSI_FULL].avg10,
+        };
+    }
+
     /* Kill a process if necessary */
     if (kill_reason != NONE) {
         struct kill_info ki = {
@@ -4006,22 +7172,85 @@ update_watermarks:
             .thrashing = (int)thrashing,
             .max_thrashing = max_thrashing,
         };
-        static bool first_kill = true;
-
-        /* Make sure watermarks are correct before the first kill */
-        if (first_kill) {
-            first_kill = false;
-            // watermarks.high_wmark = 0;  // force recomputation
-            goto update_watermarks;
-        }
 
         /* Allow killing perceptible apps if the system is stalled */
         if (critical_stall) {
             min_score_adj = 0;
         }
+
+        /* Let compaction run instead of killing if high order allocations fail to find memory */
+        if (compaction_kill_suppress && kill_reason == COMPACTION && !critical_stall &&
+            compaction_avoids_kill(&vs, wmark,
+                                   numa_target_node_id,
+                                   &curr_tm)) {
+            goto no_kill;
+        }
+
+        /*
+         * Under medium pressure try to push anon memory of cached apps into swap first, a
+         * relaunch of a killed app costs more than swapping it back in.
+         */
+        if (memcg_reclaim && level == VMPRESS_LEVEL_MEDIUM && !critical_stall && !swap_is_low &&
+            (kill_reason == LOW_MEM || kill_reason == PREDICTED_LOW_MEM ||
+             kill_reason == LOW_MEM_AND_THRASHING) &&
+            per_app_memcg && memcg_version() == MemcgVersion::kV2 &&
+            (swap_util ? : calc_swap_utilization(&mi)) < memcg_reclaim_swap_util_max) {
+            int64_t deficit = zone_mem_info.watermarks.high_wmark -
+                    (zone_mem_info.nr_free_pages - zone_mem_info.cma_free);
+
+            if (deficit > 0) {
+                int64_t reclaimed = memcg_reclaim_cached_apps(deficit);
+                union meminfo reclaim_mi;
+
+                /* Check what was actually freed, reclaim reports swapped out pages as freed */
+                if (reclaimed > 0 && meminfo_parse(&reclaim_mi) == 0 &&
+                    reclaim_mi.field.nr_free_pages - reclaim_mi.field.cma_free >=
+                    zone_mem_info.watermarks.high_wmark) {
+                    ULMK_LOG(I, "Reclaimed %" PRId64 "kB from cached apps instead of a kill; "
+                             "reason: %s", reclaimed * page_k, kill_desc);
+                    goto no_kill;
+                }
+            }
+        }
+        if (numa_target_node >= 0) {
+            size_t len = strlen(kill_desc);
+
+            snprintf(kill_desc + len, sizeof(kill_desc) - len, ", node %d is low on memory",
+                     zi.nodes[numa_target_node].id);
+        }
         psi_parse_io(&psi_data);
         psi_parse_cpu(&psi_data);
-        int pages_freed = find_and_kill_process(min_score_adj, &ki, &mi, &wi, &curr_tm, &psi_data);
+        int pages_freed;
+        /* Free enough memory to get back above the high watermark */
+        int64_t reclaim_target = zone_mem_info.watermarks.high_wmark -
+                (zone_mem_info.nr_free_pages - zone_mem_info.cma_free);
+        if (critical_stall && batch_kill_max_victims > 1 && reclaim_target > 0) {
+            char batch_kill_desc[LINE_MAX];
+
+            snprintf(batch_kill_desc, sizeof(batch_kill_desc),
+                     "%s; complete stall (%.2f%%), killing up to %d processes to free %" PRId64
+                     "kB", kill_desc, psi_data.mem_stats[PSI_FULL].avg10, batch_kill_max_victims,
+                     reclaim_target * page_k);
+            ki.kill_reason = CRITICAL_BATCH_KILL;
+            ki.kill_desc = batch_kill_desc;
+            /* Batches are limited to processes which are not perceptible to the user */
+            pages_freed = find_and_kill_processes(std::max(min_score_adj,
+                                                           PERCEPTIBLE_APP_ADJ + 1),
+                                                  reclaim_target, batch_kill_max_victims, &ki,
+                                                  &mi, &wi, &curr_tm, &psi_data);
+            if (pages_freed == 0 && min_score_adj <= PERCEPTIBLE_APP_ADJ) {
+                /* Kill a single process below that level as without batching */
+                ki.kill_reason = kill_reason;
+                ki.kill_desc = kill_desc;
+                pages_freed = find_and_kill_process(min_score_adj, &ki, &mi, &wi, &curr_tm,
+                                                    &psi_data);
+            }
+        } else {
+            pages_freed = find_and_kill_process(min_score_adj, &ki, &mi, &wi, &curr_tm,
+                                                &psi_data);
+        }
+        numa_target_node = -1;
+        numa_target_node_id = -1;
         if (pages_freed > 0) {
             killing = true;
             max_thrashing = 0;
@@ -4042,9 +7271,19 @@ update_watermarks:
             ULMK_LOG(D, "No processes to kill with adj score >= %d",
                      min_score_adj);
         }
+    } else {
+        /* Use the time while no kill is needed to keep the process size cache fresh */
+        proc_size_cache_refresh(PROC_SIZE_CACHE_REFRESH_COUNT);
     }
 
 no_kill:
+    publish_pressure_snapshot(&snapshot);
+
+    /* Index native processes whenever the evaluation did not kill, skipped ones included */
+    if (is_userdebug_or_eng_build && kill_reason == NONE) {
+        native_index_scan(NATIVE_INDEX_SCAN_COUNT);
+    }
+
     /* Do not poll if kernel supports pidfd waiting */
     if (is_waiting_for_kill()) {
         /* Pause polling if we are waiting for process death notification */
@@ -4081,6 +7320,23 @@ no_kill:
         /* By default use long intervals */
         poll_params->polling_interval_ms = PSI_POLL_PERIOD_LONG_MS;
     }
+
+    if (adaptive_polling) {
+        int interval_ms = (swap_is_low || killing) ? psi_poll_min_ms :
+                adaptive_poll_interval_ms(zone_mem_info.watermarks.min_wmark, &curr_tm);
+
+        if (interval_ms > 0) {
+            /* Count the wakeups the fixed interval would have needed over the chosen one */
+            if (interval_ms > poll_params->polling_interval_ms) {
+                wi.saved_wakeups += interval_ms / poll_params->polling_interval_ms - 1;
+            }
+            if (debug_process_killing) {
+                ULMK_LOG(D, "Polling every %dms instead of %dms, %d wakeups saved since event",
+                         interval_ms, poll_params->polling_interval_ms, wi.saved_wakeups);
+            }
+            poll_params->polling_interval_ms = interval_ms;
+        }
+    }
 }
 
 static std::string GetCgroupAttributePath(const char* attr) {
@@ -4093,77 +7349,221 @@ static std::string GetCgroupAttributePath(const char* attr) {
 
 
 static bool init_mp_psi(enum vmpressure_level level) {
-    int fd;
+    struct psi_trigger trigger = {
+        .resource = PSI_MEMORY,
+        .stall_type = psi_thresholds[level].stall_type,
+        .threshold_us = static_cast<int>(psi_thresholds[level].threshold_ms * US_PER_MS),
+        .window_us = static_cast<int>(psi_window_size_ms * US_PER_MS),
+    };
+    int idx;
 
     /* Do not register a handler if threshold_ms is not set */
     if (!psi_thresholds[level].threshold_ms) {
         return true;
     }
 
-    fd = init_psi_monitor(psi_thresholds[level].stall_type,
-        psi_thresholds[level].threshold_ms * US_PER_MS,
-        psi_window_size_ms * US_PER_MS);
-
-    if (fd < 0) {
-        return false;
-    }
-
     vmpressure_hinfo[level].handler = mp_event_psi;
     vmpressure_hinfo[level].data = level;
-    if (register_psi_monitor(epollfd, fd, &vmpressure_hinfo[level]) < 0) {
-        destroy_psi_monitor(fd);
+    idx = psi_group_add(&psi_monitors, &trigger, &vmpressure_hinfo[level]);
+    if (idx < 0) {
         return false;
     }
     maxevents++;
-    mpevfd[level] = fd;
+    psi_monitor_idx[level] = idx;
 
     return true;
 }
 
 static void destroy_mp_psi(enum vmpressure_level level) {
-    int fd = mpevfd[level];
+    int idx = psi_monitor_idx[level];
 
-    if (fd < 0) {
+    if (idx < 0) {
         return;
     }
 
-    if (unregister_psi_monitor(epollfd, fd) < 0) {
-        ALOGE("Failed to unregister psi monitor for %s memory pressure; errno=%d",
-            level_name[level], errno);
-    }
+    psi_group_remove(&psi_monitors, idx);
     maxevents--;
-    destroy_psi_monitor(fd);
-    mpevfd[level] = -1;
+    psi_monitor_idx[level] = -1;
 }
 
-enum class MemcgVersion {
-    kNotFound,
-    kV1,
-    kV2,
-};
+/*
+ * Applies the current psi_thresholds and window to the monitor of a level. A changed monitor is
+ * replaced only after the new one is registered, so pressure is monitored during the change.
+ */
+static bool update_mp_psi(enum vmpressure_level level) {
+    int idx = psi_monitor_idx[level];
 
-static MemcgVersion __memcg_version() {
-    std::string cgroupv2_path, memcg_path;
+    if (idx < 0) {
+        return init_mp_psi(level);
+    }
+    if (!psi_thresholds[level].threshold_ms) {
+        destroy_mp_psi(level);
+        return true;
+    }
+    if (psi_group_update(&psi_monitors, idx, psi_thresholds[level].threshold_ms * US_PER_MS,
+                         psi_window_size_ms * US_PER_MS) < 0) {
+        ALOGE("Failed to update psi monitor for %s memory pressure; errno=%d",
+              level_name[level], errno);
+        return false;
+    }
 
-    if (!CgroupGetControllerPath("memory", &memcg_path)) {
-        return MemcgVersion::kNotFound;
+    return true;
+}
+
+/*
+ * Sustained medium pressure trigger over PSI_TUNE_LONG_WINDOW_MS at the stall rate of
+ * ro.lmk.psi_partial_stall_ms. It keeps long, moderate stalls reported while psi_auto_tune has
+ * raised the short window threshold of the medium level above that rate.
+ */
+static bool update_mp_psi_long() {
+    int idx = psi_long_monitor_idx;
+    int threshold_us;
+
+    if (!use_psi_monitors || !psi_auto_tune || !psi_partial_stall_ms ||
+        psi_window_size_ms <= 0 || psi_window_size_ms >= PSI_TUNE_LONG_WINDOW_MS) {
+        if (idx >= 0) {
+            psi_group_remove(&psi_monitors, idx);
+            maxevents--;
+            psi_long_monitor_idx = -1;
+        }
+        return true;
     }
-    return CgroupGetControllerPath(CGROUPV2_HIERARCHY_NAME, &cgroupv2_path) &&
-                           cgroupv2_path == memcg_path
-                   ? MemcgVersion::kV2
-                   : MemcgVersion::kV1;
+
+    threshold_us = static_cast<int>((int64_t)psi_partial_stall_ms * US_PER_MS *
+                                    PSI_TUNE_LONG_WINDOW_MS / psi_window_size_ms);
+    if (idx >= 0) {
+        if (psi_group_update(&psi_monitors, idx, threshold_us,
+                             PSI_TUNE_LONG_WINDOW_MS * US_PER_MS) < 0) {
+            ALOGE("Failed to update long window psi monitor; errno=%d", errno);
+            return false;
+        }
+        return true;
+    }
+
+    struct psi_trigger trigger = {
+        .resource = PSI_MEMORY,
+        .stall_type = psi_thresholds[VMPRESS_LEVEL_MEDIUM].stall_type,
+        .threshold_us = threshold_us,
+        .window_us = PSI_TUNE_LONG_WINDOW_MS * US_PER_MS,
+    };
+    psi_long_hinfo.handler = mp_event_psi;
+    psi_long_hinfo.data = VMPRESS_LEVEL_MEDIUM;
+    idx = psi_group_add(&psi_monitors, &trigger, &psi_long_hinfo);
+    if (idx < 0) {
+        ALOGE("Failed to add long window psi monitor; errno=%d", errno);
+        return false;
+    }
+    maxevents++;
+    psi_long_monitor_idx = idx;
+
+    return true;
 }
 
-static MemcgVersion memcg_version() {
-    static MemcgVersion version = __memcg_version();
+/*
+ * Per level state of ro.lmk.psi_auto_tune. An episode lasts from an event of the level to the
+ * next one and is useful if a kill happened in it. Its stall is the avg10 stall of the level's
+ * stall type scaled to the psi window, sampled when the event was evaluated.
+ */
+struct psi_tune_state {
+    struct timespec period_start_tm;
+    struct timespec episode_start_tm;
+    bool in_episode;
+    /* -1 until the stall of the current episode is sampled */
+    int episode_stall_ms;
+    int useful_stall_ms[PSI_TUNE_MAX_SAMPLES];
+    int useful_count;
+    int idle_stall_ms[PSI_TUNE_MAX_SAMPLES];
+    int idle_count;
+};
+static struct psi_tune_state psi_tune_st[VMPRESS_LEVEL_COUNT];
 
-    return version;
+static int psi_tune_percentile(int *samples, int count, int pct) {
+    std::sort(samples, samples + count);
+    return samples[(count - 1) * pct / 100];
+}
+
+static void psi_tune_sample(enum vmpressure_level level, struct psi_data *psi_data) {
+    psi_tune_st[level].episode_stall_ms = static_cast<int>(
+            psi_data->mem_stats[psi_thresholds[level].stall_type].avg10 * psi_window_size_ms /
+            100);
+}
+
+/*
+ * With ro.lmk.psi_auto_tune, the medium and critical level thresholds are set every
+ * PSI_TUNE_PERIOD_MS from the stalls of the period's episodes: to the 10th percentile of the
+ * stalls that were followed by a kill, which keeps 90% of the useful wakeups, or, when less than
+ * 10% of the episodes were useful, at least PSI_TUNE_STEP_MS above the current threshold and up
+ * to the 90th percentile of the stalls that were not. Thresholds stay between the configured
+ * stall threshold and twice it. The super critical threshold is an emergency limit and is not
+ * tuned. Kills are not attributed to the trigger window that woke lmkd up, so avg10 stands in
+ * for the stall of that window.
+ */
+static void psi_tune_event(enum vmpressure_level level, struct timespec *tm) {
+    struct psi_tune_state *st = &psi_tune_st[level];
+    int base_ms = level == VMPRESS_LEVEL_MEDIUM ? psi_partial_stall_ms : psi_complete_stall_ms;
+    int max_ms = std::min(base_ms * 2, psi_window_size_ms);
+    int threshold_ms = psi_thresholds[level].threshold_ms;
+    int new_threshold_ms = threshold_ms;
+    int sampled;
+
+    if (!st->in_episode) {
+        st->period_start_tm = *tm;
+    } else if (st->episode_stall_ms >= 0) {
+        if (get_time_diff_ms(&st->episode_start_tm, &last_kill_tm) >= 0) {
+            if (st->useful_count < PSI_TUNE_MAX_SAMPLES) {
+                st->useful_stall_ms[st->useful_count++] = st->episode_stall_ms;
+            }
+        } else if (st->idle_count < PSI_TUNE_MAX_SAMPLES) {
+            st->idle_stall_ms[st->idle_count++] = st->episode_stall_ms;
+        }
+    }
+    st->in_episode = true;
+    st->episode_start_tm = *tm;
+    st->episode_stall_ms = -1;
+
+    if (get_time_diff_ms(&st->period_start_tm, tm) < PSI_TUNE_PERIOD_MS) {
+        return;
+    }
+
+    sampled = st->useful_count + st->idle_count;
+    if (sampled >= PSI_TUNE_MIN_EVENTS) {
+        if (st->useful_count * 10 < sampled) {
+            new_threshold_ms = threshold_ms + PSI_TUNE_STEP_MS;
+            if (st->idle_count) {
+                new_threshold_ms = std::max(new_threshold_ms,
+                        psi_tune_percentile(st->idle_stall_ms, st->idle_count, 90));
+            }
+        } else {
+            new_threshold_ms = psi_tune_percentile(st->useful_stall_ms, st->useful_count, 10);
+        }
+        new_threshold_ms = std::max(std::min(new_threshold_ms, max_ms), base_ms);
+    }
+    if (new_threshold_ms != threshold_ms) {
+        psi_thresholds[level].threshold_ms = new_threshold_ms;
+        if (update_mp_psi(level)) {
+            ALOGI("%s pressure psi threshold tuned to %dms after %d of %d events led to kills",
+                  level_name[level], new_threshold_ms, st->useful_count, sampled);
+        } else {
+            psi_thresholds[level].threshold_ms = threshold_ms;
+        }
+    }
+    st->period_start_tm = *tm;
+    st->useful_count = 0;
+    st->idle_count = 0;
 }
 
-static void memevent_listener_notification(int data __unused, uint32_t events __unused,
-                                           struct polling_params* poll_params __unused) {
+static void memevent_listener_notification(int data, uint32_t events,
+                                           struct polling_params* poll_params) {
+    static struct timespec last_fast_check_tm;
     struct timespec curr_tm;
     std::vector<mem_event_t> mem_events;
+    bool direct_reclaim_began = false;
+
+    if (!events) {
+        /* Polling started by a memory pressure check done from this handler */
+        mp_event_psi(data, 0, poll_params);
+        return;
+    }
 
     if (clock_gettime(CLOCK_MONOTONIC_COARSE, &curr_tm) != 0) {
         direct_reclaim_start_tm.tv_sec = 0;
@@ -4184,6 +7584,7 @@ static void memevent_listener_notification(int data __unused, uint32_t events __
             /* Direct Reclaim */
             case MEM_EVENT_DIRECT_RECLAIM_BEGIN:
                 direct_reclaim_start_tm = curr_tm;
+                direct_reclaim_began = true;
                 break;
             case MEM_EVENT_DIRECT_RECLAIM_END:
                 direct_reclaim_start_tm.tv_sec = 0;
@@ -4200,10 +7601,23 @@ static void memevent_listener_notification(int data __unused, uint32_t events __
                 break;
         }
     }
+
+    /*
+     * When direct reclaim begins while lmkd is neither polling nor waiting for a kill, check the
+     * memory pressure right away instead of waiting for the next PSI event. If the check finds
+     * the device in direct reclaim it starts polling through this handler.
+     */
+    if (memevent_fast_kill && use_psi_monitors && direct_reclaim_began &&
+        !poll_params->poll_handler && !poll_params->paused_handler &&
+        get_time_diff_ms(&last_fast_check_tm, &curr_tm) >= PSI_POLL_PERIOD_SHORT_MS) {
+        last_fast_check_tm = curr_tm;
+        mp_event_psi(data, 0, poll_params);
+    }
 }
 
 static bool init_memevent_listener_monitoring() {
-    static struct event_handler_info direct_reclaim_poll_hinfo = {0,
+    /* Memory pressure checks done from the handler are treated as the lowest level ones */
+    static struct event_handler_info direct_reclaim_poll_hinfo = {VMPRESS_LEVEL_LOW,
                                                                   memevent_listener_notification};
 
     if (memevent_listener) return true;
@@ -4255,11 +7669,16 @@ static bool init_memevent_listener_monitoring() {
     return true;
 }
 
-static bool init_psi_monitors() {
+static void set_psi_thresholds() {
     /* In default PSI mode override stall amounts using system properties */
     psi_thresholds[VMPRESS_LEVEL_MEDIUM].threshold_ms = psi_partial_stall_ms;
     psi_thresholds[VMPRESS_LEVEL_CRITICAL].threshold_ms = psi_complete_stall_ms;
     psi_thresholds[VMPRESS_LEVEL_SUPER_CRITICAL].threshold_ms = psi_complete_stall_scrit_ms;
+}
+
+static bool init_psi_monitors() {
+    set_psi_thresholds();
+    psi_group_init(&psi_monitors, epollfd);
 
     if (!init_mp_psi(VMPRESS_LEVEL_MEDIUM)) {
         return false;
@@ -4276,6 +7695,49 @@ static bool init_psi_monitors() {
     return true;
 }
 
+static void init_psi_long_monitor() {
+    /* The short window medium trigger keeps lmkd working without it */
+    if (!update_mp_psi_long()) {
+        ALOGW("Sustained medium pressure monitoring is not available");
+    }
+}
+
+/* Applies new psi properties to the running monitors without a gap in monitoring */
+static bool update_psi_monitors() {
+    set_psi_thresholds();
+
+    if (!update_mp_psi(VMPRESS_LEVEL_MEDIUM) || !update_mp_psi(VMPRESS_LEVEL_CRITICAL) ||
+        !update_mp_psi(VMPRESS_LEVEL_SUPER_CRITICAL)) {
+        return false;
+    }
+    init_psi_long_monitor();
+    return true;
+}
+
+static void get_monitor_config(struct monitor_config *config);
+static bool monitor_config_equal(struct monitor_config *a, struct monitor_config *b);
+
+/*
+ * Applies changed monitor settings after the properties were updated. Monitors are left alone
+ * if their settings did not change and psi triggers are reprogrammed in place when psi stays in
+ * use, otherwise monitors are recreated.
+ */
+static bool update_monitors() {
+    struct monitor_config config;
+
+    get_monitor_config(&config);
+    if (monitor_config_equal(&config, &monitor_config)) {
+        return true;
+    }
+    if (use_psi_monitors && config.use_psi) {
+        monitor_config = config;
+        return update_psi_monitors();
+    }
+
+    destroy_monitors();
+    return init_monitors();
+}
+
 static bool init_mp_common(enum vmpressure_level level) {
     // The implementation of this function relies on memcg statistics that are only available in the
     // v1 cgroup hierarchy.
@@ -4372,10 +7834,27 @@ static void kernel_event_handler(int data __unused, uint32_t events __unused,
     poll_kernel(kpoll_fd);
 }
 
+static void get_monitor_config(struct monitor_config *config) {
+    config->use_psi = GET_LMK_PROPERTY(bool, "use_psi", true);
+    config->psi_partial_stall_ms = psi_partial_stall_ms;
+    config->psi_complete_stall_ms = psi_complete_stall_ms;
+    config->psi_complete_stall_scrit_ms = psi_complete_stall_scrit_ms;
+    config->psi_window_size_ms = psi_window_size_ms;
+    config->psi_auto_tune = psi_auto_tune;
+}
+
+static bool monitor_config_equal(struct monitor_config *a, struct monitor_config *b) {
+    return a->use_psi == b->use_psi && a->psi_partial_stall_ms == b->psi_partial_stall_ms &&
+           a->psi_complete_stall_ms == b->psi_complete_stall_ms &&
+           a->psi_complete_stall_scrit_ms == b->psi_complete_stall_scrit_ms &&
+           a->psi_window_size_ms == b->psi_window_size_ms &&
+           a->psi_auto_tune == b->psi_auto_tune;
+}
+
 static bool init_monitors() {
+    get_monitor_config(&monitor_config);
     /* Try to use psi monitor first if kernel has it */
-    use_psi_monitors = GET_LMK_PROPERTY(bool, "use_psi", true) &&
-        init_psi_monitors();
+    use_psi_monitors = monitor_config.use_psi && init_psi_monitors();
     /* Fall back to vmpressure */
     if (!use_psi_monitors &&
         (!init_mp_common(VMPRESS_LEVEL_LOW) ||
@@ -4385,6 +7864,7 @@ static bool init_monitors() {
         return false;
     }
     if (use_psi_monitors) {
+        init_psi_long_monitor();
         ALOGI("Using psi monitors for memory pressure detection");
     } else {
         ALOGI("Using vmpressure for memory pressure detection");
@@ -4396,6 +7876,11 @@ static bool init_monitors() {
 
 static void destroy_monitors() {
     if (use_psi_monitors) {
+        if (psi_long_monitor_idx >= 0) {
+            psi_group_remove(&psi_monitors, psi_long_monitor_idx);
+            maxevents--;
+            psi_long_monitor_idx = -1;
+        }
         destroy_mp_psi(VMPRESS_LEVEL_SUPER_CRITICAL);
         destroy_mp_psi(VMPRESS_LEVEL_CRITICAL);
         destroy_mp_psi(VMPRESS_LEVEL_MEDIUM);
@@ -4548,6 +8033,10 @@ static int init(void) {
         procadjslot_list[i].prev = &procadjslot_list[i];
     }
 
+    if (!init_proc_pool()) {
+        ALOGW("Process records will be allocated from the heap");
+    }
+
     memset(killcnt_idx, KILLCNT_INVALID_IDX, sizeof(killcnt_idx));
 
     /*
@@ -4567,6 +8056,13 @@ static int init(void) {
         close(pidfd);
     }
     ALOGI("Process polling is %s", pidfd_supported ? "supported" : "not supported" );
+    if (pidfd_supported && !init_proc_exit_tracking()) {
+        ALOGW("Records of exited processes will be removed only on request");
+    }
+
+    if (isIoUringSupported && !init_procs_prio_ring()) {
+        ALOGW("LMK_PROCS_PRIO will be handled without io_uring");
+    }
 
     if (!lmkd_init_hook()) {
         ALOGE("Failed to initialize LMKD hooks.");
@@ -4735,6 +8231,9 @@ static void mainloop(void) {
             ALOGE("epoll_wait failed (errno=%d)", errno);
             continue;
         }
+        if (nevents > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &event_wakeup_tm);
+        }
 
         /*
          * First pass to see if any data socket connections were dropped.
@@ -4843,8 +8342,13 @@ static int on_boot_completed() {
 }
 
 static void create_handle_for_perf_iop() {
-    handle_perfd = dlopen(PERFD_LIB, RTLD_NOW);
-    handle_iopd = dlopen(IOPD_LIB, RTLD_NOW);
+    /* Opened once, every dlopen() would take another reference */
+    if (!handle_perfd) {
+        handle_perfd = dlopen(PERFD_LIB, RTLD_NOW);
+    }
+    if (!handle_iopd) {
+        handle_iopd = dlopen(IOPD_LIB, RTLD_NOW);
+    }
 }
 
 static void close_handle_for_perf_iop() {
@@ -4869,8 +8373,10 @@ static void init_PreferredApps() {
     }
 
     if (perf_ux_engine_trigger || perf_sync_request) {
-        // Initialize preferred_apps
-        preferred_apps = (char *) malloc ( PREFERRED_OUT_LENGTH * sizeof(char));
+        // Initialize preferred_apps, reused when reinitializing
+        if (preferred_apps == NULL) {
+            preferred_apps = (char *) malloc ( PREFERRED_OUT_LENGTH * sizeof(char));
+        }
         if (preferred_apps == NULL) {
             enable_preferred_apps = false;
         } else {
@@ -5033,9 +8539,24 @@ static void update_perf_props() {
 }
 
 static bool update_props() {
+#ifndef LMKD_REPLAY
+    static bool props_read;
+
+    if (props_read && !watched_properties_changed()) {
+        ALOGI("Properties did not change since the last update");
+        return true;
+    }
+    props_read = true;
+#endif
+
     /* By default disable low level vmpressure events */
     debug_process_killing = GET_LMK_PROPERTY(bool, "debug", false);
+#ifdef LMKD_REPLAY
+    /* Native processes of the device running the replay are not part of the trace */
+    is_userdebug_or_eng_build = false;
+#else
     is_userdebug_or_eng_build = property_get_bool("ro.debuggable", false);
+#endif
 
     /* By default disable upgrade/downgrade logic */
     upgrade_pressure =
@@ -5077,8 +8598,44 @@ static bool update_props() {
     lowmem_min_oom_score =
             std::max(PERCEPTIBLE_APP_ADJ + 1,
                      GET_LMK_PROPERTY(int32, "lowmem_min_oom_score", DEF_LOWMEM_MIN_SCORE));
+    proc_size_cache_ms = std::max(0, GET_LMK_PROPERTY(int32, "proc_size_cache_ms",
+                                                       DEF_PROC_SIZE_CACHE_MS));
+    proc_pool_size = std::max(0, GET_LMK_PROPERTY(int32, "proc_pool_size", DEF_PROC_POOL_SIZE));
+    use_heaviest_index = GET_LMK_PROPERTY(bool, "use_heaviest_index", false);
+    use_io_uring_snapshot = GET_LMK_PROPERTY(bool, "use_io_uring_snapshot", false);
+    numa_aware = GET_LMK_PROPERTY(bool, "numa_aware", false);
+    memevent_fast_kill = GET_LMK_PROPERTY(bool, "memevent_fast_kill", false);
+    predictive_horizon_ms = std::max(0, GET_LMK_PROPERTY(int32, "predictive_horizon_ms", 0));
+    adaptive_polling = GET_LMK_PROPERTY(bool, "adaptive_polling", false);
+    psi_poll_min_ms = std::max(1, GET_LMK_PROPERTY(int32, "psi_poll_min_ms",
+                                                   PSI_POLL_PERIOD_SHORT_MS));
+    psi_poll_max_ms = std::max(psi_poll_min_ms, GET_LMK_PROPERTY(int32, "psi_poll_max_ms",
+                                                                 PSI_POLL_PERIOD_LONG_MS * 5));
+    memcg_reclaim = GET_LMK_PROPERTY(bool, "memcg_reclaim", false);
+    memcg_reclaim_budget_ms = std::max(1, GET_LMK_PROPERTY(int32, "memcg_reclaim_budget_ms",
+                                                           DEF_MEMCG_RECLAIM_BUDGET_MS));
+    memcg_reclaim_swap_util_max = clamp(0, 100, GET_LMK_PROPERTY(int32,
+            "memcg_reclaim_swap_util_max", DEF_MEMCG_RECLAIM_SWAP_UTIL_MAX));
+    batch_kill_max_victims = std::max(1, GET_LMK_PROPERTY(int32, "batch_kill_max_victims", 1));
+    kill_cost_model = GET_LMK_PROPERTY(bool, "kill_cost_model", false);
+    zoneinfo_sample_ms = std::max(0, GET_LMK_PROPERTY(int32, "zoneinfo_sample_ms", 0));
+    if (!init_memory_sampler()) {
+        ALOGW("Memory state will be read by memory pressure checks");
+    }
+    psi_auto_tune = GET_LMK_PROPERTY(bool, "psi_auto_tune", false);
+    kill_cost_file_pct = clamp(0, 100, GET_LMK_PROPERTY(int32, "kill_cost_file_pct",
+                                                        DEF_KILL_COST_FILE_PCT));
+    kill_uid_group = GET_LMK_PROPERTY(bool, "kill_uid_group", false);
+    kill_efficacy = GET_LMK_PROPERTY(bool, "kill_efficacy", false);
+    compaction_kill_suppress = GET_LMK_PROPERTY(bool, "compaction_kill_suppress", false);
+    compaction_wait_ms = std::max(0, GET_LMK_PROPERTY(int32, "compaction_wait_ms",
+                                                      DEF_COMPACTION_WAIT_MS));
+    if (!init_compaction()) {
+        ALOGW("Kills will not be held off for compaction");
+    }
 
     reaper.enable_debug(debug_process_killing);
+    update_trace_file();
 
     // Update Perf Properties
     update_perf_props();
@@ -5091,7 +8648,37 @@ static bool update_props() {
     return true;
 }
 
+#ifdef LMKD_REPLAY
+bool lmkd_replay_init() {
+    page_k = sysconf(_SC_PAGESIZE);
+    if (page_k == -1)
+        page_k = getpagesize();
+    page_k /= 1024;
+
+    if (!update_props()) {
+        return false;
+    }
+    /* Do not record the trace being replayed */
+    if (trace_fp) {
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+    mem_source = &replay_mem_source;
+
+    return true;
+}
+
+void lmkd_replay_check(int level, uint32_t events) {
+    static struct polling_params poll_params;
+
+    mp_event_psi(level, events, &poll_params);
+}
+
+/* lmkd_replay provides its own main() */
+int lmkd_main(int argc, char **argv) {
+#else
 int main(int argc, char **argv) {
+#endif
     if ((argc > 1) && argv[1]) {
         if (!strcmp(argv[1], "--reinit")) {
             if (property_set(LMKD_REINIT_PROP, "")) {
@@ -5142,6 +8729,10 @@ int main(int argc, char **argv) {
                 reaper.thread_cnt());
         }
 
+        if (!init_kill_report()) {
+            ALOGW("Kill reports will be logged from the main thread");
+        }
+
         if (!watchdog.init()) {
             ALOGE("Failed to initialize the watchdog");
         }
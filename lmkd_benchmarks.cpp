@@ -0,0 +1,236 @@
+/*
+ *  Copyright 2024 Google, Inc
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Microbenchmarks of the lmkd hot paths. lmkd.cpp is built into this file with LMKD_REPLAY so that
+ * its internals can be called directly and the parsers can be fed with /proc images captured when
+ * the benchmark starts.
+ */
+
+#include "lmkd.cpp"
+
+#include <string>
+
+#include <android-base/file.h>
+#include <benchmark/benchmark.h>
+
+#define BENCHMARK_FIRST_PID 100000
+
+static std::string proc_images[LMKD_TRACE_FILE_COUNT];
+static std::string replay_buf;
+
+static const char* const proc_image_paths[LMKD_TRACE_FILE_COUNT] = {
+    VMSTAT_PATH,
+    MEMINFO_PATH,
+    ZONEINFO_PATH,
+    psi_resource_file[PSI_MEMORY],
+    psi_resource_file[PSI_IO],
+    psi_resource_file[PSI_CPU],
+};
+
+char *lmkd_replay_read(enum lmkd_trace_file file) {
+    /* Parsers modify the buffer, hand out a copy of the image */
+    replay_buf = proc_images[file];
+    return replay_buf.data();
+}
+
+int lmkd_replay_time(struct timespec *tm) {
+    return clock_gettime(CLOCK_MONOTONIC_COARSE, tm);
+}
+
+int lmkd_replay_kill(int, int, const char *) {
+    return 0;
+}
+
+bool lmkd_replay_property_bool(const char *, bool def) {
+    return def;
+}
+
+int32_t lmkd_replay_property_int32(const char *, int32_t def) {
+    return def;
+}
+
+int64_t lmkd_replay_property_int64(const char *, int64_t def) {
+    return def;
+}
+
+static bool capture_proc_images() {
+    for (int i = 0; i < LMKD_TRACE_FILE_COUNT; i++) {
+        if (!android::base::ReadFileToString(proc_image_paths[i], &proc_images[i])) {
+            return false;
+        }
+    }
+
+    page_k = sysconf(_SC_PAGESIZE) / 1024;
+    mem_source = &replay_mem_source;
+
+    return true;
+}
+
+/* Register count synthetic processes per oom_score_adj slot with fresh cached sizes */
+static void add_synthetic_procs(int slots, int count) {
+    struct timespec tm;
+    int pid = BENCHMARK_FIRST_PID;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &tm);
+    /* Keep the cached sizes valid without re-reading the status of the made up pids */
+    tm.tv_sec += 3600;
+    proc_size_cache_ms = 1000;
+
+    for (int slot = 0; slot < slots; slot++) {
+        for (int i = 0; i < count; i++) {
+            struct proc *procp = static_cast<struct proc*>(calloc(1, sizeof(struct proc)));
+
+            procp->pid = pid++;
+            procp->pidfd = -1;
+            procp->oomadj = OOM_SCORE_ADJ_MAX - slot;
+            procp->valid = true;
+            procp->size_cache = 1 + (procp->pid * 2654435761u) % 100000;
+            procp->size_cache_tm = tm;
+            proc_insert(procp);
+        }
+    }
+}
+
+static void remove_synthetic_procs(int total) {
+    for (int pid = BENCHMARK_FIRST_PID; pid < BENCHMARK_FIRST_PID + total; pid++) {
+        pid_remove(pid);
+    }
+}
+
+static void BM_reread_meminfo(benchmark::State& state) {
+    static struct reread_data file_data = {
+        .filename = MEMINFO_PATH,
+        .fd = -1,
+    };
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(reread_file(&file_data));
+    }
+}
+BENCHMARK(BM_reread_meminfo);
+
+static void BM_meminfo_parse(benchmark::State& state) {
+    union meminfo mi;
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(meminfo_parse(&mi));
+    }
+}
+BENCHMARK(BM_meminfo_parse);
+
+static void BM_vmstat_parse(benchmark::State& state) {
+    union vmstat vs;
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(vmstat_parse(&vs));
+    }
+}
+BENCHMARK(BM_vmstat_parse);
+
+static void BM_zoneinfo_parse(benchmark::State& state) {
+    struct zoneinfo zi;
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(zoneinfo_parse(&zi));
+    }
+}
+BENCHMARK(BM_zoneinfo_parse);
+
+static void BM_parse_one_zone_watermark(benchmark::State& state) {
+    struct watermark_info w;
+
+    for (auto _ : state) {
+        replay_buf = proc_images[LMKD_TRACE_ZONEINFO];
+        benchmark::DoNotOptimize(parse_one_zone_watermark(replay_buf.data(), &w));
+    }
+}
+BENCHMARK(BM_parse_one_zone_watermark);
+
+static void BM_parse_psi_line(benchmark::State& state) {
+    struct psi_stats stats[PSI_TYPE_COUNT];
+    char line[] = "some avg10=1.23 avg60=0.45 avg300=0.06 total=123456789";
+    char buf[sizeof(line)];
+
+    for (auto _ : state) {
+        memcpy(buf, line, sizeof(line));
+        benchmark::DoNotOptimize(parse_psi_line(buf, PSI_SOME, stats));
+    }
+}
+BENCHMARK(BM_parse_psi_line);
+
+static void BM_proc_get_heaviest(benchmark::State& state) {
+    int count = state.range(0);
+
+    use_heaviest_index = state.range(1);
+    add_synthetic_procs(1, count);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(proc_get_heaviest(OOM_SCORE_ADJ_MAX));
+    }
+    remove_synthetic_procs(count);
+}
+BENCHMARK(BM_proc_get_heaviest)->ArgsProduct({{16, 64, 256, 1024}, {0, 1}});
+
+static void BM_pid_lookup(benchmark::State& state) {
+    int slots = ADJTOSLOT(OOM_SCORE_ADJ_MAX) + 1;
+    int count = (state.range(0) / slots) * slots;
+    int pid = BENCHMARK_FIRST_PID;
+
+    add_synthetic_procs(slots, count / slots);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(pid_lookup(pid));
+        if (++pid == BENCHMARK_FIRST_PID + count) {
+            pid = BENCHMARK_FIRST_PID;
+        }
+    }
+    remove_synthetic_procs(count);
+}
+BENCHMARK(BM_pid_lookup)->Arg(1000)->Arg(10000);
+
+static void BM_pid_insert_remove(benchmark::State& state) {
+    int slots = ADJTOSLOT(OOM_SCORE_ADJ_MAX) + 1;
+    int count = (state.range(0) / slots) * slots;
+    int pid = BENCHMARK_FIRST_PID;
+
+    add_synthetic_procs(slots, count / slots);
+    for (auto _ : state) {
+        struct proc *procp = pid_lookup(pid);
+        struct proc copy = *procp;
+
+        /* Remove a record and insert it back to keep the table size unchanged */
+        pid_remove(pid);
+        procp = static_cast<struct proc*>(calloc(1, sizeof(struct proc)));
+        *procp = copy;
+        proc_insert(procp);
+        if (++pid == BENCHMARK_FIRST_PID + count) {
+            pid = BENCHMARK_FIRST_PID;
+        }
+    }
+    remove_synthetic_procs(count);
+}
+BENCHMARK(BM_pid_insert_remove)->Arg(1000)->Arg(10000);
+
+int main(int argc, char** argv) {
+    if (!capture_proc_images()) {
+        fprintf(stderr, "Failed to capture /proc images\n");
+        return 1;
+    }
+
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+
+    return 0;
+}
@@ -0,0 +1,244 @@
+/*
+ *  Copyright 2024 Google, Inc
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Feeds a memory pressure trace recorded by lmkd through its decision logic and reports the kills
+ * it decides on. Usage:
+ *
+ *   lmkd_replay [-p <ro.lmk property name>=<value>]... <trace file>
+ *
+ * The replay is open loop: memory state after a kill is the recorded one, so kills decided at
+ * other times than during recording are not reflected in the following cycles.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "lmkd_replay.h"
+
+#define NS_PER_US 1000L
+#define US_PER_SEC 1000000L
+
+/* Property overrides */
+static std::map<std::string, std::string> props;
+
+/* Cycle being replayed */
+static struct timespec cycle_tm;
+static std::vector<std::string> cycle_files[LMKD_TRACE_FILE_COUNT];
+static size_t cycle_file_pos[LMKD_TRACE_FILE_COUNT];
+
+static struct timespec first_tm;
+static int kill_count;
+
+static long get_time_diff_ms(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000L + (to->tv_nsec - from->tv_nsec) / 1000000L;
+}
+
+static long get_cpu_time_us() {
+    struct timespec tm;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tm);
+    return tm.tv_sec * US_PER_SEC + tm.tv_nsec / NS_PER_US;
+}
+
+char *lmkd_replay_read(enum lmkd_trace_file file) {
+    if (file < 0 || file >= LMKD_TRACE_FILE_COUNT ||
+        cycle_file_pos[file] >= cycle_files[file].size()) {
+        return NULL;
+    }
+
+    return cycle_files[file][cycle_file_pos[file]++].data();
+}
+
+int lmkd_replay_time(struct timespec *tm) {
+    *tm = cycle_tm;
+    return 0;
+}
+
+int lmkd_replay_kill(int kill_reason, int min_score_adj, const char *kill_desc) {
+    kill_count++;
+    printf("kill at %ldms: reason %d, min_score_adj %d (%s)\n",
+           get_time_diff_ms(&first_tm, &cycle_tm), kill_reason, min_score_adj,
+           kill_desc ? kill_desc : "no reason");
+
+    /* Report a page as freed so that the post-kill state is entered as after a real kill */
+    return 1;
+}
+
+static const char *get_override(const char *name) {
+    auto it = props.find(name);
+
+    return it == props.end() ? NULL : it->second.c_str();
+}
+
+bool lmkd_replay_property_bool(const char *name, bool def) {
+    const char *val = get_override(name);
+
+    if (!val) {
+        return def;
+    }
+    return !strcmp(val, "1") || !strcmp(val, "true") || !strcmp(val, "y") ||
+           !strcmp(val, "yes") || !strcmp(val, "on");
+}
+
+int32_t lmkd_replay_property_int32(const char *name, int32_t def) {
+    const char *val = get_override(name);
+
+    return val ? (int32_t)strtol(val, NULL, 0) : def;
+}
+
+int64_t lmkd_replay_property_int64(const char *name, int64_t def) {
+    const char *val = get_override(name);
+
+    return val ? (int64_t)strtoll(val, NULL, 0) : def;
+}
+
+/*
+ * Reads the files recorded for the cycle which header was already read. Returns false at the end
+ * of the trace, *next_cycle is set when the header of the next cycle was read.
+ */
+static bool read_cycle_files(FILE *fp, bool *next_cycle, struct timespec *next_tm,
+                             int *next_level, uint32_t *next_events) {
+    char line[128];
+
+    for (int i = 0; i < LMKD_TRACE_FILE_COUNT; i++) {
+        cycle_files[i].clear();
+        cycle_file_pos[i] = 0;
+    }
+
+    *next_cycle = false;
+    while (fgets(line, sizeof(line), fp)) {
+        long sec, nsec;
+        int file;
+        size_t len;
+
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (sscanf(line, "cycle %ld %ld %d %u", &sec, &nsec, next_level, next_events) == 4) {
+            next_tm->tv_sec = sec;
+            next_tm->tv_nsec = nsec;
+            *next_cycle = true;
+            return true;
+        }
+        if (sscanf(line, "file %d %zu", &file, &len) != 2 || file < 0 ||
+            file >= LMKD_TRACE_FILE_COUNT) {
+            fprintf(stderr, "Malformed trace record: %s", line);
+            return false;
+        }
+
+        std::string content(len, '\0');
+        if (fread(content.data(), 1, len, fp) != len || fgetc(fp) != '\n') {
+            fprintf(stderr, "Truncated trace record\n");
+            return false;
+        }
+        cycle_files[file].push_back(std::move(content));
+    }
+
+    return !ferror(fp);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-p <property>=<value>]... <trace file>\n", name);
+    fprintf(stderr, "  -p  override ro.lmk.<property> for the replay\n");
+}
+
+int main(int argc, char **argv) {
+    FILE *fp;
+    struct timespec next_tm;
+    int level;
+    uint32_t events;
+    bool have_cycle;
+    int cycles = 0;
+    int event_cycles = 0;
+    long cpu_total_us = 0;
+    long cpu_max_us = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:")) != -1) {
+        char *sep;
+
+        if (opt != 'p' || (sep = strchr(optarg, '=')) == NULL) {
+            usage(argv[0]);
+            return 1;
+        }
+        props[std::string(optarg, sep - optarg)] = sep + 1;
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fp = fopen(argv[optind], "re");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    if (!lmkd_replay_init()) {
+        fprintf(stderr, "Failed to initialize lmkd\n");
+        fclose(fp);
+        return 1;
+    }
+
+    /* Skip to the first cycle */
+    if (!read_cycle_files(fp, &have_cycle, &next_tm, &level, &events)) {
+        fclose(fp);
+        return 1;
+    }
+    first_tm = next_tm;
+    while (have_cycle) {
+        int cycle_level = level;
+        uint32_t cycle_events = events;
+        long cpu_start_us;
+        long cpu_us;
+
+        cycle_tm = next_tm;
+        if (!read_cycle_files(fp, &have_cycle, &next_tm, &level, &events)) {
+            break;
+        }
+
+        cpu_start_us = get_cpu_time_us();
+        lmkd_replay_check(cycle_level, cycle_events);
+        cpu_us = get_cpu_time_us() - cpu_start_us;
+
+        cycles++;
+        if (cycle_events) {
+            event_cycles++;
+        }
+        cpu_total_us += cpu_us;
+        if (cpu_us > cpu_max_us) {
+            cpu_max_us = cpu_us;
+        }
+    }
+    fclose(fp);
+
+    printf("cycles: %d (%d events) over %ldms, kills: %d\n", cycles, event_cycles,
+           get_time_diff_ms(&first_tm, &cycle_tm), kill_count);
+    printf("cpu time per cycle: avg %ldus, max %ldus\n",
+           cycles ? cpu_total_us / cycles : 0, cpu_max_us);
+
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ *  Copyright 2024 Google, Inc
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Memory pressure traces are recorded by lmkd when the lmkd.debug.trace_file property names a
+ * file and replayed by lmkd_replay. A trace is a text file of records:
+ *
+ *   # comment
+ *   cycle <tv_sec> <tv_nsec> <vmpressure level> <events>
+ *   file <lmkd_trace_file> <length>
+ *   <length bytes of file content>
+ *
+ * Each cycle record starts one mp_event_psi() call and is followed by the files it read, in the
+ * order they were read. A file can be read more than once per cycle.
+ */
+#define LMKD_TRACE_HEADER "# lmkd memory pressure trace v1"
+
+/* Memory state files in a trace, matches enum snapshot_file of lmkd.cpp */
+enum lmkd_trace_file {
+    LMKD_TRACE_VMSTAT = 0,
+    LMKD_TRACE_MEMINFO,
+    LMKD_TRACE_ZONEINFO,
+    LMKD_TRACE_PSI_MEMORY,
+    LMKD_TRACE_PSI_IO,
+    LMKD_TRACE_PSI_CPU,
+    LMKD_TRACE_FILE_COUNT
+};
+
+#ifdef LMKD_REPLAY
+
+/* Provided by lmkd.cpp built with LMKD_REPLAY */
+
+/* Loads the tunables and switches memory state reads to lmkd_replay_read() */
+bool lmkd_replay_init();
+/* Runs one memory pressure check */
+void lmkd_replay_check(int level, uint32_t events);
+
+/* Provided by the replay tool */
+
+/* Returns a modifiable copy of the next recorded content of the file or NULL */
+char *lmkd_replay_read(enum lmkd_trace_file file);
+/* Returns the time recorded for the current cycle */
+int lmkd_replay_time(struct timespec *tm);
+/* Called instead of killing, returns the number of pages reported as freed */
+int lmkd_replay_kill(int kill_reason, int min_score_adj, const char *kill_desc);
+/* Overrides of ro.lmk.* properties given on the command line */
+bool lmkd_replay_property_bool(const char *name, bool def);
+int32_t lmkd_replay_property_int32(const char *name, int32_t def);
+int64_t lmkd_replay_property_int64(const char *name, int64_t def);
+
+#endif /* LMKD_REPLAY */
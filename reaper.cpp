@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/pidfd.h>
 #include <sys/resource.h>
 #include <sys/sysinfo.h>
@@ -37,6 +38,7 @@
 #include "reaper.h"
 
 #define NS_PER_MS (NS_PER_SEC / MS_PER_SEC)
+#define NS_PER_US (NS_PER_SEC / US_PER_SEC)
 #define THREAD_POOL_SIZE 2
 
 #ifndef __NR_process_mrelease
@@ -53,6 +55,11 @@ static inline long get_time_diff_ms(struct timespec *from,
            (to->tv_nsec - from->tv_nsec) / (long)NS_PER_MS;
 }
 
+static inline long get_time_diff_us(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * (long)US_PER_SEC +
+           (to->tv_nsec - from->tv_nsec) / (long)NS_PER_US;
+}
+
 static void set_process_group_and_prio(uid_t uid, int pid, const std::vector<std::string>& profiles,
                                        int prio) {
     DIR* d;
@@ -89,9 +96,10 @@ static void set_process_group_and_prio(uid_t uid, int pid, const std::vector<std
 }
 
 static void* reaper_main(void* param) {
-    Reaper *reaper = static_cast<Reaper*>(param);
+    struct Reaper::worker* w = static_cast<struct Reaper::worker*>(param);
+    Reaper *reaper = w->reaper;
     struct timespec start_tm, end_tm;
-    struct Reaper::target_proc target;
+    struct Reaper::request req;
     pid_t tid = gettid();
 
     // Ensure the thread does not use little cores
@@ -104,35 +112,37 @@ static void* reaper_main(void* param) {
     }
 
     for (;;) {
-        target = reaper->dequeue_request();
+        req = reaper->dequeue_request(w);
 
-        if (reaper->debug_enabled()) {
-            clock_gettime(CLOCK_MONOTONIC_COARSE, &start_tm);
-        }
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &start_tm);
 
-        if (pidfd_send_signal(target.pidfd, SIGKILL, NULL, 0)) {
+        if (!req.signaled && pidfd_send_signal(req.target.pidfd, SIGKILL, NULL, 0)) {
             // Inform the main thread about failure to kill
-            reaper->notify_kill_failure(target.pid);
+            reaper->notify_kill_failure(req.target.pid);
             goto done;
         }
 
-        set_process_group_and_prio(target.uid, target.pid,
+        set_process_group_and_prio(req.target.uid, req.target.pid,
                                    {"CPUSET_SP_FOREGROUND", "SCHED_SP_FOREGROUND"},
                                    ANDROID_PRIORITY_NORMAL);
 
-        if (process_mrelease(target.pidfd, 0)) {
-            ALOGE("process_mrelease %d failed: %s", target.pid, strerror(errno));
+        if (process_mrelease(req.target.pidfd, 0)) {
+            ALOGE("process_mrelease %d failed: %s", req.target.pid, strerror(errno));
             goto done;
         }
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &end_tm);
+        reaper->record_reap_latency(req.kill_tm);
+        w->reaped_cnt++;
+        w->reap_time_ms += get_time_diff_ms(&start_tm, &end_tm);
         if (reaper->debug_enabled()) {
-            clock_gettime(CLOCK_MONOTONIC_COARSE, &end_tm);
-            ALOGI("Process %d was reaped in %ldms", target.pid,
-                  get_time_diff_ms(&start_tm, &end_tm));
+            ALOGI("Process %d was reaped in %ldms by lmkd_reaper%d (queue depth %d, %u reaped "
+                  "in %ldms)", req.target.pid, get_time_diff_ms(&start_tm, &end_tm), w->id,
+                  reaper->queue_depth(), w->reaped_cnt, w->reap_time_ms);
         }
 
 done:
-        close(target.pidfd);
-        reaper->request_complete();
+        close(req.target.pidfd);
+        reaper->request_complete(w);
     }
 
     return NULL;
@@ -166,10 +176,29 @@ bool Reaper::init(int comm_fd) {
         return false;
     }
 
+    for (int i = 0; i < LMK_LATENCY_BUCKET_COUNT; i++) {
+        reap_latency_hist_[i] = 0;
+    }
     thread_pool_ = new pthread_t[THREAD_POOL_SIZE];
+    workers_ = new worker[THREAD_POOL_SIZE];
     for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        if (pthread_create(&thread_pool_[thread_cnt_], NULL, reaper_main, this)) {
+        struct worker* w = &workers_[thread_cnt_];
+
+        w->reaper = this;
+        w->id = thread_cnt_;
+        w->head = 0;
+        w->tail = 0;
+        w->completed = 0;
+        w->reaped_cnt = 0;
+        w->reap_time_ms = 0;
+        w->event_fd = eventfd(0, EFD_CLOEXEC);
+        if (w->event_fd < 0) {
+            ALOGE("eventfd failed: %s", strerror(errno));
+            continue;
+        }
+        if (pthread_create(&thread_pool_[thread_cnt_], NULL, reaper_main, w)) {
             ALOGE("pthread_create failed: %s", strerror(errno));
+            close(w->event_fd);
             continue;
         }
         // set normal scheduling policy for the reaper thread
@@ -185,81 +214,145 @@ bool Reaper::init(int comm_fd) {
 
     if (!thread_cnt_) {
         delete[] thread_pool_;
+        delete[] workers_;
         return false;
     }
 
-    queue_.reserve(thread_cnt_);
     comm_fd_ = comm_fd;
     return true;
 }
 
+int Reaper::queue_depth() const {
+    int depth = 0;
+
+    for (int i = 0; i < thread_cnt_; i++) {
+        depth += workers_[i].tail.load(std::memory_order_acquire) -
+                 workers_[i].completed.load(std::memory_order_acquire);
+    }
+    return depth;
+}
+
 bool Reaper::async_kill(const struct target_proc& target) {
+    struct worker* w = nullptr;
+    uint32_t min_load = worker::kQueueSize;
+    uint32_t tail;
+    bool signaled = false;
+    uint64_t val = 1;
+    struct timespec kill_tm;
+
     if (target.pidfd == -1) {
         return false;
     }
 
-    if (!thread_cnt_) {
-        return false;
+    clock_gettime(CLOCK_MONOTONIC, &kill_tm);
+    // Pick the least loaded thread
+    for (int i = 0; i < thread_cnt_; i++) {
+        uint32_t load = workers_[i].tail.load(std::memory_order_relaxed) -
+                        workers_[i].completed.load(std::memory_order_acquire);
+        if (load < min_load) {
+            min_load = load;
+            w = &workers_[i];
+        }
     }
-
-    mutex_.lock();
-    if (active_requests_ >= thread_cnt_) {
-        mutex_.unlock();
+    if (!w) {
+        // All queues are full or there are no threads
         return false;
     }
-    active_requests_++;
 
     // Duplicate pidfd instead of reusing the original one to avoid synchronization and refcounting
     // when both reaper and main threads are using or closing the pidfd
-    queue_.push_back({ dup(target.pidfd), target.pid, target.uid });
-    // Wake up a reaper thread
-    cond_.notify_one();
-    mutex_.unlock();
+    int pidfd = dup(target.pidfd);
+    if (pidfd < 0) {
+        return false;
+    }
+
+    if (min_load > 0) {
+        // The thread is busy with another process, so send SIGKILL now to avoid delaying the kill
+        // and let the thread only reap this process later
+        if (pidfd_send_signal(pidfd, SIGKILL, NULL, 0)) {
+            close(pidfd);
+            return false;
+        }
+        signaled = true;
+    }
+
+    tail = w->tail.load(std::memory_order_relaxed);
+    w->queue[tail & (worker::kQueueSize - 1)] = { { pidfd, target.pid, target.uid }, signaled,
+                                                  kill_tm };
+    w->tail.store(tail + 1, std::memory_order_release);
+    // Wake up only the chosen thread
+    if (TEMP_FAILURE_RETRY(write(w->event_fd, &val, sizeof(val))) != sizeof(val)) {
+        ALOGE("Failed to wake up lmkd_reaper%d: %s", w->id, strerror(errno));
+    }
 
     return true;
 }
 
 int Reaper::kill(const struct target_proc& target, bool synchronous) {
-    /* CAP_KILL required */
-    if (target.pidfd < 0) {
-        return ::kill(target.pid, SIGKILL);
-    }
+    struct timespec kill_tm;
+    int result;
 
     if (!synchronous && async_kill(target)) {
         // we assume the kill will be successful and if it fails we will be notified
         return 0;
     }
 
-    int result = pidfd_send_signal(target.pidfd, SIGKILL, NULL, 0);
+    // Kills which are not reaped end the stage once the signal is sent
+    clock_gettime(CLOCK_MONOTONIC, &kill_tm);
+    if (target.pidfd < 0) {
+        /* CAP_KILL required */
+        result = ::kill(target.pid, SIGKILL);
+    } else {
+        result = pidfd_send_signal(target.pidfd, SIGKILL, NULL, 0);
+    }
     if (result) {
         return result;
     }
+    record_reap_latency(kill_tm);
 
     return 0;
 }
 
-Reaper::target_proc Reaper::dequeue_request() {
-    struct target_proc target;
-    std::unique_lock<std::mutex> lock(mutex_);
+struct Reaper::request Reaper::dequeue_request(struct worker* w) {
+    struct request req;
+    uint32_t head = w->head.load(std::memory_order_relaxed);
+    uint64_t val;
 
-    while (queue_.empty()) {
-        cond_.wait(lock);
+    while (head == w->tail.load(std::memory_order_acquire)) {
+        // Queue is empty, sleep until the main thread adds a request
+        if (TEMP_FAILURE_RETRY(read(w->event_fd, &val, sizeof(val))) != sizeof(val)) {
+            ALOGE("lmkd_reaper%d failed to wait for requests: %s", w->id, strerror(errno));
+        }
     }
-    target = queue_.back();
-    queue_.pop_back();
+    req = w->queue[head & (worker::kQueueSize - 1)];
+    w->head.store(head + 1, std::memory_order_release);
 
-    return target;
+    return req;
 }
 
-void Reaper::request_complete() {
-    std::scoped_lock<std::mutex> lock(mutex_);
-    active_requests_--;
+void Reaper::request_complete(struct worker* w) {
+    w->completed.fetch_add(1, std::memory_order_release);
 }
 
-void Reaper::notify_kill_failure(int pid) {
-    std::scoped_lock<std::mutex> lock(mutex_);
+void Reaper::record_reap_latency(const struct timespec& kill_tm) {
+    struct timespec curr_tm;
+    long latency_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &curr_tm);
+    latency_us = get_time_diff_us(&kill_tm, &curr_tm);
+    reap_latency_hist_[lmkd_latency_bucket(latency_us > 0 ? latency_us : 0)].fetch_add(
+            1, std::memory_order_relaxed);
+}
 
+void Reaper::get_reap_latency_hist(unsigned int* buckets) const {
+    for (int i = 0; i < LMK_LATENCY_BUCKET_COUNT; i++) {
+        buckets[i] = reap_latency_hist_[i].load(std::memory_order_relaxed);
+    }
+}
+
+void Reaper::notify_kill_failure(int pid) {
     ALOGE("Failed to kill process %d", pid);
+    // Writes of up to PIPE_BUF bytes are atomic, so several threads can report at once
     if (TEMP_FAILURE_RETRY(write(comm_fd_, &pid, sizeof(pid))) != sizeof(pid)) {
         ALOGE("thread communication write failed: %s", strerror(errno));
     }
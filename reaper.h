@@ -16,9 +16,13 @@
 
 #pragma once
 
-#include <condition_variable>
-#include <mutex>
-#include <vector>
+#include <atomic>
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <lmkd.h>
 
 class Reaper {
 public:
@@ -27,22 +31,47 @@ public:
         int pid;
         uid_t uid;
     };
+    struct request {
+        struct target_proc target;
+        // SIGKILL was already sent by the main thread, only reaping is left
+        bool signaled;
+        // CLOCK_MONOTONIC time of the kill request
+        struct timespec kill_tm;
+    };
+    // Requests for one reaper thread. The queue is filled only by the main thread and drained
+    // only by its reaper thread, so a single-producer single-consumer ring needs no locking.
+    struct worker {
+        static constexpr uint32_t kQueueSize = 8;
+        static_assert((kQueueSize & (kQueueSize - 1)) == 0, "kQueueSize should be a power of 2");
+
+        Reaper* reaper;
+        int id;
+        // eventfd used to wake up this thread only
+        int event_fd;
+        struct request queue[kQueueSize];
+        // next request to be dequeued, modified only by the reaper thread
+        std::atomic<uint32_t> head;
+        // next free slot, modified only by the main thread
+        std::atomic<uint32_t> tail;
+        // number of completed requests, modified only by the reaper thread
+        std::atomic<uint32_t> completed;
+        // statistics of successful reaps, modified only by the reaper thread
+        uint32_t reaped_cnt;
+        long reap_time_ms;
+    };
 private:
-    // mutex_ and cond_ are used to wakeup the reaper thread.
-    std::mutex mutex_;
-    std::condition_variable cond_;
-    // mutex_ protects queue_ and active_requests_ access.
-    std::vector<struct target_proc> queue_;
-    int active_requests_;
     // write side of the pipe to communicate kill failures with the main thread
     int comm_fd_;
     int thread_cnt_;
     pthread_t* thread_pool_;
+    struct worker* workers_;
     bool debug_enabled_;
+    // LMK_LATENCY_REAP histogram, updated by all reaper threads
+    std::atomic<uint32_t> reap_latency_hist_[LMK_LATENCY_BUCKET_COUNT];
 
     bool async_kill(const struct target_proc& target);
 public:
-    Reaper() : active_requests_(0), thread_cnt_(0), debug_enabled_(false) {}
+    Reaper() : thread_cnt_(0), debug_enabled_(false) {}
 
     static bool is_reaping_supported();
 
@@ -50,11 +79,15 @@ public:
     int thread_cnt() const { return thread_cnt_; }
     void enable_debug(bool enable) { debug_enabled_ = enable; }
     bool debug_enabled() const { return debug_enabled_; }
+    // number of requests queued or being processed by all reaper threads
+    int queue_depth() const;
+    void get_reap_latency_hist(unsigned int* buckets) const;
 
     // return 0 on success or error code returned by the syscall
     int kill(const struct target_proc& target, bool synchronous);
     // below members are used only by reaper_main
-    target_proc dequeue_request();
-    void request_complete();
+    struct request dequeue_request(struct worker* w);
+    void request_complete(struct worker* w);
+    void record_reap_latency(const struct timespec& kill_tm);
     void notify_kill_failure(int pid);
 };
@@ -47,27 +47,6 @@
 
 static bool enable_stats_log = property_get_bool("ro.lmk.log_stats", true);
 
-struct proc {
-    int pid;
-    char taskname[MAX_TASKNAME_LEN];
-    struct proc* pidhash_next;
-};
-
-#define PIDHASH_SZ 1024
-static struct proc** pidhash = NULL;
-#define pid_hashfn(x) ((((x) >> 8) ^ (x)) & (PIDHASH_SZ - 1))
-
-static struct proc* pid_lookup(int pid) {
-    struct proc* procp;
-
-    if (!pidhash) return NULL;
-
-    for (procp = pidhash[pid_hashfn(pid)]; procp && procp->pid != pid; procp = procp->pidhash_next)
-        ;
-
-    return procp;
-}
-
 static void memory_stat_parse_line(const char* line, struct memory_stat* mem_st) {
     char key[MAX_TASKNAME_LEN + 1];
     int64_t value;
@@ -169,83 +148,6 @@ struct memory_stat *stats_read_memory_stat(bool per_app_memcg, int pid, uid_t ui
     return NULL;
 }
 
-static void proc_insert(struct proc* procp) {
-    if (!pidhash) {
-        pidhash = static_cast<struct proc**>(calloc(PIDHASH_SZ, sizeof(*pidhash)));
-    }
-
-    int hval = pid_hashfn(procp->pid);
-    procp->pidhash_next = pidhash[hval];
-    pidhash[hval] = procp;
-}
-
-void stats_remove_taskname(int pid) {
-    if (!enable_stats_log || !pidhash) {
-        return;
-    }
-
-    int hval = pid_hashfn(pid);
-    struct proc* procp;
-    struct proc* prevp;
-
-    for (procp = pidhash[hval], prevp = NULL; procp && procp->pid != pid;
-         procp = procp->pidhash_next)
-        prevp = procp;
-
-    if (!procp)
-        return;
-
-    if (!prevp)
-        pidhash[hval] = procp->pidhash_next;
-    else
-        prevp->pidhash_next = procp->pidhash_next;
-
-    free(procp);
-}
-
-void stats_store_taskname(int pid, const char* taskname) {
-    if (!enable_stats_log || !taskname) {
-        return;
-    }
-
-    struct proc* procp = pid_lookup(pid);
-    if (procp != NULL) {
-        if (strcmp(procp->taskname, taskname) == 0) {
-            return;
-        }
-        stats_remove_taskname(pid);
-    }
-    procp = static_cast<struct proc*>(malloc(sizeof(struct proc)));
-    procp->pid = pid;
-    strncpy(procp->taskname, taskname, MAX_TASKNAME_LEN - 1);
-    procp->taskname[MAX_TASKNAME_LEN - 1] = '\0';
-    proc_insert(procp);
-}
-
-void stats_purge_tasknames() {
-    if (!enable_stats_log || !pidhash) {
-        return;
-    }
-
-    struct proc* procp;
-    struct proc* next;
-    int i;
-    for (i = 0; i < PIDHASH_SZ; i++) {
-        procp = pidhash[i];
-        while (procp) {
-            next = procp->pidhash_next;
-            free(procp);
-            procp = next;
-        }
-    }
-    memset(pidhash, 0, PIDHASH_SZ * sizeof(*pidhash));
-}
-
-const char* stats_get_task_name(int pid) {
-    struct proc* proc = pid_lookup(pid);
-    return proc ? proc->taskname : NULL;
-}
-
 /**
  * Writes int32 in a machine independent way
  * https://docs.oracle.com/javase/7/docs/api/java/io/DataOutput.html#writeInt(int)
@@ -337,4 +239,39 @@ size_t lmkd_pack_set_kill_occurred(LMK_KILL_OCCURRED_PACKET packet,
     return index;
 }
 
+size_t lmkd_pack_set_kill_latency(LMK_KILL_OCCURRED_PACKET packet,
+                                  struct kill_latency_stat *latency_st) {
+    if (!enable_stats_log) {
+        return 0;
+    }
+
+    int32_t index = 0;
+    index = pack_int32(packet, index, LMK_STAT_KILL_LATENCY);
+    index = pack_int32(packet, index, latency_st->uid);
+    index = pack_int32(packet, index, latency_st->oom_score);
+    index = pack_int32(packet, index, (int)latency_st->kill_reason);
+    index = pack_int32(packet, index, latency_st->event_us);
+    index = pack_int32(packet, index, latency_st->parse_us);
+    index = pack_int32(packet, index, latency_st->select_us);
+    index = pack_int32(packet, index, latency_st->exit_us);
+    return index;
+}
+
+size_t lmkd_pack_set_kill_efficacy(LMK_KILL_OCCURRED_PACKET packet,
+                                   struct kill_efficacy_stat *efficacy_st) {
+    if (!enable_stats_log) {
+        return 0;
+    }
+
+    int32_t index = 0;
+    index = pack_int32(packet, index, LMK_STAT_KILL_EFFICACY);
+    index = pack_int32(packet, index, efficacy_st->uid);
+    index = pack_int32(packet, index, efficacy_st->oom_score);
+    index = pack_int32(packet, index, (int)efficacy_st->kill_reason);
+    index = pack_int32(packet, index, (int)efficacy_st->estimated_kb);
+    index = pack_int32(packet, index, (int)efficacy_st->freed_kb);
+    index = pack_int32(packet, index, efficacy_st->efficacy_pct);
+    return index;
+}
+
 #endif /* LMKD_LOG_STATS */
@@ -70,6 +70,8 @@ enum kill_reasons {
     DIRECT_RECL_AND_THROT,
     DIRECT_RECL_AND_LOW_MEM,
     DIRECT_RECL_STUCK,
+    CRITICAL_BATCH_KILL,
+    PREDICTED_LOW_MEM,
     KILL_REASON_COUNT
 };
 
@@ -89,6 +91,31 @@ struct kill_stat {
 /* LMKD reply packet to hold data for the LmkKillOccurred statsd atom */
 typedef char LMK_KILL_OCCURRED_PACKET[LMKD_REPLY_MAX_SIZE];
 
+/* LMK_STAT_KILL_LATENCY packet payload, latencies are in microseconds */
+struct kill_latency_stat {
+    int32_t uid;
+    int32_t oom_score;
+    enum kill_reasons kill_reason;
+    int32_t event_us;
+    int32_t parse_us;
+    int32_t select_us;
+    int32_t exit_us;
+};
+
+/*
+ * LMK_STAT_KILL_EFFICACY packet payload. uid is -1 if the kills measured together were of
+ * different uids, efficacy_pct is the moving average of the uid after this kill. Not sent for
+ * kills whose freed memory could not be told apart from other memory activity.
+ */
+struct kill_efficacy_stat {
+    int32_t uid;
+    int32_t oom_score;
+    enum kill_reasons kill_reason;
+    int64_t estimated_kb;
+    int64_t freed_kb;
+    int32_t efficacy_pct;
+};
+
 #ifdef LMKD_LOG_STATS
 
 #define PROC_STAT_FILE_PATH "/proc/%d/stat"
@@ -110,21 +137,18 @@ struct memory_stat *stats_read_memory_stat(bool per_app_memcg, int pid, uid_t ui
                                            int64_t rss_bytes, int64_t swap_bytes);
 
 /**
- * Registers a process taskname by pid, while it is still alive.
- */
-void stats_store_taskname(int pid, const char* taskname);
-
-/**
- * Unregister all process tasknames.
+ * Produces packet with the latencies of handling memory pressure that ended with a kill, once
+ * the killed process exits.
  */
-void stats_purge_tasknames();
+size_t lmkd_pack_set_kill_latency(LMK_KILL_OCCURRED_PACKET packet,
+                                  struct kill_latency_stat *latency_st);
 
 /**
- * Unregister a process taskname, e.g. after it has been killed.
+ * Produces packet with the memory estimated to be freed by a kill and the memory it freed, once
+ * the killed process exits.
  */
-void stats_remove_taskname(int pid);
-
-const char* stats_get_task_name(int pid);
+size_t lmkd_pack_set_kill_efficacy(LMK_KILL_OCCURRED_PACKET packet,
+                                   struct kill_efficacy_stat *efficacy_st);
 
 #else /* LMKD_LOG_STATS */
 
@@ -141,13 +165,17 @@ static inline struct memory_stat *stats_read_memory_stat(bool per_app_memcg __un
     return NULL;
 }
 
-static inline void stats_store_taskname(int pid __unused, const char* taskname __unused) {}
-
-static inline void stats_purge_tasknames() {}
-
-static inline void stats_remove_taskname(int pid __unused) {}
+static inline size_t
+lmkd_pack_set_kill_latency(LMK_KILL_OCCURRED_PACKET packet __unused,
+                           struct kill_latency_stat *latency_st __unused) {
+    return 0;
+}
 
-static inline const char* stats_get_task_name(int pid __unused) { return NULL; }
+static inline size_t
+lmkd_pack_set_kill_efficacy(LMK_KILL_OCCURRED_PACKET packet __unused,
+                            struct kill_efficacy_stat *efficacy_st __unused) {
+    return 0;
+}
 
 #endif /* LMKD_LOG_STATS */
 
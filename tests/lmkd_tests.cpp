@@ -124,6 +124,23 @@ class LmkdTest : public ::testing::Test {
                 << "Failed fetching lmkd kill count";
     }
 
+    void SendBatch(LMKD_BATCH_PACKET batch, size_t batch_size, LMKD_BATCH_PACKET replies,
+                   int& replies_size) {
+        ASSERT_EQ(lmkd_send_batch(sock, batch, batch_size), 0)
+                << "Failed sending batch to lmkd, err=" << strerror(errno);
+        replies_size = lmkd_recv_batch_replies(sock, replies);
+        ASSERT_GT(replies_size, 0) << "Failed receiving batch replies, err=" << strerror(errno);
+    }
+
+    const struct lmk_pressure_snapshot* MapPressureSnapshot() {
+        return lmkd_map_pressure_snapshot(sock);
+    }
+
+    enum get_latency_hist_result GetLatencyHist(enum lmk_latency_stage stage,
+                                                struct lmk_getlatencyhist_reply* reply) {
+        return lmkd_get_latency_hist(sock, stage, reply);
+    }
+
     static std::string ExecCommand(const std::string& command) {
         FILE* fp = popen(command.c_str(), "r");
         std::string content;
@@ -334,6 +351,95 @@ TEST_F(LmkdTest, batch_procs_oom_score_adj) {
     }
 }
 
+/*
+ * Verify that commands sent in one LMK_BATCH packet are executed in order and their replies are
+ * sent back together.
+ */
+TEST_F(LmkdTest, batch_commands) {
+    const int new_oom_score = 900;
+    LMKD_BATCH_PACKET batch;
+    LMKD_BATCH_PACKET replies;
+    LMKD_CTRL_PACKET packet;
+    struct lmk_getkillcnt kill_cnt_req = {.min_oomadj = -1000, .max_oomadj = 1000};
+    struct lmk_procprio params;
+    size_t batch_size;
+    size_t offset;
+    int replies_size;
+    int reply_count = 0;
+    int size;
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0) << "Failed forking process";
+    if (pid == 0) {
+        while (true) {
+            sleep(20);
+        }
+    }
+
+    params = {.pid = pid, .uid = getLmkdTestUid(), .oomadj = new_oom_score,
+              .ptype = PROC_TYPE_APP};
+    batch_size = lmkd_pack_set_batch_header(batch, 0);
+    size = lmkd_pack_set_procprio(packet, &params);
+    batch_size = lmkd_pack_add_batch(batch, batch_size, packet, size);
+    size = lmkd_pack_set_getkillcnt(packet, &kill_cnt_req);
+    batch_size = lmkd_pack_add_batch(batch, batch_size, packet, size);
+    batch_size = lmkd_pack_add_batch(batch, batch_size, packet, size);
+    ASSERT_GT(batch_size, 0u);
+
+    SendBatch(batch, batch_size, replies, replies_size);
+    offset = LMK_BATCH_HEADER_SIZE;
+    while ((size = lmkd_pack_get_batch_next(replies, replies_size, &offset, packet)) > 0) {
+        EXPECT_EQ(lmkd_pack_get_cmd(packet), LMK_GETKILLCNT);
+        EXPECT_EQ(size, (int)(2 * sizeof(int)));
+        reply_count++;
+    }
+    EXPECT_EQ(size, 0) << "Malformed batch reply";
+    EXPECT_EQ(reply_count, 2);
+
+    std::string curr_oom_score;
+    ASSERT_TRUE(ReadFileToString("/proc/" + std::to_string(pid) + "/oom_score_adj",
+                                 &curr_oom_score));
+    kill(pid, SIGKILL);
+    ASSERT_EQ(atoi(curr_oom_score.c_str()), new_oom_score);
+}
+
+/*
+ * Verify that latency histograms of all memory pressure handling stages can be queried and that
+ * an unknown stage is rejected.
+ */
+TEST_F(LmkdTest, latency_histograms) {
+    struct lmk_getlatencyhist_reply reply;
+
+    for (int stage = 0; stage < LMK_LATENCY_STAGE_COUNT; stage++) {
+        ASSERT_EQ(GetLatencyHist((enum lmk_latency_stage)stage, &reply), GET_LATENCY_HIST_SUCCESS)
+                << "Failed fetching latency histogram of stage " << stage;
+        ASSERT_EQ(reply.stage, stage);
+    }
+
+    ASSERT_EQ(GetLatencyHist(LMK_LATENCY_STAGE_COUNT, &reply), GET_LATENCY_HIST_FORMAT_ERR)
+            << "Latency histogram of an unknown stage should not be reported";
+    ASSERT_EQ(reply.stage, -1);
+}
+
+/*
+ * Verify that the pressure snapshot can be mapped and read but not modified by clients.
+ */
+TEST_F(LmkdTest, pressure_snapshot) {
+    const struct lmk_pressure_snapshot* shared = MapPressureSnapshot();
+    struct lmk_pressure_snapshot snapshot;
+
+    ASSERT_NE(shared, nullptr) << "Failed mapping pressure snapshot, err=" << strerror(errno);
+    if (lmkd_read_pressure_snapshot(shared, &snapshot)) {
+        EXPECT_EQ(snapshot.version, (uint32_t)LMK_PRESSURE_SNAPSHOT_VERSION);
+        EXPECT_GE(snapshot.size, sizeof(snapshot));
+        EXPECT_EQ(snapshot.seq % 2, 0u);
+    }
+    EXPECT_NE(mprotect(const_cast<struct lmk_pressure_snapshot*>(shared), sizeof(*shared),
+                       PROT_READ | PROT_WRITE), 0)
+            << "Pressure snapshot should not be writable by clients";
+    lmkd_unmap_pressure_snapshot(shared);
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     InitLogging(argv, StderrLogger);